@@ -4,25 +4,15 @@
 #include "Utils.h"
 #include "Picture.h"
 #include "time.h"
-#include "thpool.h"
+#include "PicPool.h"
 
 /* ---------- definitions ---------- */
 #define NO_RGB_COMPONENTS 3
 #define BLUR_REGION_SIZE 9
 #define BILLION 1000000000.0
-#define NUM_THREADS 16
-struct task_args
+// the pictures a parallel blur reads from and writes to
+struct blur_args
 {
-  int i;
-  int j;
-  struct picture *input;
-  struct picture *output;
-};
-
-struct sector_args
-{
-  int i;
-  int j;
   struct picture *input;
   struct picture *output;
   int sector_size;
@@ -93,175 +83,117 @@ void blur_picture(struct picture *pic)
 
 /* column by column version */
 // helper function runs by child for column blur
-void *help_column_blur(struct task_args *args)
+void help_column_blur(int begin, int end, void *ctx)
 {
-  int i = args->i;
-  struct picture *input = args->input;
-  struct picture *output = args->output;
-  int height = output->height;
-
-  for (int j = 0; j < height; j++)
+  struct blur_args *args = ctx;
+  for (int i = begin; i < end; i++)
   {
-    calculate_new_blur_pixel(i, j, input, output);
+    for (int j = 0; j < args->output->height; j++)
+    {
+      calculate_new_blur_pixel(i, j, args->input, args->output);
+    }
   }
-
-  free(args);
-  return NULL;
 }
 
 void column_blur_picture(struct picture *pic)
 {
   struct picture tmp;
   init_picture_from_size(&tmp, pic->width, pic->height);
-  int height = tmp.height;
-  int width = tmp.width;
-  // init a thread pool
-  threadpool thpool = thpool_init(NUM_THREADS);
+  struct blur_args args = {pic, &tmp, 0};
+
+  // one column per task on the shared thread pool
+  thpool_parallel_for(get_picture_pool(), 0, tmp.width, 1, help_column_blur, &args);
 
-  for (int i = 0; i < width; i++)
-  {
-    struct task_args *args = malloc(sizeof(struct task_args));
-    args->i = i;
-    args->input = pic;
-    args->output = &tmp;
-    thpool_add_work(thpool, (void (*)(void *))help_column_blur, args);
-  }
   // cleaning up
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
 }
 
 /* row by row version */
 // helper function runs by child for row blur
-void *help_row_blur(struct task_args *args)
+void help_row_blur(int begin, int end, void *ctx)
 {
-  int j = args->j;
-  struct picture *input = args->input;
-  struct picture *output = args->output;
-  int width = output->width;
-
-  for (int i = 0; i < width; i++)
+  struct blur_args *args = ctx;
+  for (int j = begin; j < end; j++)
   {
-    calculate_new_blur_pixel(i, j, input, output);
+    for (int i = 0; i < args->output->width; i++)
+    {
+      calculate_new_blur_pixel(i, j, args->input, args->output);
+    }
   }
-
-  free(args);
-  return NULL;
 }
 
 void row_blur_picture(struct picture *pic)
 {
   struct picture tmp;
   init_picture_from_size(&tmp, pic->width, pic->height);
-  int height = tmp.height;
-  int width = tmp.width;
-  threadpool thpool = thpool_init(NUM_THREADS);
+  struct blur_args args = {pic, &tmp, 0};
+
+  thpool_parallel_for(get_picture_pool(), 0, tmp.height, 1, help_row_blur, &args);
 
-  for (int j = 0; j < height; j++)
-  {
-    struct task_args *args = malloc(sizeof(struct task_args));
-    args->j = j;
-    args->input = pic;
-    args->output = &tmp;
-    thpool_add_work(thpool, (void (*)(void *))help_row_blur, args);
-  }
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
 }
 
 /* pixel by pixel version */
 // helper function runs by child for parallel blur
-void *help_parallel_blur(struct task_args *args)
+void help_parallel_blur(int begin, int end, void *ctx)
 {
-  int i = args->i;
-  int j = args->j;
-  struct picture *input = args->input;
-  struct picture *output = args->output;
-
-  calculate_new_blur_pixel(i, j, input, output);
-
-  free(args);
-  return NULL;
+  struct blur_args *args = ctx;
+  int height = args->output->height;
+  for (int n = begin; n < end; n++)
+  {
+    calculate_new_blur_pixel(n / height, n % height, args->input, args->output);
+  }
 }
 
 void parallel_blur_picture(struct picture *pic)
 {
   struct picture tmp;
   init_picture_from_size(&tmp, pic->width, pic->height);
-  int height = tmp.height;
-  int width = tmp.width;
-  threadpool thpool = thpool_init(NUM_THREADS);
+  struct blur_args args = {pic, &tmp, 0};
+
+  // pixels are numbered column by column
+  thpool_parallel_for(get_picture_pool(), 0, tmp.width * tmp.height, 1, help_parallel_blur, &args);
 
-  for (int i = 0; i < width; i++)
-  {
-    for (int j = 0; j < height; j++)
-    {
-      struct task_args *args = malloc(sizeof(struct task_args));
-      args->i = i;
-      args->j = j;
-      args->input = pic;
-      args->output = &tmp;
-      thpool_add_work(thpool, (void (*)(void *))help_parallel_blur, args);
-    }
-  }
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
 }
 
 /* sector by sector version */
 // helper function runs by child for sector blur
-void *help_sector_blur(struct sector_args *args)
+void help_sector_blur(int begin, int end, void *ctx)
 {
-  int x = args->i;
-  int y = args->j;
-  struct picture *input = args->input;
+  struct blur_args *args = ctx;
   struct picture *output = args->output;
   int sector_size = args->sector_size;
+  int sectors_down = (output->height + sector_size - 1) / sector_size;
 
-  for (int i = x; i < x + sector_size; i++)
+  // sectors are numbered column by column
+  for (int n = begin; n < end; n++)
   {
-    for (int j = y; j < y + sector_size; j++)
+    int x = n / sectors_down * sector_size;
+    int y = n % sectors_down * sector_size;
+    for (int i = x; i < x + sector_size && i < output->width; i++)
     {
-      if (i >= 0 && i < output->width && j >= 0 && j < output->height)
+      for (int j = y; j < y + sector_size && j < output->height; j++)
       {
-        calculate_new_blur_pixel(i, j, input, output);
+        calculate_new_blur_pixel(i, j, args->input, output);
       }
     }
   }
-  free(args);
-  return NULL;
 }
 
 void sector_blur_picture(struct picture *pic, int sector_size)
 {
   struct picture tmp;
   init_picture_from_size(&tmp, pic->width, pic->height);
-  int height = tmp.height;
-  int width = tmp.width;
-  threadpool thpool = thpool_init(NUM_THREADS);
+  struct blur_args args = {pic, &tmp, sector_size};
+  int sectors_across = (tmp.width + sector_size - 1) / sector_size;
+  int sectors_down = (tmp.height + sector_size - 1) / sector_size;
 
-  for (int i = 0; i < width; i += sector_size)
-  {
-    for (int j = 0; j < height; j += sector_size)
-    {
+  thpool_parallel_for(get_picture_pool(), 0, sectors_across * sectors_down, 1, help_sector_blur, &args);
 
-      struct sector_args *args = malloc(sizeof(struct sector_args));
-      args->i = i;
-      args->j = j;
-      args->input = pic;
-      args->output = &tmp;
-      args->sector_size = sector_size;
-      thpool_add_work(thpool, (void (*)(void *))help_sector_blur, args);
-    }
-  }
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
 }
@@ -423,4 +355,5 @@ int main(int argc, char **argv)
     printf("----average time taken: %lf----\n", total / 3);
   }
 
+  shutdown_picture_pool();
 }
@@ -5,12 +5,1418 @@
 #include "Picture.h"
 #include "PicProcess.h"
 #include "PicStore.h"
+#include "PicPool.h"
 
-// ---------- MAIN PROGRAM ---------- \\
+// most arguments taken by a single interpreter command
+#define MAX_CMD_ARGS 2
+
+// command line flag that runs the whole script as a dependency graph
+#define BATCH_FLAG "--batch"
+
+// number of buckets the strand table starts with (a power of two)
+#define STRANDS_INITIAL_BUCKETS 64
+
+// number of buckets indexing the files loaded and saved by the interpreter
+#define FILE_BUCKETS 64
+
+// -------------- picture transformation function wrappers --------------
+
+bool rotate_picture_wrapper(struct picture *pic, const char *extra_arg)
+{
+  return rotate_picture(pic, atoi(extra_arg));
+}
+
+bool flip_picture_wrapper(struct picture *pic, const char *extra_arg)
+{
+  return flip_picture(pic, extra_arg[0]);
+}
+
+bool rotate_geometry_wrapper(const char *extra_arg, struct geometry *geom)
+{
+  return rotation_geometry(atoi(extra_arg), geom);
+}
+
+bool flip_geometry_wrapper(const char *extra_arg, struct geometry *geom)
+{
+  return flip_geometry(extra_arg[0], geom);
+}
+
+bool blur_picture_wrapper(struct picture *pic, const char *extra_arg)
+{
+  return blur_picture_n(pic, atoi(extra_arg));
+}
+
+// ------------------------------------------------------------------------
+
+// The ways a command can act on its picture
+enum cmd_kind
+{
+  // decode a file into the picture
+  LOAD,
+  // drop the picture
+  UNLOAD,
+  // encode the picture into a file
+  SAVE,
+  // change the picture's pixels in place
+  TRANSFORM,
+  // change the colour of every pixel on its own (runs of these share a single pass)
+  COLOUR,
+  // rotate or flip the picture (runs of these share a single copy)
+  GEOMETRY,
+  // blur the picture a number of times (runs of these share their sweeps)
+  BLUR
+};
+
+// The commands of the interpreter that act on a single named picture. Each
+// takes a fixed number of arguments, one of which names the picture.
+struct cmd_spec
+{
+  const char *name;
+  enum cmd_kind kind;
+  int no_args;
+  // index of the argument naming the picture
+  int name_arg;
+  // transformation applied to the picture (TRANSFORM and GEOMETRY), false if memory runs out
+  bool (*transform)(struct picture *, const char *);
+  // colour operation applied to the picture (COLOUR only)
+  enum colour_op op;
+  // look up the rotation or flip the command applies (GEOMETRY only)
+  bool (*geometry)(const char *, struct geometry *);
+  // first argument to use when only the others are given (NULL if it is required)
+  const char *default_arg;
+};
+
+// position of load in the look-up table (used to pre-load pictures)
+#define LOAD_CMD 0
+
+// list of all picture commands (liststore and exit are handled by the interpreter)
+static const struct cmd_spec cmd_specs[] = {
+    {.name = "load", .kind = LOAD, .no_args = 2, .name_arg = 1},
+    {.name = "unload", .kind = UNLOAD, .no_args = 1, .name_arg = 0},
+    {.name = "save", .kind = SAVE, .no_args = 2, .name_arg = 0},
+    {.name = "invert", .kind = COLOUR, .no_args = 1, .name_arg = 0, .op = INVERT_COLOURS},
+    {.name = "grayscale", .kind = COLOUR, .no_args = 1, .name_arg = 0, .op = GRAYSCALE_COLOURS},
+    {.name = "rotate", .kind = GEOMETRY, .no_args = 2, .name_arg = 1,
+     .transform = rotate_picture_wrapper, .geometry = rotate_geometry_wrapper},
+    {.name = "flip", .kind = GEOMETRY, .no_args = 2, .name_arg = 1,
+     .transform = flip_picture_wrapper, .geometry = flip_geometry_wrapper},
+    {.name = "blur", .kind = BLUR, .no_args = 2, .name_arg = 1,
+     .transform = blur_picture_wrapper, .default_arg = "1"}};
+
+// size of look-up table (for safe IO error reporting)
+static int no_of_cmds = sizeof(cmd_specs) / sizeof(cmd_specs[0]);
+
+// A parsed command waiting to run on its picture's strand
+struct command
+{
+  const struct cmd_spec *spec;
+  char *args[MAX_CMD_ARGS];
+  // next command on the strand, or next command of a fused run
+  struct command *next;
+  // strand the command is queued on
+  struct strand *strand;
+  // loads and saves only: the file the command reads or writes
+  struct file_entry *file;
+  // commands on the same file it still has to wait for
+  atomic_int waiting;
+  // commands on the same file waiting for this one (guarded by the interpreter lock)
+  struct command **successors;
+  int no_successors;
+  int successors_capacity;
+};
+
+// A strand runs the commands on one picture name one at a time, in the order
+// they were read, while strands of other names run alongside it on the pool.
+struct strand
+{
+  char *name;
+  pthread_mutex_t lock;
+  // commands not yet run (guarded by lock)
+  struct command *head;
+  struct command *tail;
+  // whether a job draining this strand has been handed to the pool (guarded by lock)
+  bool scheduled;
+  // next strand in the same bucket
+  struct strand *next;
+};
+
+// A file loaded or saved by the interpreter. Strands only keep the commands
+// on one picture in order, so a load waits for the last save into its file,
+// and a save for that and for every load from the file since.
+struct file_entry
+{
+  char *path;
+  // the last save into the file not yet finished, and the unfinished loads
+  // from it since then (guarded by the interpreter lock)
+  struct command *last_save;
+  struct command **loads;
+  int no_loads;
+  int loads_capacity;
+  // next file in the same bucket
+  struct file_entry *next;
+};
+
+// The interpreter's state. The strand and file tables are only touched by the
+// thread reading commands, while strands and files themselves are shared with the pool.
+struct interpreter
+{
+  struct pic_store store;
+  struct strand **strands;
+  size_t no_buckets;
+  size_t no_strands;
+  struct file_entry *files[FILE_BUCKETS];
+  // commands read but not yet finished (guarded by lock)
+  int in_flight;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+};
+
+// -------------------------- command execution --------------------------
+
+// apply a run of colour commands (linked through next) to a picture in a single pass
+static bool apply_colour_commands(struct picture *pic, struct command *cmds)
+{
+  int no_ops = 0;
+  for (struct command *cmd = cmds; cmd != NULL; cmd = cmd->next)
+  {
+    no_ops++;
+  }
+  enum colour_op ops[no_ops];
+  int i = 0;
+  for (struct command *cmd = cmds; cmd != NULL; cmd = cmd->next)
+  {
+    ops[i++] = cmd->spec->op;
+  }
+  return apply_colour_ops(pic, ops, no_ops);
+}
+
+// apply a run of rotate and flip commands (linked through next) to a picture in a single copy
+static bool apply_geometry_commands(struct picture *pic, struct command *cmds)
+{
+  struct geometry net = {false, false, false};
+  for (struct command *cmd = cmds; cmd != NULL; cmd = cmd->next)
+  {
+    struct geometry geom;
+    if (!cmd->spec->geometry(cmd->args[0], &geom))
+    {
+      // report the undefined rotation or flip (only ever alone in its run)
+      return cmd->spec->transform(pic, cmd->args[0]);
+    }
+    net = compose_geometry(net, geom);
+  }
+  return apply_geometry(pic, net);
+}
+
+// check if a command can join the run of commands ending with last
+// NOTE: runs of colour commands share a pass over the pixels, runs of
+//       (well-defined) rotations and flips share a single copy of them
+//       and runs of blurs share their sweeps
+static bool can_fuse(struct command *last, struct command *cmd)
+{
+  enum cmd_kind kind = last->spec->kind;
+  if (cmd->spec->kind != kind)
+  {
+    return false;
+  }
+  if (kind == GEOMETRY)
+  {
+    struct geometry geom;
+    return last->spec->geometry(last->args[0], &geom) && cmd->spec->geometry(cmd->args[0], &geom);
+  }
+  return kind == COLOUR || kind == BLUR;
+}
+
+// apply a run of blur commands (linked through next) to a picture in as few sweeps as possible
+static bool apply_blur_commands(struct picture *pic, struct command *cmds)
+{
+  int passes = 0;
+  for (struct command *cmd = cmds; cmd != NULL; cmd = cmd->next)
+  {
+    passes += atoi(cmd->args[0]);
+  }
+  return blur_picture_n(pic, passes);
+}
+
+// apply a fused run of commands (linked through next) to a picture, reporting
+// a run that ran out of memory
+static void apply_fused_commands(struct picture *pic, struct command *cmds)
+{
+  bool transformed;
+  switch (cmds->spec->kind)
+  {
+  case COLOUR:
+    transformed = apply_colour_commands(pic, cmds);
+    break;
+  case GEOMETRY:
+    transformed = apply_geometry_commands(pic, cmds);
+    break;
+  case BLUR:
+    transformed = apply_blur_commands(pic, cmds);
+    break;
+  default:
+    transformed = cmds->spec->transform(pic, cmds->args[0]);
+    break;
+  }
+  if (!transformed)
+  {
+    fprintf(get_report_stream(), "[!] could not allocate memory to %s picture %s\n", cmds->spec->name,
+            cmds->args[cmds->spec->name_arg]);
+  }
+}
+
+// report every command of a run that found no picture to act on
+static void report_missing_picture(struct command *cmds)
+{
+  for (struct command *cmd = cmds; cmd != NULL; cmd = cmd->next)
+  {
+    fprintf(get_report_stream(), "[!] no picture called %s is stored\n", cmd->args[cmd->spec->name_arg]);
+  }
+}
+
+// run a single command (or a fused run of colour commands) on the picture store
+static void run_command(struct pic_store *store, struct command *cmd)
+{
+  const struct cmd_spec *spec = cmd->spec;
+  const char *name = cmd->args[spec->name_arg];
+
+  switch (spec->kind)
+  {
+  case LOAD:
+    load_picture(store, cmd->args[0], name);
+    break;
+  case UNLOAD:
+    unload_picture(store, name);
+    break;
+  case SAVE:
+    save_picture(store, name, cmd->args[1]);
+    break;
+  default:
+  {
+    struct pic_entry *entry = acquire_picture(store, name);
+    if (entry == NULL)
+    {
+      report_missing_picture(cmd);
+      break;
+    }
+    struct picture *pic = lock_picture(entry, true);
+    if (pic != NULL)
+    {
+      apply_fused_commands(pic, cmd);
+      unlock_picture(entry);
+    }
+    release_picture(entry);
+    break;
+  }
+  }
+}
+
+// free a command (and any commands fused with it) and its arguments
+static void free_command(struct command *cmd)
+{
+  while (cmd != NULL)
+  {
+    struct command *next = cmd->next;
+    for (int i = 0; i < cmd->spec->no_args; i++)
+    {
+      free(cmd->args[i]);
+    }
+    free(cmd->successors);
+    free(cmd);
+    cmd = next;
+  }
+}
+
+// the interpreter a strand job belongs to
+static struct interpreter *interp;
+
+static void run_strand(void *arg);
+
+// append a command to a list of commands, growing it as needed
+static void push_command(struct command ***list, int *count, int *capacity, struct command *cmd)
+{
+  if (*count == *capacity)
+  {
+    *capacity = *capacity > 0 ? *capacity * 2 : 4;
+    *list = realloc(*list, *capacity * sizeof(struct command *));
+    if (*list == NULL)
+    {
+      printf("[!] could not allocate memory to order commands on a file\n");
+      exit(IO_ERROR);
+    }
+  }
+  (*list)[(*count)++] = cmd;
+}
+
+// make cmd wait for an unfinished command on the same file (if there is one)
+// NOTE: the caller must hold the interpreter lock
+static void wait_for_command(struct command *cmd, struct command *other)
+{
+  if (other != NULL)
+  {
+    push_command(&other->successors, &other->no_successors, &other->successors_capacity, cmd);
+    atomic_fetch_add(&cmd->waiting, 1);
+  }
+}
+
+// find the entry of a file path, creating it on first use
+static struct file_entry *get_file(const char *path)
+{
+  struct file_entry **link = &interp->files[hash_picture_name(path) % FILE_BUCKETS];
+  while (*link != NULL && strcmp((*link)->path, path))
+  {
+    link = &(*link)->next;
+  }
+  if (*link == NULL)
+  {
+    *link = calloc(1, sizeof(struct file_entry));
+    if (*link == NULL)
+    {
+      printf("[!] could not allocate memory for commands on %s\n", path);
+      exit(IO_ERROR);
+    }
+    (*link)->path = strdup(path);
+  }
+  return *link;
+}
+
+// order a load or save after the unfinished commands on its file that it has to follow
+static void order_file_command(struct command *cmd)
+{
+  bool save = cmd->spec->kind == SAVE;
+  cmd->file = get_file(cmd->args[save ? 1 : 0]);
+  struct file_entry *file = cmd->file;
+
+  pthread_mutex_lock(&interp->lock);
+  wait_for_command(cmd, file->last_save);
+  if (save)
+  {
+    for (int i = 0; i < file->no_loads; i++)
+    {
+      wait_for_command(cmd, file->loads[i]);
+    }
+    file->last_save = cmd;
+  }
+  else
+  {
+    push_command(&file->loads, &file->no_loads, &file->loads_capacity, cmd);
+  }
+  pthread_mutex_unlock(&interp->lock);
+}
+
+// start the strand of a command that no longer waits for anything, if the command holds it up
+static void resume_command(struct command *cmd)
+{
+  struct strand *strand = cmd->strand;
+  pthread_mutex_lock(&strand->lock);
+  bool start = !strand->scheduled && strand->head == cmd;
+  if (start)
+  {
+    strand->scheduled = true;
+  }
+  pthread_mutex_unlock(&strand->lock);
+  if (start)
+  {
+    thpool_add_work(get_picture_pool(), run_strand, strand);
+  }
+}
+
+// take a finished load or save off its file, letting the commands waiting for it go on
+static void finish_file_command(struct command *cmd)
+{
+  struct file_entry *file = cmd->file;
+  pthread_mutex_lock(&interp->lock);
+  if (file->last_save == cmd)
+  {
+    file->last_save = NULL;
+  }
+  for (int i = 0; i < file->no_loads; i++)
+  {
+    if (file->loads[i] == cmd)
+    {
+      file->loads[i] = file->loads[--file->no_loads];
+      break;
+    }
+  }
+  struct command **successors = cmd->successors;
+  int no_successors = cmd->no_successors;
+  cmd->successors = NULL;
+  cmd->no_successors = 0;
+  pthread_mutex_unlock(&interp->lock);
+
+  for (int i = 0; i < no_successors; i++)
+  {
+    if (atomic_fetch_sub(&successors[i]->waiting, 1) == 1)
+    {
+      resume_command(successors[i]);
+    }
+  }
+  free(successors);
+}
+
+// pool job running the next command of a strand
+// NOTE: the job hands itself back to the pool for every further command, so a
+//       long strand never keeps a thread from the other strands
+static void run_strand(void *arg)
+{
+  struct strand *strand = arg;
+
+  // take the next command, along with the commands queued right behind it that fuse with it
+  pthread_mutex_lock(&strand->lock);
+  struct command *cmd = strand->head;
+  if (atomic_load(&cmd->waiting) > 0)
+  {
+    // the last command it waits for on its file starts the strand again
+    strand->scheduled = false;
+    pthread_mutex_unlock(&strand->lock);
+    return;
+  }
+  struct command *last = cmd;
+  int no_cmds = 1;
+  while (last->next != NULL && can_fuse(last, last->next))
+  {
+    last = last->next;
+    no_cmds++;
+  }
+  strand->head = last->next;
+  if (strand->head == NULL)
+  {
+    strand->tail = NULL;
+  }
+  last->next = NULL;
+  pthread_mutex_unlock(&strand->lock);
+
+  run_command(&interp->store, cmd);
+  if (cmd->file != NULL)
+  {
+    finish_file_command(cmd);
+  }
+  free_command(cmd);
+
+  pthread_mutex_lock(&strand->lock);
+  bool more = strand->scheduled = strand->head != NULL;
+  pthread_mutex_unlock(&strand->lock);
+  if (more)
+  {
+    thpool_add_work(get_picture_pool(), run_strand, strand);
+  }
+
+  pthread_mutex_lock(&interp->lock);
+  interp->in_flight -= no_cmds;
+  if (interp->in_flight == 0)
+  {
+    pthread_cond_broadcast(&interp->idle);
+  }
+  pthread_mutex_unlock(&interp->lock);
+}
+
+// find the strand of a picture name, creating it on first use
+static struct strand *get_strand(const char *name)
+{
+  size_t hash = hash_picture_name(name);
+  struct strand **link = &interp->strands[hash & (interp->no_buckets - 1)];
+  while (*link != NULL && strcmp((*link)->name, name))
+  {
+    link = &(*link)->next;
+  }
+  if (*link != NULL)
+  {
+    return *link;
+  }
+
+  struct strand *strand = malloc(sizeof(struct strand));
+  if (strand == NULL)
+  {
+    printf("[!] could not allocate memory for commands on %s\n", name);
+    exit(IO_ERROR);
+  }
+  strand->name = strdup(name);
+  pthread_mutex_init(&strand->lock, NULL);
+  strand->head = NULL;
+  strand->tail = NULL;
+  strand->scheduled = false;
+  strand->next = NULL;
+  *link = strand;
+
+  // keep chains short as more names are used
+  if (++interp->no_strands > interp->no_buckets * 2)
+  {
+    size_t no_buckets = interp->no_buckets * 2;
+    struct strand **strands = calloc(no_buckets, sizeof(struct strand *));
+    if (strands != NULL)
+    {
+      for (size_t i = 0; i < interp->no_buckets; i++)
+      {
+        struct strand *s = interp->strands[i];
+        while (s != NULL)
+        {
+          struct strand *next = s->next;
+          struct strand **head = &strands[hash_picture_name(s->name) & (no_buckets - 1)];
+          s->next = *head;
+          *head = s;
+          s = next;
+        }
+      }
+      free(interp->strands);
+      interp->strands = strands;
+      interp->no_buckets = no_buckets;
+    }
+  }
+  return strand;
+}
+
+// queue a command on its picture's strand, starting the strand if it is idle
+static void dispatch_command(struct command *cmd)
+{
+  struct strand *strand = get_strand(cmd->args[cmd->spec->name_arg]);
+  cmd->strand = strand;
+  if (cmd->spec->kind == LOAD || cmd->spec->kind == SAVE)
+  {
+    order_file_command(cmd);
+  }
+
+  pthread_mutex_lock(&interp->lock);
+  interp->in_flight++;
+  pthread_mutex_unlock(&interp->lock);
+
+  pthread_mutex_lock(&strand->lock);
+  cmd->next = NULL;
+  if (strand->tail != NULL)
+  {
+    strand->tail->next = cmd;
+  }
+  else
+  {
+    strand->head = cmd;
+  }
+  strand->tail = cmd;
+  bool start = !strand->scheduled;
+  strand->scheduled = true;
+  pthread_mutex_unlock(&strand->lock);
+  if (start)
+  {
+    thpool_add_work(get_picture_pool(), run_strand, strand);
+  }
+}
+
+// wait for every command read so far to finish
+static void drain_commands(void)
+{
+  pthread_mutex_lock(&interp->lock);
+  while (interp->in_flight > 0)
+  {
+    pthread_cond_wait(&interp->idle, &interp->lock);
+  }
+  pthread_mutex_unlock(&interp->lock);
+}
+
+// ------------------------------ interpreter -----------------------------
+
+// make a command from its specification and (copies of) its arguments
+// NOTE: returns NULL (after reporting why) if there is no memory for it
+static struct command *new_command(const struct cmd_spec *spec, char **args)
+{
+  struct command *cmd = malloc(sizeof(struct command));
+  if (cmd == NULL)
+  {
+    printf("[!] could not allocate memory for command %s\n", spec->name);
+    return NULL;
+  }
+  cmd->spec = spec;
+  cmd->next = NULL;
+  cmd->strand = NULL;
+  cmd->file = NULL;
+  atomic_init(&cmd->waiting, 0);
+  cmd->successors = NULL;
+  cmd->no_successors = 0;
+  cmd->successors_capacity = 0;
+  for (int i = 0; i < spec->no_args; i++)
+  {
+    cmd->args[i] = strdup(args[i]);
+  }
+  return cmd;
+}
+
+// parse a line of input into a command
+// NOTE: returns NULL (after reporting why) if the line is not a valid command
+static struct command *parse_command(char *cmd_name, char *saveptr)
+{
+  int cmd_no = 0;
+  while (cmd_no < no_of_cmds && strcmp(cmd_name, cmd_specs[cmd_no].name))
+  {
+    cmd_no++;
+  }
+
+  // IO error check
+  if (cmd_no == no_of_cmds)
+  {
+    fprintf(get_report_stream(), "[!] invalid command requested: %s is not defined\n", cmd_name);
+    return NULL;
+  }
+
+  const struct cmd_spec *spec = &cmd_specs[cmd_no];
+  char *args[MAX_CMD_ARGS];
+  for (int i = 0; i < spec->no_args; i++)
+  {
+    args[i] = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (args[i] != NULL)
+    {
+      continue;
+    }
+
+    // an optional first argument was left out: shift the others along
+    if (i == spec->no_args - 1 && spec->default_arg != NULL)
+    {
+      for (int j = i; j > 0; j--)
+      {
+        args[j] = args[j - 1];
+      }
+      args[0] = (char *)spec->default_arg;
+      break;
+    }
+    fprintf(get_report_stream(), "[!] insufficient arguments provided to %s\n", spec->name);
+    return NULL;
+  }
+
+  if (spec->kind == BLUR && atoi(args[0]) < 1)
+  {
+    fprintf(get_report_stream(), "[!] blur is undefined for %s passes (must be at least 1)\n", args[0]);
+    return NULL;
+  }
+
+  // reject a bad angle or plane here, as running it would end the whole interpreter
+  struct geometry geom;
+  if (spec->kind == GEOMETRY && !spec->geometry(args[0], &geom))
+  {
+    if (spec->geometry == rotate_geometry_wrapper)
+    {
+      fprintf(get_report_stream(), "[!] rotate is undefined for angle %s (must be 90, 180 or 270)\n", args[0]);
+    }
+    else
+    {
+      fprintf(get_report_stream(), "[!] flip is undefined for plane %s (must be H or V)\n", args[0]);
+    }
+    return NULL;
+  }
+
+  return new_command(spec, args);
+}
+
+// name a picture loaded from the command line after its file (without directory or extension)
+static char *picture_name_from_path(const char *path)
+{
+  const char *base = strrchr(path, '/');
+  char *name = strdup(base != NULL ? base + 1 : path);
+  char *ext = strrchr(name, '.');
+  if (ext != NULL && ext != name)
+  {
+    *ext = '\0';
+  }
+  return name;
+}
+
+// release the interpreter's resources, once all its commands have finished
+static void clear_interpreter(void)
+{
+  for (size_t i = 0; i < interp->no_buckets; i++)
+  {
+    struct strand *strand = interp->strands[i];
+    while (strand != NULL)
+    {
+      struct strand *next = strand->next;
+      pthread_mutex_destroy(&strand->lock);
+      free(strand->name);
+      free(strand);
+      strand = next;
+    }
+  }
+  free(interp->strands);
+  for (int i = 0; i < FILE_BUCKETS; i++)
+  {
+    struct file_entry *file = interp->files[i];
+    while (file != NULL)
+    {
+      struct file_entry *next = file->next;
+      free(file->loads);
+      free(file->path);
+      free(file);
+      file = next;
+    }
+  }
+  clear_picstore(&interp->store);
+  pthread_mutex_destroy(&interp->lock);
+  pthread_cond_destroy(&interp->idle);
+}
+
+// ---------------------------- batch execution ----------------------------
+
+// A growable list of graph nodes
+struct node_list
+{
+  struct batch_node **nodes;
+  int count;
+  int capacity;
+};
+
+// One version of a named picture: the picture a load creates, up to the
+// unload or reload that ends it. Different versions of a name are separate
+// pictures, so the commands on one never wait for those on another.
+struct version
+{
+  char *name;
+  struct picture pic;
+  // whether the picture holds a loaded image (only touched by the version's nodes)
+  bool loaded;
+  // bytes the picture's pixels take up, set by its load
+  size_t bytes;
+  // version this one replaces, whose picture it keeps if its own load fails
+  struct version *prev;
+  // graph building only: the load starting the version, the last node changing
+  // it, the nodes reading it since then and the listings it appears in
+  struct batch_node *load;
+  struct batch_node *last_write;
+  struct node_list readers;
+  struct node_list listers;
+  // next version created (for clean-up)
+  struct version *next;
+};
+
+// A node of the dependency graph: a command of the script, or a listing of
+// the store, that runs once every node it depends on has finished
+struct batch_node
+{
+  // command to run (NULL for a listing)
+  struct command *cmd;
+  // version the command acts on (NULL if no picture has the name)
+  struct version *version;
+  // versions a listing includes if they hold a loaded image
+  struct version **listed;
+  int no_listed;
+  // reports the command printed, held until the outputs before them are out
+  char *reports;
+  size_t reports_size;
+  // node printing this one's reports, or the node whose reports this one prints
+  struct batch_node *report;
+  struct batch_node *reported;
+  // dependencies not yet finished, plus one until the node is released to run
+  atomic_int waiting;
+  // nodes depending on this one
+  struct node_list successors;
+};
+
+// A picture name or file path used by the script
+struct batch_key
+{
+  char *key;
+  // names only: the version currently under the name (NULL after an unload)
+  struct version *current;
+  // paths only: the last save into the file and the loads from it since then
+  struct batch_node *last_save;
+  struct node_list loads;
+  // next key in the same bucket
+  struct batch_key *next;
+};
+
+// A hash table of names or paths
+struct key_table
+{
+  struct batch_key **buckets;
+  size_t no_buckets;
+  size_t size;
+};
+
+// The dependency graph of a whole script
+struct batch
+{
+  struct key_table names;
+  struct key_table paths;
+  // every node, in script order
+  struct node_list nodes;
+  // listings and the reports of commands print in script order, so each waits
+  // for the one before it
+  struct batch_node *last_output;
+  struct version *versions;
+};
+
+// append a node to a list
+static void push_node(struct node_list *list, struct batch_node *node)
+{
+  if (list->count == list->capacity)
+  {
+    list->capacity = list->capacity > 0 ? list->capacity * 2 : 4;
+    list->nodes = realloc(list->nodes, list->capacity * sizeof(struct batch_node *));
+    if (list->nodes == NULL)
+    {
+      printf("[!] could not allocate memory for the command graph\n");
+      exit(IO_ERROR);
+    }
+  }
+  list->nodes[list->count++] = node;
+}
+
+// find the entry of a name or path in a table, creating it on first use
+static struct batch_key *get_key(struct key_table *table, const char *key)
+{
+  struct batch_key **link = &table->buckets[hash_picture_name(key) & (table->no_buckets - 1)];
+  while (*link != NULL && strcmp((*link)->key, key))
+  {
+    link = &(*link)->next;
+  }
+  if (*link != NULL)
+  {
+    return *link;
+  }
+
+  struct batch_key *entry = calloc(1, sizeof(struct batch_key));
+  if (entry == NULL)
+  {
+    printf("[!] could not allocate memory for the command graph\n");
+    exit(IO_ERROR);
+  }
+  entry->key = strdup(key);
+  *link = entry;
+
+  // keep chains short as more keys are used
+  if (++table->size > table->no_buckets * 2)
+  {
+    size_t no_buckets = table->no_buckets * 2;
+    struct batch_key **buckets = calloc(no_buckets, sizeof(struct batch_key *));
+    if (buckets != NULL)
+    {
+      for (size_t i = 0; i < table->no_buckets; i++)
+      {
+        struct batch_key *k = table->buckets[i];
+        while (k != NULL)
+        {
+          struct batch_key *next = k->next;
+          struct batch_key **head = &buckets[hash_picture_name(k->key) & (no_buckets - 1)];
+          k->next = *head;
+          *head = k;
+          k = next;
+        }
+      }
+      free(table->buckets);
+      table->buckets = buckets;
+      table->no_buckets = no_buckets;
+    }
+  }
+  return entry;
+}
+
+// add a node to the graph (held back from running until the graph is complete)
+static struct batch_node *new_node(struct batch *batch, struct command *cmd, struct version *version)
+{
+  struct batch_node *node = calloc(1, sizeof(struct batch_node));
+  if (node == NULL)
+  {
+    printf("[!] could not allocate memory for the command graph\n");
+    exit(IO_ERROR);
+  }
+  node->cmd = cmd;
+  node->version = version;
+  atomic_init(&node->waiting, 1);
+  push_node(&batch->nodes, node);
+  return node;
+}
+
+// make node wait for another one to finish (if there is one)
+static void depend_on(struct batch_node *node, struct batch_node *other)
+{
+  if (other != NULL && other != node)
+  {
+    push_node(&other->successors, node);
+    atomic_fetch_add(&node->waiting, 1);
+  }
+}
+
+// make node wait for every node of a list to finish, then empty the list
+static void depend_on_all(struct batch_node *node, struct node_list *list)
+{
+  for (int i = 0; i < list->count; i++)
+  {
+    depend_on(node, list->nodes[i]);
+  }
+  list->count = 0;
+}
+
+// make node wait for every node using a version so far
+static void depend_on_version(struct batch_node *node, struct version *version)
+{
+  depend_on(node, version->last_write);
+  depend_on_all(node, &version->readers);
+  depend_on_all(node, &version->listers);
+}
+
+// add a node printing the reports of a command once it has run and the outputs
+// before it are out, so errors print where the interactive interpreter prints them
+static void add_report(struct batch *batch, struct batch_node *node)
+{
+  struct batch_node *report = new_node(batch, NULL, NULL);
+  report->reported = node;
+  node->report = report;
+  depend_on(report, node);
+  depend_on(report, batch->last_output);
+  batch->last_output = report;
+}
+
+// add a node printing reports collected while building the graph, in order
+static void add_reports(struct batch *batch, char *reports, size_t reports_size)
+{
+  struct batch_node *node = new_node(batch, NULL, NULL);
+  node->reports = reports;
+  node->reports_size = reports_size;
+  node->reported = node;
+  depend_on(node, batch->last_output);
+  batch->last_output = node;
+}
+
+// add a command of the script to the graph
+// NOTE: a command only waits for earlier commands on the same version of its
+//       picture, and for earlier commands on the same file
+static void add_command(struct batch *batch, struct command *cmd)
+{
+  const struct cmd_spec *spec = cmd->spec;
+  struct batch_key *name = get_key(&batch->names, cmd->args[spec->name_arg]);
+  struct version *version = name->current;
+
+  if (spec->kind == LOAD)
+  {
+    // a load starts a new version, taking over from any version still under the name
+    struct version *loaded = calloc(1, sizeof(struct version));
+    if (loaded == NULL)
+    {
+      printf("[!] could not allocate memory for the command graph\n");
+      exit(IO_ERROR);
+    }
+    loaded->name = name->key;
+    loaded->prev = version;
+    loaded->next = batch->versions;
+    batch->versions = loaded;
+
+    struct batch_node *node = new_node(batch, cmd, loaded);
+    if (version != NULL)
+    {
+      depend_on_version(node, version);
+    }
+    struct batch_key *path = get_key(&batch->paths, cmd->args[0]);
+    depend_on(node, path->last_save);
+    push_node(&path->loads, node);
+    add_report(batch, node);
+
+    loaded->load = node;
+    loaded->last_write = node;
+    name->current = loaded;
+    return;
+  }
+
+  // a command right after one it fuses with on the same version joins its run,
+  // unless something printed since (its reports would come out too early)
+  // NOTE: nothing else can depend on that node yet while no reader follows it
+  if (version != NULL && version->readers.count == 0 && version->last_write->report == batch->last_output)
+  {
+    struct command *tail = version->last_write->cmd;
+    while (tail->next != NULL)
+    {
+      tail = tail->next;
+    }
+    if (can_fuse(tail, cmd))
+    {
+      tail->next = cmd;
+      return;
+    }
+  }
+
+  struct batch_node *node = new_node(batch, cmd, version);
+  if (version == NULL)
+  {
+    // the command only reports the missing picture
+    depend_on(node, batch->last_output);
+    batch->last_output = node;
+    return;
+  }
+
+  switch (spec->kind)
+  {
+  case UNLOAD:
+    depend_on_version(node, version);
+    name->current = NULL;
+    break;
+  case SAVE:
+  {
+    struct batch_key *path = get_key(&batch->paths, cmd->args[1]);
+    depend_on(node, version->last_write);
+    depend_on(node, path->last_save);
+    depend_on_all(node, &path->loads);
+    push_node(&version->readers, node);
+    path->last_save = node;
+    break;
+  }
+  default:
+    depend_on(node, version->last_write);
+    depend_on_all(node, &version->readers);
+    version->last_write = node;
+    break;
+  }
+  add_report(batch, node);
+}
+
+// add a listing of the store to the graph, covering every version under a name so far
+static void add_listing(struct batch *batch)
+{
+  struct batch_node *node = new_node(batch, NULL, NULL);
+  depend_on(node, batch->last_output);
+  batch->last_output = node;
+
+  node->listed = malloc((batch->names.size + 1) * sizeof(struct version *));
+  if (node->listed == NULL)
+  {
+    printf("[!] could not allocate memory for the command graph\n");
+    exit(IO_ERROR);
+  }
+  for (size_t i = 0; i < batch->names.no_buckets; i++)
+  {
+    for (struct batch_key *name = batch->names.buckets[i]; name != NULL; name = name->next)
+    {
+      struct version *version = name->current;
+      if (version != NULL)
+      {
+        // only the load decides whether the version is listed
+        depend_on(node, version->load);
+        push_node(&version->listers, node);
+        node->listed[node->no_listed++] = version;
+      }
+    }
+  }
+}
+
+// run the command (or listing) of a node
+static void execute_node(struct batch_node *node)
+{
+  struct version *version = node->version;
+
+  if (node->reported != NULL)
+  {
+    fwrite(node->reported->reports, 1, node->reported->reports_size, stdout);
+    return;
+  }
+
+  if (node->cmd == NULL)
+  {
+    // batch pictures are never spilled, as they live outside the store
+    struct pic_listing listing[node->no_listed + 1];
+    size_t count = 0;
+    for (int i = 0; i < node->no_listed; i++)
+    {
+      struct version *listed = node->listed[i];
+      if (listed->loaded)
+      {
+        listing[count++] = (struct pic_listing){listed->name, false, listed->bytes};
+      }
+    }
+    print_picture_listing(listing, count);
+    return;
+  }
+
+  const struct cmd_spec *spec = node->cmd->spec;
+  if (spec->kind == LOAD)
+  {
+    version->loaded = init_picture_from_cache(&version->pic, node->cmd->args[0]);
+    struct version *prev = version->prev;
+    if (prev != NULL && prev->loaded)
+    {
+      // a failed load leaves the picture already under the name in place
+      if (version->loaded)
+      {
+        clear_picture(&prev->pic);
+      }
+      else
+      {
+        version->pic = prev->pic;
+        version->loaded = true;
+      }
+      prev->loaded = false;
+    }
+    if (version->loaded)
+    {
+      version->bytes = get_picture_size(&version->pic);
+    }
+    return;
+  }
+
+  if (version == NULL || !version->loaded)
+  {
+    report_missing_picture(node->cmd);
+    return;
+  }
+
+  switch (spec->kind)
+  {
+  case UNLOAD:
+    clear_picture(&version->pic);
+    version->loaded = false;
+    break;
+  case SAVE:
+    save_picture_to_file(&version->pic, node->cmd->args[1]);
+    break;
+  default:
+    apply_fused_commands(&version->pic, node->cmd);
+    break;
+  }
+}
+
+// pool job running a node, then releasing the nodes that were only waiting for it
+static void run_node(void *arg)
+{
+  struct batch_node *node = arg;
+  // a command's reports are collected for its report node to print in order
+  FILE *reports = NULL;
+  if (node->cmd != NULL && node->version != NULL)
+  {
+    reports = open_memstream(&node->reports, &node->reports_size);
+    set_report_stream(reports);
+  }
+  execute_node(node);
+  if (reports != NULL)
+  {
+    set_report_stream(NULL);
+    fclose(reports);
+  }
+
+  for (int i = 0; i < node->successors.count; i++)
+  {
+    struct batch_node *next = node->successors.nodes[i];
+    if (atomic_fetch_sub(&next->waiting, 1) == 1)
+    {
+      thpool_add_work(get_picture_pool(), run_node, next);
+    }
+  }
+}
+
+// initialise an empty key table
+static void init_key_table(struct key_table *table)
+{
+  table->no_buckets = STRANDS_INITIAL_BUCKETS;
+  table->size = 0;
+  table->buckets = calloc(table->no_buckets, sizeof(struct batch_key *));
+  if (table->buckets == NULL)
+  {
+    printf("[!] could not allocate memory for the command graph\n");
+    exit(IO_ERROR);
+  }
+}
+
+// free a key table and its keys
+static void clear_key_table(struct key_table *table)
+{
+  for (size_t i = 0; i < table->no_buckets; i++)
+  {
+    struct batch_key *key = table->buckets[i];
+    while (key != NULL)
+    {
+      struct batch_key *next = key->next;
+      free(key->loads.nodes);
+      free(key->key);
+      free(key);
+      key = next;
+    }
+  }
+  free(table->buckets);
+}
+
+// parse a whole script (after the given pre-loads) into a dependency graph, then run
+// it on the pool, each command starting as soon as the commands it depends on are done
+static void run_batch(int no_preloads, char **preloads)
+{
+  struct batch batch = {0};
+  init_key_table(&batch.names);
+  init_key_table(&batch.paths);
+
+  for (int i = 0; i < no_preloads; i++)
+  {
+    char *args[MAX_CMD_ARGS] = {preloads[i], picture_name_from_path(preloads[i])};
+    struct command *cmd = new_command(&cmd_specs[LOAD_CMD], args);
+    if (cmd != NULL)
+    {
+      add_command(&batch, cmd);
+    }
+    free(args[1]);
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, stdin) != -1)
+  {
+    char *saveptr;
+    char *cmd_name = strtok_r(line, " \t\r\n", &saveptr);
+
+    // skip empty lines
+    if (cmd_name == NULL)
+    {
+      continue;
+    }
+
+    if (!strcmp(cmd_name, "exit"))
+    {
+      break;
+    }
+
+    if (!strcmp(cmd_name, "liststore"))
+    {
+      add_listing(&batch);
+      continue;
+    }
+
+    // a line the parser rejects reports where the script has it as well
+    char *reports = NULL;
+    size_t reports_size = 0;
+    FILE *stream = open_memstream(&reports, &reports_size);
+    set_report_stream(stream);
+    struct command *cmd = parse_command(cmd_name, saveptr);
+    set_report_stream(NULL);
+    if (stream != NULL)
+    {
+      fclose(stream);
+    }
+    if (reports_size > 0)
+    {
+      add_reports(&batch, reports, reports_size);
+    }
+    else
+    {
+      free(reports);
+    }
+    if (cmd != NULL)
+    {
+      add_command(&batch, cmd);
+    }
+  }
+  free(line);
+
+  // release every node to run, starting those with nothing left to wait for
+  threadpool pool = get_picture_pool();
+  for (int i = 0; i < batch.nodes.count; i++)
+  {
+    struct batch_node *node = batch.nodes.nodes[i];
+    if (atomic_fetch_sub(&node->waiting, 1) == 1)
+    {
+      thpool_add_work(pool, run_node, node);
+    }
+  }
+  thpool_wait(pool);
+
+  // clean up the graph and whatever pictures are still loaded
+  for (int i = 0; i < batch.nodes.count; i++)
+  {
+    struct batch_node *node = batch.nodes.nodes[i];
+    if (node->cmd != NULL)
+    {
+      free_command(node->cmd);
+    }
+    free(node->listed);
+    free(node->reports);
+    free(node->successors.nodes);
+    free(node);
+  }
+  free(batch.nodes.nodes);
+  while (batch.versions != NULL)
+  {
+    struct version *next = batch.versions->next;
+    if (batch.versions->loaded)
+    {
+      clear_picture(&batch.versions->pic);
+    }
+    free(batch.versions->readers.nodes);
+    free(batch.versions->listers.nodes);
+    free(batch.versions);
+    batch.versions = next;
+  }
+  clear_key_table(&batch.names);
+  clear_key_table(&batch.paths);
+}
+
+// ---------- MAIN PROGRAM ----------
 
 int main(int argc, char **argv)
 {
 
   printf("Running the Interactive C Picture Processing Library... \n");
-  // TODO: implement the interactive command-line interpreter for the Optional Extension
+
+  // run the whole script as a dependency graph instead if requested
+  if (argc > 1 && !strcmp(argv[1], BATCH_FLAG))
+  {
+    run_batch(argc - 2, argv + 2);
+    shutdown_picture_pool();
+    clear_picture_cache();
+    return 0;
+  }
+
+  struct interpreter state;
+  interp = &state;
+  init_picstore(&state.store);
+  state.no_buckets = STRANDS_INITIAL_BUCKETS;
+  state.no_strands = 0;
+  state.strands = calloc(state.no_buckets, sizeof(struct strand *));
+  memset(state.files, 0, sizeof(state.files));
+  state.in_flight = 0;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.idle, NULL);
+  if (state.strands == NULL)
+  {
+    printf("[!] could not allocate memory for the interpreter\n");
+    exit(IO_ERROR);
+  }
+
+  // pre-load the pictures given on the command line as ordinary load commands,
+  // so they decode in parallel and only commands on a picture still loading wait
+  for (int i = 1; i < argc; i++)
+  {
+    char *args[MAX_CMD_ARGS] = {argv[i], picture_name_from_path(argv[i])};
+    struct command *cmd = new_command(&cmd_specs[LOAD_CMD], args);
+    if (cmd != NULL)
+    {
+      dispatch_command(cmd);
+    }
+    free(args[1]);
+  }
+
+  // read and dispatch commands until exit (or the end of input)
+  char *line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, stdin) != -1)
+  {
+    char *saveptr;
+    char *cmd_name = strtok_r(line, " \t\r\n", &saveptr);
+
+    // skip empty lines
+    if (cmd_name == NULL)
+    {
+      continue;
+    }
+
+    if (!strcmp(cmd_name, "exit"))
+    {
+      break;
+    }
+
+    // the listing reflects every command read before it
+    if (!strcmp(cmd_name, "liststore"))
+    {
+      drain_commands();
+      print_picstore(&state.store);
+      continue;
+    }
+
+    struct command *cmd = parse_command(cmd_name, saveptr);
+    if (cmd != NULL)
+    {
+      dispatch_command(cmd);
+    }
+  }
+  free(line);
+
+  // let all in-flight work finish before shutting down
+  drain_commands();
+  shutdown_picture_pool();
+  clear_interpreter();
+  clear_picture_cache();
+  return 0;
 }
@@ -0,0 +1,343 @@
+#include "PicCache.h"
+#include <pthread.h>
+#include <string.h>
+
+// pixels that may be shared, indexed by the hash of their path
+static struct pic_pixels *indexed[PICCACHE_BUCKETS];
+
+// pixels the cache holds, from the most to the least recently used, and their total size
+static struct pic_pixels *newest = NULL;
+static struct pic_pixels *oldest = NULL;
+static size_t cached_bytes = 0;
+
+// bytes the cached pixels may take up (read from the environment on first use)
+static size_t cache_budget = 0;
+static bool cache_budget_chosen = false;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// signalled when pixels being decoded are ready (or failed)
+static pthread_cond_t cache_ready = PTHREAD_COND_INITIALIZER;
+
+// work out the cache's memory budget from the environment
+// NOTE: the caller must hold cache_lock
+static void choose_cache_budget(void)
+{
+  if (!cache_budget_chosen)
+  {
+    const char *env = getenv(PICCACHE_BUDGET_ENV);
+    cache_budget = env != NULL ? parse_byte_size(env) : PICCACHE_DEFAULT_BUDGET;
+    cache_budget_chosen = true;
+  }
+}
+
+// link pointing at the indexed pixels decoded from a file as it is now (or at the end of the chain)
+// NOTE: the caller must hold cache_lock
+static struct pic_pixels **find_pixels(const char *path, const struct stat *info)
+{
+  struct pic_pixels **link = &indexed[hash_picture_name(path) % PICCACHE_BUCKETS];
+  while (*link != NULL && (strcmp((*link)->path, path) || (*link)->file_size != info->st_size ||
+                           (*link)->file_mtime.tv_sec != info->st_mtim.tv_sec ||
+                           (*link)->file_mtime.tv_nsec != info->st_mtim.tv_nsec))
+  {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// stop later loads from sharing some pixels
+// NOTE: the caller must hold cache_lock
+static void unindex_pixels(struct pic_pixels *pixels)
+{
+  if (pixels->path == NULL)
+  {
+    return;
+  }
+  struct pic_pixels **link = &indexed[hash_picture_name(pixels->path) % PICCACHE_BUCKETS];
+  while (*link != pixels)
+  {
+    link = &(*link)->next;
+  }
+  *link = pixels->next;
+  free(pixels->path);
+  pixels->path = NULL;
+}
+
+// make pixels the cache's most recently used ones
+// NOTE: the caller must hold cache_lock
+static void push_newest(struct pic_pixels *pixels)
+{
+  pixels->newer = NULL;
+  pixels->older = newest;
+  if (newest != NULL)
+  {
+    newest->newer = pixels;
+  }
+  newest = pixels;
+  if (oldest == NULL)
+  {
+    oldest = pixels;
+  }
+}
+
+// take pixels out of the cache's order of use
+// NOTE: the caller must hold cache_lock
+static void unlink_pixels(struct pic_pixels *pixels)
+{
+  *(pixels->newer != NULL ? &pixels->newer->older : &newest) = pixels->older;
+  *(pixels->older != NULL ? &pixels->older->newer : &oldest) = pixels->newer;
+}
+
+// drop the cache's reference to some pixels, returning whether nothing else uses them
+// NOTE: the caller must hold cache_lock, and free the pixels if they are unused
+static bool uncache_pixels(struct pic_pixels *pixels)
+{
+  unlink_pixels(pixels);
+  pixels->cached = false;
+  cached_bytes -= pixels->bytes;
+  if (pixels->refs > 0)
+  {
+    return false;
+  }
+  unindex_pixels(pixels);
+  return true;
+}
+
+// drop the least recently used pixels until the cache fits its budget,
+// returning the ones nothing else uses (chained through next) to be freed
+// NOTE: the caller must hold cache_lock
+static struct pic_pixels *trim_cache(size_t budget)
+{
+  struct pic_pixels *unused = NULL;
+  while (oldest != NULL && cached_bytes > budget)
+  {
+    struct pic_pixels *pixels = oldest;
+    if (uncache_pixels(pixels))
+    {
+      pixels->next = unused;
+      unused = pixels;
+    }
+  }
+  return unused;
+}
+
+// free a chain of unused pixels (as returned by trim_cache())
+static void free_pixels(struct pic_pixels *unused)
+{
+  while (unused != NULL)
+  {
+    struct pic_pixels *next = unused->next;
+    clear_picture(&unused->pic);
+    free(unused);
+    unused = next;
+  }
+}
+
+struct pic_pixels *new_pixels(struct picture *pic)
+{
+  struct pic_pixels *pixels = malloc(sizeof(struct pic_pixels));
+  if (pixels == NULL)
+  {
+    return NULL;
+  }
+  pixels->pic = *pic;
+  pixels->bytes = get_picture_size(pic);
+  pixels->refs = 1;
+  atomic_init(&pixels->stored, 0);
+  pixels->path = NULL;
+  pixels->ready = true;
+  pixels->cached = false;
+  pixels->next = NULL;
+  return pixels;
+}
+
+// decode the file at path into pixels that are never shared
+static struct pic_pixels *decode_pixels(const char *path)
+{
+  struct picture pic;
+  if (!init_picture_from_file(&pic, path))
+  {
+    return NULL;
+  }
+  struct pic_pixels *pixels = new_pixels(&pic);
+  if (pixels == NULL)
+  {
+    fprintf(get_report_stream(), "[!] could not allocate memory for the picture at %s\n", path);
+    clear_picture(&pic);
+  }
+  return pixels;
+}
+
+struct pic_pixels *load_pixels(const char *path)
+{
+  struct stat info;
+  if (stat(path, &info) != 0)
+  {
+    // let the decoder report the unreadable file
+    return decode_pixels(path);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  choose_cache_budget();
+  struct pic_pixels *pixels;
+  while ((pixels = *find_pixels(path, &info)) != NULL && !pixels->ready)
+  {
+    pthread_cond_wait(&cache_ready, &cache_lock);
+  }
+  if (pixels != NULL)
+  {
+    pixels->refs++;
+    if (pixels->cached)
+    {
+      unlink_pixels(pixels);
+      push_newest(pixels);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return pixels;
+  }
+
+  // index the pixels before decoding, so loads of the file meanwhile wait for them
+  pixels = malloc(sizeof(struct pic_pixels));
+  char *indexed_path = strdup(path);
+  if (pixels == NULL || indexed_path == NULL)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    free(pixels);
+    free(indexed_path);
+    return decode_pixels(path);
+  }
+  pixels->refs = 1;
+  atomic_init(&pixels->stored, 0);
+  pixels->path = indexed_path;
+  pixels->file_size = info.st_size;
+  pixels->file_mtime = info.st_mtim;
+  pixels->ready = false;
+  pixels->cached = false;
+  struct pic_pixels **head = &indexed[hash_picture_name(path) % PICCACHE_BUCKETS];
+  pixels->next = *head;
+  *head = pixels;
+  pthread_mutex_unlock(&cache_lock);
+
+  bool decoded = init_picture_from_file(&pixels->pic, path);
+  if (decoded)
+  {
+    pixels->bytes = get_picture_size(&pixels->pic);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  pixels->ready = true;
+  struct pic_pixels *unused = NULL;
+  if (!decoded)
+  {
+    unindex_pixels(pixels);
+  }
+  else if (cache_budget > 0)
+  {
+    pixels->cached = true;
+    cached_bytes += pixels->bytes;
+    push_newest(pixels);
+    unused = trim_cache(cache_budget);
+  }
+  pthread_cond_broadcast(&cache_ready);
+  pthread_mutex_unlock(&cache_lock);
+
+  free_pixels(unused);
+  if (!decoded)
+  {
+    free(pixels);
+    return NULL;
+  }
+  return pixels;
+}
+
+void release_pixels(struct pic_pixels *pixels)
+{
+  pthread_mutex_lock(&cache_lock);
+  bool unused = --pixels->refs == 0 && !pixels->cached;
+  if (unused)
+  {
+    unindex_pixels(pixels);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (unused)
+  {
+    pixels->next = NULL;
+    free_pixels(pixels);
+  }
+}
+
+struct pic_pixels *own_pixels(struct pic_pixels *pixels)
+{
+  pthread_mutex_lock(&cache_lock);
+  bool sole = pixels->refs == 1 && !pixels->cached;
+  if (sole)
+  {
+    unindex_pixels(pixels);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (sole)
+  {
+    return pixels;
+  }
+
+  // copy on write
+  struct picture copy;
+  if (!init_picture_from_picture(&copy, &pixels->pic))
+  {
+    return NULL;
+  }
+  struct pic_pixels *own = new_pixels(&copy);
+  if (own == NULL)
+  {
+    clear_picture(&copy);
+    return NULL;
+  }
+  release_pixels(pixels);
+  return own;
+}
+
+bool claim_pixels(struct pic_pixels *pixels)
+{
+  pthread_mutex_lock(&cache_lock);
+  bool sole = pixels->refs == 1;
+  if (sole)
+  {
+    if (pixels->cached)
+    {
+      uncache_pixels(pixels);
+    }
+    unindex_pixels(pixels);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return sole;
+}
+
+bool init_picture_from_cache(struct picture *pic, const char *path)
+{
+  struct pic_pixels *pixels = load_pixels(path);
+  if (pixels == NULL)
+  {
+    return false;
+  }
+
+  // pixels no longer shared with anything can be taken over, rather than copied again
+  struct pic_pixels *own = own_pixels(pixels);
+  if (own == NULL)
+  {
+    fprintf(get_report_stream(), "[!] could not allocate memory for the picture at %s\n", path);
+    release_pixels(pixels);
+    return false;
+  }
+  *pic = own->pic;
+  free(own);
+  return true;
+}
+
+void clear_picture_cache(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  struct pic_pixels *unused = trim_cache(0);
+  pthread_mutex_unlock(&cache_lock);
+  free_pixels(unused);
+}
@@ -0,0 +1,81 @@
+#ifndef PICCACHE_H
+#define PICCACHE_H
+
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "Picture.h"
+#include "Utils.h"
+
+// environment variable giving the memory budget of the decoded-image cache,
+// in bytes or with a K, M or G suffix (0 turns the cache off)
+#define PICCACHE_BUDGET_ENV "PICTURE_CACHE_BUDGET"
+
+// memory budget of the decoded-image cache if PICTURE_CACHE_BUDGET is not set
+#define PICCACHE_DEFAULT_BUDGET (256ul << 20)
+
+// number of buckets indexing decoded pixels by the path they were decoded from
+#define PICCACHE_BUCKETS 64
+
+// Decoded pixels, shared copy-on-write between the pictures loaded from the
+// same file. While the file is unchanged (by size and modification time),
+// later loads of it take another reference to the same pixels. The cache
+// also keeps a reference to the most recently used ones within its budget,
+// so loading a file again after every picture of it is gone needs no decode.
+struct pic_pixels
+{
+  // the decoded picture (never changed while other references to it may exist)
+  struct picture pic;
+  // bytes the pixels take up
+  size_t bytes;
+  // pictures using the pixels (guarded by the cache lock)
+  int refs;
+  // stored pictures using the pixels, which count their bytes towards the
+  // store's resident total once between them
+  atomic_int stored;
+  // file the pixels were decoded from, with its size and modification time then,
+  // while later loads of it may share them (otherwise NULL, guarded by the cache lock)
+  char *path;
+  off_t file_size;
+  struct timespec file_mtime;
+  // whether decoding has finished (guarded by the cache lock)
+  bool ready;
+  // whether the cache holds the pixels, and its more and less recently used ones
+  // (guarded by the cache lock)
+  bool cached;
+  struct pic_pixels *newer;
+  struct pic_pixels *older;
+  // next pixels indexed in the same bucket
+  struct pic_pixels *next;
+};
+
+// take a reference to the decoded pixels of the file at path, sharing those of
+// an earlier load of it if the file is unchanged since (and decoding it otherwise)
+// NOTE: loads of the same file at the same time wait for one decode; returns NULL
+//       if the file cannot be decoded
+struct pic_pixels *load_pixels(const char *path);
+
+// take over a picture as new pixels with a single reference, shared with nothing
+// NOTE: returns NULL if memory runs out, leaving the picture alone
+struct pic_pixels *new_pixels(struct picture *pic);
+
+// drop a reference to some pixels, freeing them once nothing uses them
+void release_pixels(struct pic_pixels *pixels);
+
+// pixels that a reference may change: the same pixels if it is the only one,
+// otherwise a private copy of them (dropping the reference to the shared ones)
+// NOTE: returns NULL if memory runs out, keeping the reference to the shared pixels
+struct pic_pixels *own_pixels(struct pic_pixels *pixels);
+
+// if a reference is the only one, keep the pixels out of the cache and later
+// loads and return true, so the holder may change them, or clear their picture
+// and free them itself
+bool claim_pixels(struct pic_pixels *pixels);
+
+// initialise a picture with a copy of the decoded image of the file at path,
+// going through the cache
+bool init_picture_from_cache(struct picture *pic, const char *path);
+
+// drop every cached reference, freeing the pixels no picture uses
+void clear_picture_cache(void);
+
+#endif
@@ -0,0 +1,2246 @@
+#include "PicJpeg.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "PicKernels.h"
+#include "PicPool.h"
+
+// values of an 8x8 block's pixels handed to the kernels (red, green and blue)
+#define NO_RGB_VALUES 3
+
+// bytes a band's output buffer starts out with
+#define SEGMENT_INITIAL_BYTES 4096
+
+// first of the eight restart markers (RST0 - RST7), used in turn
+#define JPEG_RST0 0xD0
+#define JPEG_NO_RST 8
+
+// largest image side a baseline JPEG header can describe
+#define JPEG_MAX_SIDE 65535
+
+// The encoding below follows sod's writer (itself based on Jon Olick's
+// jo_jpeg) operation for operation, so that every block quantises to the same
+// coefficients. The colour conversion, DCT and quantisation of each block are
+// done by the JPEG block kernel of the selected pic_kernels (see PicKernels.h).
+// Only the entropy coded data is split into restart intervals.
+
+static const unsigned char zigzag[JPEG_BLOCK_VALUES] = {
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42, 3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18,
+    24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60, 21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63};
+
+// standard Huffman tables (JPEG Annex K), as numbers of codes of each length (1 - 16) and their values
+static const unsigned char dc_luminance_nrcodes[] = {0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const unsigned char dc_luminance_values[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const unsigned char ac_luminance_nrcodes[] = {0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const unsigned char ac_luminance_values[] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+static const unsigned char dc_chrominance_nrcodes[] = {0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const unsigned char dc_chrominance_values[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const unsigned char ac_chrominance_nrcodes[] = {0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const unsigned char ac_chrominance_values[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+// standard quantisation tables (JPEG Annex K), scaled by the quality
+static const int luminance_qt[JPEG_BLOCK_VALUES] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+static const int chrominance_qt[JPEG_BLOCK_VALUES] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+// AAN scale factors folded into the quantisation
+static const float aasf[8] = {
+    1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+    1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f};
+
+// Huffman code of every value, as {code, length in bits}
+typedef unsigned short huffman_table[256][2];
+
+// Everything fixed for one picture, shared by the bands encoding it
+struct jpeg_tables
+{
+  unsigned char y_table[JPEG_BLOCK_VALUES];
+  unsigned char uv_table[JPEG_BLOCK_VALUES];
+  float fdtbl_y[JPEG_BLOCK_VALUES];
+  float fdtbl_uv[JPEG_BLOCK_VALUES];
+  huffman_table y_dc;
+  huffman_table y_ac;
+  huffman_table uv_dc;
+  huffman_table uv_ac;
+};
+
+// Entropy coded data of one band, ending in a restart marker (except for the last band)
+struct jpeg_segment
+{
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  // bits not yet written out, aligned to the top of a 24-bit window
+  unsigned int bit_buf;
+  int bit_cnt;
+  // set if the buffer could not grow (the data is then incomplete)
+  bool failed;
+};
+
+// A picture being encoded in bands of block rows, where the pixels and
+// segments start at band first_band (0 unless it is streamed band by band)
+struct jpeg_job
+{
+  const unsigned char *pixels;
+  int width;
+  int height;
+  int comp;
+  const struct jpeg_tables *tables;
+  int band_rows;
+  int no_bands;
+  int first_band;
+  struct jpeg_segment *segments;
+};
+
+// build the canonical Huffman codes of a table given as numbers of codes per length and values
+static void build_huffman_table(const unsigned char *nrcodes, const unsigned char *values, huffman_table codes)
+{
+  memset(codes, 0, sizeof(huffman_table));
+  int code = 0;
+  int k = 0;
+  for (int length = 1; length <= 16; length++)
+  {
+    for (int i = 0; i < nrcodes[length]; i++, k++)
+    {
+      codes[values[k]][0] = code++;
+      codes[values[k]][1] = length;
+    }
+    code <<= 1;
+  }
+}
+
+// work out the quantisation and Huffman tables for a quality (1 - 100)
+static void init_jpeg_tables(struct jpeg_tables *tables, int quality)
+{
+  quality = quality ? quality : 90;
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+  quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  for (int i = 0; i < JPEG_BLOCK_VALUES; i++)
+  {
+    int yti = (luminance_qt[i] * quality + 50) / 100;
+    tables->y_table[zigzag[i]] = (unsigned char)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+    int uvti = (chrominance_qt[i] * quality + 50) / 100;
+    tables->uv_table[zigzag[i]] = (unsigned char)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+  }
+
+  for (int row = 0, k = 0; row < 8; row++)
+  {
+    for (int col = 0; col < 8; col++, k++)
+    {
+      tables->fdtbl_y[k] = 1 / (tables->y_table[zigzag[k]] * aasf[row] * aasf[col]);
+      tables->fdtbl_uv[k] = 1 / (tables->uv_table[zigzag[k]] * aasf[row] * aasf[col]);
+    }
+  }
+
+  build_huffman_table(dc_luminance_nrcodes, dc_luminance_values, tables->y_dc);
+  build_huffman_table(ac_luminance_nrcodes, ac_luminance_values, tables->y_ac);
+  build_huffman_table(dc_chrominance_nrcodes, dc_chrominance_values, tables->uv_dc);
+  build_huffman_table(ac_chrominance_nrcodes, ac_chrominance_values, tables->uv_ac);
+}
+
+// append a byte to a segment, growing its buffer as needed
+static void put_byte(struct jpeg_segment *seg, unsigned char c)
+{
+  if (seg->size == seg->capacity)
+  {
+    size_t capacity = seg->capacity > 0 ? seg->capacity * 2 : SEGMENT_INITIAL_BYTES;
+    unsigned char *more = seg->failed ? NULL : realloc(seg->data, capacity);
+    if (more == NULL)
+    {
+      seg->failed = true;
+      return;
+    }
+    seg->data = more;
+    seg->capacity = capacity;
+  }
+  seg->data[seg->size++] = c;
+}
+
+// append a Huffman code (or raw bits) to a segment, stuffing a zero after every 0xFF byte
+static void write_bits(struct jpeg_segment *seg, const unsigned short bits[2])
+{
+  seg->bit_cnt += bits[1];
+  seg->bit_buf |= bits[0] << (24 - seg->bit_cnt);
+  while (seg->bit_cnt >= 8)
+  {
+    unsigned char c = (seg->bit_buf >> 16) & 255;
+    put_byte(seg, c);
+    if (c == 255)
+    {
+      put_byte(seg, 0);
+    }
+    seg->bit_buf <<= 8;
+    seg->bit_cnt -= 8;
+  }
+}
+
+// pad a segment's last byte with one bits
+static void flush_bits(struct jpeg_segment *seg)
+{
+  static const unsigned short fill_bits[2] = {0x7F, 7};
+  write_bits(seg, fill_bits);
+  seg->bit_buf = 0;
+  seg->bit_cnt = 0;
+}
+
+// Huffman code the quantised coefficients (in row order) of a block of one component, returning its DC
+static int encode_block(struct jpeg_segment *seg, const int *quantised, int dc,
+                        const huffman_table dc_codes, const huffman_table ac_codes)
+{
+  const unsigned short *eob = ac_codes[0x00];
+  const unsigned short *zero_run = ac_codes[0xF0];
+  int coefs[JPEG_BLOCK_VALUES];
+  for (int i = 0; i < JPEG_BLOCK_VALUES; i++)
+  {
+    coefs[zigzag[i]] = quantised[i];
+  }
+
+  // DC, as the difference from the previous block's
+  unsigned short bits[2];
+  int diff = coefs[0] - dc;
+  if (diff == 0)
+  {
+    write_bits(seg, dc_codes[0]);
+  }
+  else
+  {
+    int magnitude = diff < 0 ? -diff : diff;
+    int value = diff < 0 ? diff - 1 : diff;
+    bits[1] = 1;
+    while (magnitude >>= 1)
+    {
+      bits[1]++;
+    }
+    bits[0] = value & ((1 << bits[1]) - 1);
+    write_bits(seg, dc_codes[bits[1]]);
+    write_bits(seg, bits);
+  }
+
+  // ACs, as runs of zeroes before each non-zero coefficient
+  int last = 63;
+  while (last > 0 && coefs[last] == 0)
+  {
+    last--;
+  }
+  for (int i = 1; i <= last; i++)
+  {
+    int start = i;
+    while (coefs[i] == 0 && i <= last)
+    {
+      i++;
+    }
+    int zeroes = i - start;
+    for (int run = 0; run < zeroes >> 4; run++)
+    {
+      write_bits(seg, zero_run);
+    }
+    zeroes &= 15;
+
+    int magnitude = coefs[i] < 0 ? -coefs[i] : coefs[i];
+    int value = coefs[i] < 0 ? coefs[i] - 1 : coefs[i];
+    bits[1] = 1;
+    while (magnitude >>= 1)
+    {
+      bits[1]++;
+    }
+    bits[0] = value & ((1 << bits[1]) - 1);
+    write_bits(seg, ac_codes[(zeroes << 4) + bits[1]]);
+    write_bits(seg, bits);
+  }
+  if (last != 63)
+  {
+    write_bits(seg, eob);
+  }
+  return coefs[0];
+}
+
+// encode bands [begin, end) of a picture, each into its own segment
+static void encode_bands(int begin, int end, void *ctx)
+{
+  struct jpeg_job *job = ctx;
+  const struct jpeg_tables *tables = job->tables;
+  const struct pic_kernels *kernels = get_pic_kernels();
+  int width = job->width;
+  int height = job->height;
+  int comp = job->comp;
+  // grey pictures (with or without alpha) use the one value for every colour
+  int ofs_g = comp > 2 ? 1 : 0;
+  int ofs_b = comp > 2 ? 2 : 0;
+  int first_row = job->first_band * job->band_rows * 8;
+
+  for (int band = begin; band < end; band++)
+  {
+    struct jpeg_segment *seg = &job->segments[band - job->first_band];
+    int y0 = band * job->band_rows * 8;
+    int y1 = y0 + job->band_rows * 8 < height ? y0 + job->band_rows * 8 : height;
+    // every restart interval starts predicting DC coefficients from zero again
+    int dc_y = 0, dc_u = 0, dc_v = 0;
+
+    for (int y = y0; y < y1; y += 8)
+    {
+      for (int x = 0; x < width; x += 8)
+      {
+        unsigned char block[JPEG_BLOCK_VALUES * NO_RGB_VALUES];
+        if (comp == NO_RGB_VALUES && x + 8 <= width && y + 8 <= height)
+        {
+          for (int row = 0; row < 8; row++)
+          {
+            const unsigned char *src = job->pixels + ((size_t)(y + row - first_row) * width + x) * comp;
+            memcpy(block + row * 8 * NO_RGB_VALUES, src, 8 * NO_RGB_VALUES);
+          }
+        }
+        else
+        {
+          for (int row = y, pos = 0; row < y + 8; row++)
+          {
+            for (int col = x; col < x + 8; col++, pos += NO_RGB_VALUES)
+            {
+              // blocks over the edge repeat the last row and column
+              const unsigned char *p = job->pixels +
+                                       ((size_t)((row < height ? row : height - 1) - first_row) * width +
+                                        (col < width ? col : width - 1)) * comp;
+              block[pos] = p[0];
+              block[pos + 1] = p[ofs_g];
+              block[pos + 2] = p[ofs_b];
+            }
+          }
+        }
+
+        int coefs[3 * JPEG_BLOCK_VALUES];
+        kernels->jpeg_block(block, tables->fdtbl_y, tables->fdtbl_uv, coefs);
+        dc_y = encode_block(seg, coefs, dc_y, tables->y_dc, tables->y_ac);
+        dc_u = encode_block(seg, coefs + JPEG_BLOCK_VALUES, dc_u, tables->uv_dc, tables->uv_ac);
+        dc_v = encode_block(seg, coefs + 2 * JPEG_BLOCK_VALUES, dc_v, tables->uv_dc, tables->uv_ac);
+      }
+    }
+
+    flush_bits(seg);
+    if (band < job->no_bands - 1)
+    {
+      put_byte(seg, 0xFF);
+      put_byte(seg, JPEG_RST0 + band % JPEG_NO_RST);
+    }
+  }
+}
+
+// write the headers up to the start of the entropy coded data
+// NOTE: a restart interval of 0 leaves the DRI marker out
+static bool write_headers(FILE *file, const struct jpeg_tables *tables, int width, int height,
+                          int restart_interval)
+{
+  static const unsigned char head0[] = {0xFF, 0xD8, 0xFF, 0xE0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0,
+                                        0xFF, 0xDB, 0, 0x84, 0};
+  static const unsigned char head2[] = {0xFF, 0xDA, 0, 0xC, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0};
+  const unsigned char head1[] = {0xFF, 0xC0, 0, 0x11, 8, height >> 8, height & 255, width >> 8, width & 255,
+                                 3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1, 0xFF, 0xC4, 0x01, 0xA2, 0};
+  const unsigned char dri[] = {0xFF, 0xDD, 0, 4, restart_interval >> 8, restart_interval & 255};
+  const unsigned char uv_table_id = 1, y_ac_id = 0x10, uv_dc_id = 1, uv_ac_id = 0x11;
+
+  bool ok = fwrite(head0, sizeof(head0), 1, file) == 1;
+  ok = ok && fwrite(tables->y_table, sizeof(tables->y_table), 1, file) == 1;
+  ok = ok && fwrite(&uv_table_id, 1, 1, file) == 1;
+  ok = ok && fwrite(tables->uv_table, sizeof(tables->uv_table), 1, file) == 1;
+  ok = ok && fwrite(head1, sizeof(head1), 1, file) == 1;
+  ok = ok && fwrite(dc_luminance_nrcodes + 1, sizeof(dc_luminance_nrcodes) - 1, 1, file) == 1;
+  ok = ok && fwrite(dc_luminance_values, sizeof(dc_luminance_values), 1, file) == 1;
+  ok = ok && fwrite(&y_ac_id, 1, 1, file) == 1;
+  ok = ok && fwrite(ac_luminance_nrcodes + 1, sizeof(ac_luminance_nrcodes) - 1, 1, file) == 1;
+  ok = ok && fwrite(ac_luminance_values, sizeof(ac_luminance_values), 1, file) == 1;
+  ok = ok && fwrite(&uv_dc_id, 1, 1, file) == 1;
+  ok = ok && fwrite(dc_chrominance_nrcodes + 1, sizeof(dc_chrominance_nrcodes) - 1, 1, file) == 1;
+  ok = ok && fwrite(dc_chrominance_values, sizeof(dc_chrominance_values), 1, file) == 1;
+  ok = ok && fwrite(&uv_ac_id, 1, 1, file) == 1;
+  ok = ok && fwrite(ac_chrominance_nrcodes + 1, sizeof(ac_chrominance_nrcodes) - 1, 1, file) == 1;
+  ok = ok && fwrite(ac_chrominance_values, sizeof(ac_chrominance_values), 1, file) == 1;
+  if (restart_interval > 0)
+  {
+    ok = ok && fwrite(dri, sizeof(dri), 1, file) == 1;
+  }
+  ok = ok && fwrite(head2, sizeof(head2), 1, file) == 1;
+  return ok;
+}
+
+// number of block rows in each band of a picture (of about JPEG_RESTART_BLOCKS blocks)
+static int get_band_rows(int width)
+{
+  int row_blocks = (width + 7) / 8;
+  return JPEG_RESTART_BLOCKS / row_blocks > 0 ? JPEG_RESTART_BLOCKS / row_blocks : 1;
+}
+
+bool write_jpeg(const char *path, const unsigned char *pixels, int width, int height,
+                int comp, int quality)
+{
+  if (pixels == NULL || width <= 0 || height <= 0 || width > JPEG_MAX_SIDE || height > JPEG_MAX_SIDE ||
+      comp < 1 || comp > 4)
+  {
+    return false;
+  }
+
+  struct jpeg_tables tables;
+  init_jpeg_tables(&tables, quality);
+
+  int row_blocks = (width + 7) / 8;
+  int band_rows = get_band_rows(width);
+  int no_bands = ((height + 7) / 8 + band_rows - 1) / band_rows;
+  struct jpeg_segment *segments = calloc(no_bands, sizeof(struct jpeg_segment));
+  if (segments == NULL)
+  {
+    return false;
+  }
+
+  struct jpeg_job job = {pixels, width, height, comp, &tables, band_rows, no_bands, 0, segments};
+  if (no_bands == 1)
+  {
+    encode_bands(0, 1, &job);
+  }
+  else
+  {
+    thpool_parallel_for(get_picture_pool(), 0, no_bands, 1, encode_bands, &job);
+  }
+
+  // join the segments behind the headers
+  bool ok = true;
+  for (int i = 0; i < no_bands; i++)
+  {
+    ok = ok && !segments[i].failed;
+  }
+  FILE *file = ok ? fopen(path, "wb") : NULL;
+  ok = file != NULL && write_headers(file, &tables, width, height, no_bands > 1 ? band_rows * row_blocks : 0);
+  for (int i = 0; ok && i < no_bands; i++)
+  {
+    ok = fwrite(segments[i].data, 1, segments[i].size, file) == segments[i].size;
+  }
+  static const unsigned char eoi[] = {0xFF, 0xD9};
+  ok = ok && fwrite(eoi, sizeof(eoi), 1, file) == 1;
+  if (file != NULL)
+  {
+    ok = fclose(file) == 0 && ok;
+  }
+
+  for (int i = 0; i < no_bands; i++)
+  {
+    free(segments[i].data);
+  }
+  free(segments);
+  return ok;
+}
+
+// A band of rows given to a jpeg_writer, encoded on the shared pool once it is full
+struct jpeg_band
+{
+  struct jpeg_writer *writer;
+  struct jpeg_job job;
+  unsigned char *pixels;
+  struct jpeg_segment segment;
+  // set from when the band is full until it has been encoded
+  bool busy;
+};
+
+// A JPEG being encoded as its rows are given, band by band
+struct jpeg_writer
+{
+  FILE *file;
+  struct jpeg_tables tables;
+  int width;
+  int height;
+  int comp;
+  int band_rows;
+  int no_bands;
+  // rows given and bands written to the file so far
+  int rows;
+  int written;
+  // bands being filled, encoded or written in turn (with no_slots of them in use
+  // at once), and whether they are encoded on the pool rather than the caller's thread
+  int no_slots;
+  struct jpeg_band *bands;
+  bool pooled;
+  bool failed;
+  pthread_mutex_t lock;
+  pthread_cond_t encoded;
+};
+
+// encode a full band on the shared pool, then hand it back to its writer
+static void encode_band(void *arg)
+{
+  struct jpeg_band *band = arg;
+  encode_bands(band->job.first_band, band->job.first_band + 1, &band->job);
+  pthread_mutex_lock(&band->writer->lock);
+  band->busy = false;
+  pthread_cond_broadcast(&band->writer->encoded);
+  pthread_mutex_unlock(&band->writer->lock);
+}
+
+// write the bands up to end to the file in order, waiting for any still being encoded
+static void write_bands(struct jpeg_writer *writer, int end)
+{
+  for (; writer->written < end; writer->written++)
+  {
+    struct jpeg_band *band = &writer->bands[writer->written % writer->no_slots];
+    pthread_mutex_lock(&writer->lock);
+    while (band->busy)
+    {
+      pthread_cond_wait(&writer->encoded, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    // the segment's buffer is kept for the next band to use the slot
+    struct jpeg_segment *seg = &band->segment;
+    writer->failed = writer->failed || seg->failed || fwrite(seg->data, 1, seg->size, writer->file) != seg->size;
+    seg->size = 0;
+  }
+}
+
+struct jpeg_writer *open_jpeg_writer(const char *path, int width, int height, int comp, int quality)
+{
+  if (width <= 0 || height <= 0 || width > JPEG_MAX_SIDE || height > JPEG_MAX_SIDE || comp < 1 || comp > 4)
+  {
+    return NULL;
+  }
+  struct jpeg_writer *writer = calloc(1, sizeof(struct jpeg_writer));
+  if (writer == NULL)
+  {
+    return NULL;
+  }
+
+  init_jpeg_tables(&writer->tables, quality);
+  writer->width = width;
+  writer->height = height;
+  writer->comp = comp;
+  writer->band_rows = get_band_rows(width);
+  writer->no_bands = ((height + 7) / 8 + writer->band_rows - 1) / writer->band_rows;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->encoded, NULL);
+
+  // enough bands for every thread to encode one while the next is filled
+  int pool_size = get_picture_pool_size();
+  writer->pooled = pool_size > 1 && writer->no_bands > 1;
+  writer->no_slots = writer->pooled ? (pool_size + 1 < writer->no_bands ? pool_size + 1 : writer->no_bands) : 1;
+  writer->bands = calloc(writer->no_slots, sizeof(struct jpeg_band));
+  bool ok = writer->bands != NULL;
+  int band_height = writer->band_rows * 8 < height ? writer->band_rows * 8 : height;
+  for (int i = 0; ok && i < writer->no_slots; i++)
+  {
+    writer->bands[i].writer = writer;
+    writer->bands[i].pixels = malloc((size_t)band_height * width * comp);
+    ok = writer->bands[i].pixels != NULL;
+  }
+
+  writer->file = ok ? fopen(path, "wb") : NULL;
+  int restart_interval = writer->no_bands > 1 ? writer->band_rows * ((width + 7) / 8) : 0;
+  if (writer->file == NULL || !write_headers(writer->file, &writer->tables, width, height, restart_interval))
+  {
+    // nothing has been encoded, so closing only releases the writer
+    writer->failed = true;
+    close_jpeg_writer(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+bool write_jpeg_row(struct jpeg_writer *writer, const unsigned char *row)
+{
+  if (writer->rows == writer->height)
+  {
+    return false;
+  }
+  int band_height = writer->band_rows * 8;
+  int b = writer->rows / band_height;
+  int y = writer->rows - b * band_height;
+  struct jpeg_band *band = &writer->bands[b % writer->no_slots];
+  if (y == 0)
+  {
+    // the band last filled in this slot has to be out of the way first
+    write_bands(writer, b - writer->no_slots + 1);
+  }
+  memcpy(band->pixels + (size_t)y * writer->width * writer->comp, row, (size_t)writer->width * writer->comp);
+  writer->rows++;
+
+  if (y == band_height - 1 || writer->rows == writer->height)
+  {
+    band->job = (struct jpeg_job){band->pixels, writer->width, writer->height, writer->comp, &writer->tables,
+                                  writer->band_rows, writer->no_bands, b, &band->segment};
+    band->busy = true;
+    if (!writer->pooled || thpool_add_work(get_picture_pool(), encode_band, band) != 0)
+    {
+      encode_bands(b, b + 1, &band->job);
+      band->busy = false;
+    }
+  }
+  return !writer->failed;
+}
+
+bool close_jpeg_writer(struct jpeg_writer *writer)
+{
+  // wait for every band given in full, and only finish the file if that was all of them
+  int band_height = writer->band_rows * 8;
+  write_bands(writer, writer->rows == writer->height ? writer->no_bands : writer->rows / band_height);
+  bool ok = !writer->failed && writer->rows == writer->height;
+  static const unsigned char eoi[] = {0xFF, 0xD9};
+  ok = ok && fwrite(eoi, sizeof(eoi), 1, writer->file) == 1;
+  if (writer->file != NULL)
+  {
+    ok = fclose(writer->file) == 0 && ok;
+  }
+
+  for (int i = 0; writer->bands != NULL && i < writer->no_slots; i++)
+  {
+    free(writer->bands[i].pixels);
+    free(writer->bands[i].segment.data);
+  }
+  free(writer->bands);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->encoded);
+  free(writer);
+  return ok;
+}
+
+// The decoding below follows sod's reader (stb_image) for baseline JPEGs, using
+// the same integer IDCT, upsampling filters and colour conversion, so that
+// every file decodes to the same pixels. Each restart interval starts at a
+// byte boundary with fresh DC predictions, so the intervals are decoded
+// independently of each other.
+
+// markers
+#define JPEG_SOF0 0xC0
+#define JPEG_SOF1 0xC1
+#define JPEG_DHT 0xC4
+#define JPEG_RST7 0xD7
+#define JPEG_SOI 0xD8
+#define JPEG_EOI 0xD9
+#define JPEG_SOS 0xDA
+#define JPEG_DQT 0xDB
+#define JPEG_DRI 0xDD
+#define JPEG_APP0 0xE0
+#define JPEG_APP14 0xEE
+#define JPEG_APP15 0xEF
+#define JPEG_COM 0xFE
+
+// quantisation and Huffman tables of each kind a JPEG may define
+#define JPEG_MAX_TABLES 4
+
+// components of the pictures decoded here (greyscale or colour)
+#define JPEG_MAX_COMPONENTS 3
+
+// largest sampling factor of a component
+#define JPEG_MAX_SAMPLING 4
+
+// bits of a Huffman code looked up at once (longer codes are searched for)
+#define HUFFMAN_FAST_BITS 9
+#define HUFFMAN_NO_SYMBOL 255
+
+// bytes of output pixels each range of colour converted rows aims for
+#define ROW_GRAIN_BYTES (64 * 1024)
+
+// MCU rows of samples kept while streaming: the one being converted and those either side
+#define JPEG_STREAM_MCU_ROWS 3
+
+// row order index of each coefficient in zig-zag order (corrupt runs past the end land on the last one)
+static const unsigned char dezigzag[JPEG_BLOCK_VALUES + 15] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,
+    7, 14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63};
+
+// (1 << n) - 1
+static const unsigned int bit_masks[17] = {0, 1, 3, 7, 15, 31, 63, 127, 255, 511, 1023, 2047, 4095, 8191,
+                                           16383, 32767, 65535};
+
+// (-1 << n) + 1, turning an n-bit magnitude with a clear top bit into a negative value
+static const int extend_bias[17] = {0, -1, -3, -7, -15, -31, -63, -127, -255, -511, -1023, -2047, -4095,
+                                    -8191, -16383, -32767, -65535};
+
+// A Huffman table from a DHT segment, with lookups for decoding
+struct huffman_decoder
+{
+  // symbol index of each HUFFMAN_FAST_BITS-bit prefix starting with a whole code (or HUFFMAN_NO_SYMBOL)
+  unsigned char fast[1 << HUFFMAN_FAST_BITS];
+  unsigned short code[256];
+  unsigned char values[256];
+  unsigned char size[257];
+  // one past the largest code of each length, aligned to 16 bits
+  unsigned int maxcode[18];
+  // offset from a code of each length to its symbol index
+  int delta[17];
+  // value * 256 + run * 16 + bits of the AC coefficients a prefix codes whole (0 if none)
+  short fast_ac[1 << HUFFMAN_FAST_BITS];
+  bool defined;
+};
+
+struct jpeg_component
+{
+  int id;
+  // sampling factors, quantisation table and Huffman tables
+  int h;
+  int v;
+  int tq;
+  int hd;
+  int ha;
+  // samples across and down
+  int x;
+  int y;
+  // decoded samples (in whole MCUs), w2 across and h2 down, of which data keeps
+  // ring_rows rows (every one, unless the picture is being streamed), sample
+  // row y being at row y % ring_rows
+  int w2;
+  int h2;
+  int ring_rows;
+  unsigned char *data;
+};
+
+// Entropy coded data of one restart interval (without its marker)
+struct jpeg_interval
+{
+  const unsigned char *start;
+  const unsigned char *end;
+};
+
+// A baseline JPEG being decoded
+struct jpeg_decoder
+{
+  int width;
+  int height;
+  int no_components;
+  struct jpeg_component comps[JPEG_MAX_COMPONENTS];
+  // components in the order the scan interleaves them
+  int scan_order[JPEG_MAX_COMPONENTS];
+  unsigned short dequant[JPEG_MAX_TABLES][JPEG_BLOCK_VALUES];
+  bool dequant_defined[JPEG_MAX_TABLES];
+  struct huffman_decoder huff_dc[JPEG_MAX_TABLES];
+  struct huffman_decoder huff_ac[JPEG_MAX_TABLES];
+  // whether the colour components are stored as RGB rather than YCbCr (as sod decides it)
+  bool jfif;
+  int app14_transform;
+  int rgb_ids;
+  // MCUs across and down, MCUs between restart markers (0 if there are none)
+  // and MCUs in each restart interval (all of them if there are no markers)
+  int h_max;
+  int v_max;
+  int mcu_x;
+  int mcu_y;
+  int restart_interval;
+  int interval_mcus;
+  int no_intervals;
+  struct jpeg_interval *intervals;
+  // whether only a window of MCU rows is kept, for decoding a row at a time
+  bool streaming;
+  // set by any interval that fails to decode
+  atomic_bool failed;
+  // output, with out_comp values per pixel, either interleaved bytes or one
+  // float plane per value
+  int out_comp;
+  unsigned char *pixels;
+  float *planes;
+  // plane value of each sample
+  float sample_values[256];
+};
+
+// Bits of an interval's entropy coded data being read
+struct bit_reader
+{
+  const unsigned char *p;
+  const unsigned char *end;
+  // bits not yet consumed, aligned to the top
+  unsigned int buf;
+  int bits;
+  // whether the end of the interval was reached (only zeroes follow)
+  bool nomore;
+};
+
+// Progress of decoding the MCUs of a scan in order
+struct mcu_cursor
+{
+  int interval;
+  int mcu;
+  struct bit_reader br;
+  int dc_pred[JPEG_MAX_COMPONENTS];
+};
+
+// build the decoding lookups of a Huffman table given its number of codes of each length (1 - 16)
+static bool build_huffman_decoder(struct huffman_decoder *h, const int counts[16])
+{
+  int k = 0;
+  for (int i = 0; i < 16; i++)
+  {
+    for (int j = 0; j < counts[i]; j++)
+    {
+      if (k == 256)
+      {
+        return false;
+      }
+      h->size[k++] = (unsigned char)(i + 1);
+    }
+  }
+  h->size[k] = 0;
+
+  // canonical codes, one length after the other
+  unsigned int code = 0;
+  int length;
+  k = 0;
+  for (length = 1; length <= 16; length++)
+  {
+    h->delta[length] = k - code;
+    if (h->size[k] == length)
+    {
+      while (h->size[k] == length)
+      {
+        h->code[k++] = (unsigned short)code++;
+      }
+      if (code - 1 >= 1u << length)
+      {
+        return false;
+      }
+    }
+    h->maxcode[length] = code << (16 - length);
+    code <<= 1;
+  }
+  h->maxcode[length] = 0xFFFFFFFF;
+
+  memset(h->fast, HUFFMAN_NO_SYMBOL, sizeof(h->fast));
+  for (int i = 0; i < k; i++)
+  {
+    int s = h->size[i];
+    if (s <= HUFFMAN_FAST_BITS)
+    {
+      int c = h->code[i] << (HUFFMAN_FAST_BITS - s);
+      for (int j = 0; j < 1 << (HUFFMAN_FAST_BITS - s); j++)
+      {
+        h->fast[c + j] = (unsigned char)i;
+      }
+    }
+  }
+  return true;
+}
+
+// fill in the lookup of AC coefficients whose code and value both fit in HUFFMAN_FAST_BITS
+static void build_fast_ac(struct huffman_decoder *h)
+{
+  for (int i = 0; i < 1 << HUFFMAN_FAST_BITS; i++)
+  {
+    unsigned char fast = h->fast[i];
+    h->fast_ac[i] = 0;
+    if (fast == HUFFMAN_NO_SYMBOL)
+    {
+      continue;
+    }
+    int rs = h->values[fast];
+    int run = (rs >> 4) & 15;
+    int magnitude_bits = rs & 15;
+    int length = h->size[fast];
+    if (magnitude_bits > 0 && length + magnitude_bits <= HUFFMAN_FAST_BITS)
+    {
+      int k = ((i << length) & ((1 << HUFFMAN_FAST_BITS) - 1)) >> (HUFFMAN_FAST_BITS - magnitude_bits);
+      int m = 1 << (magnitude_bits - 1);
+      if (k < m)
+      {
+        k += (~0U << magnitude_bits) + 1;
+      }
+      if (k >= -128 && k <= 127)
+      {
+        h->fast_ac[i] = (short)(k * 256 + run * 16 + length + magnitude_bits);
+      }
+    }
+  }
+}
+
+// top up the bits of a reader, stopping short at the end of its interval and
+// with zeroes after it (as sod's reader does on meeting the marker)
+static void fill_bits(struct bit_reader *br)
+{
+  do
+  {
+    unsigned int b = 0;
+    if (!br->nomore)
+    {
+      if (br->p == br->end)
+      {
+        br->nomore = true;
+        return;
+      }
+      b = *br->p++;
+      // skip the zero stuffed after a 0xFF data byte (and any fill bytes before it)
+      if (b == 0xFF)
+      {
+        while (br->p < br->end && *br->p == 0xFF)
+        {
+          br->p++;
+        }
+        br->p += br->p < br->end;
+      }
+    }
+    br->buf |= b << (24 - br->bits);
+    br->bits += 8;
+  } while (br->bits <= 24);
+}
+
+// read a Huffman coded symbol (or -1 for an invalid code)
+static int decode_huffman(struct bit_reader *br, const struct huffman_decoder *h)
+{
+  if (br->bits < 16)
+  {
+    fill_bits(br);
+  }
+
+  int c = (br->buf >> (32 - HUFFMAN_FAST_BITS)) & ((1 << HUFFMAN_FAST_BITS) - 1);
+  int k = h->fast[c];
+  if (k != HUFFMAN_NO_SYMBOL)
+  {
+    int s = h->size[k];
+    if (s > br->bits)
+    {
+      return -1;
+    }
+    br->buf <<= s;
+    br->bits -= s;
+    return h->values[k];
+  }
+
+  // longer codes: find the length whose codes the next bits fall under
+  unsigned int top = br->buf >> 16;
+  for (k = HUFFMAN_FAST_BITS + 1; top >= h->maxcode[k]; k++)
+  {
+  }
+  if (k == 17 || k > br->bits)
+  {
+    return -1;
+  }
+  c = ((br->buf >> (32 - k)) & bit_masks[k]) + h->delta[k];
+  br->buf <<= k;
+  br->bits -= k;
+  return h->values[c];
+}
+
+// read an n-bit (1 - 16) coefficient value
+static int receive_extend(struct bit_reader *br, int n)
+{
+  if (br->bits < n)
+  {
+    fill_bits(br);
+  }
+  int negative = !(br->buf >> 31);
+  unsigned int k = br->buf >> (32 - n);
+  br->buf <<= n;
+  br->bits -= n;
+  return (int)k + (negative ? extend_bias[n] : 0);
+}
+
+// decode and dequantise the coefficients (in row order) of one block
+static bool decode_block(struct bit_reader *br, short data[JPEG_BLOCK_VALUES], const struct huffman_decoder *hdc,
+                         const struct huffman_decoder *hac, int *dc_pred, const unsigned short *dequant)
+{
+  int t = decode_huffman(br, hdc);
+  if (t < 0 || t > 16)
+  {
+    return false;
+  }
+  memset(data, 0, JPEG_BLOCK_VALUES * sizeof(short));
+
+  int dc = *dc_pred + (t ? receive_extend(br, t) : 0);
+  *dc_pred = dc;
+  data[0] = (short)(dc * dequant[0]);
+
+  int k = 1;
+  do
+  {
+    if (br->bits < 16)
+    {
+      fill_bits(br);
+    }
+    int c = (br->buf >> (32 - HUFFMAN_FAST_BITS)) & ((1 << HUFFMAN_FAST_BITS) - 1);
+    int r = hac->fast_ac[c];
+    if (r)
+    {
+      // run, code and value in one lookup
+      k += (r >> 4) & 15;
+      int s = r & 15;
+      br->buf <<= s;
+      br->bits -= s;
+      int zig = dezigzag[k++];
+      data[zig] = (short)((r >> 8) * dequant[zig]);
+      continue;
+    }
+
+    int rs = decode_huffman(br, hac);
+    if (rs < 0)
+    {
+      return false;
+    }
+    int s = rs & 15;
+    r = rs >> 4;
+    if (s == 0)
+    {
+      // end of block, or a run of 16 zeroes
+      if (rs != 0xF0)
+      {
+        break;
+      }
+      k += 16;
+    }
+    else
+    {
+      k += r;
+      int zig = dezigzag[k++];
+      data[zig] = (short)(receive_extend(br, s) * dequant[zig]);
+    }
+  } while (k < JPEG_BLOCK_VALUES);
+  return true;
+}
+
+// clamp an integer to a sample value
+static inline unsigned char clamp_sample(int x)
+{
+  return x < 0 ? 0 : x > 255 ? 255 : (unsigned char)x;
+}
+
+// IDCT constants, scaled by 1 << 12
+#define IDCT_F2F(x) ((int)((x) * 4096 + 0.5))
+#define IDCT_FSH(x) ((x) * 4096)
+
+#ifndef __SSE2__
+// one-dimensional integer IDCT (jidctint's ISLOW) of eight values, giving the
+// even (x) and odd (t) terms whose sums and differences are the outputs
+static inline void idct_1d(int s0, int s1, int s2, int s3, int s4, int s5, int s6, int s7, int x[4], int t[4])
+{
+  int p1, p2, p3, p4, p5, t0, t1, t2, t3;
+  p2 = s2;
+  p3 = s6;
+  p1 = (p2 + p3) * IDCT_F2F(0.5411961f);
+  t2 = p1 + p3 * IDCT_F2F(-1.847759065f);
+  t3 = p1 + p2 * IDCT_F2F(0.765366865f);
+  p2 = s0;
+  p3 = s4;
+  t0 = IDCT_FSH(p2 + p3);
+  t1 = IDCT_FSH(p2 - p3);
+  x[0] = t0 + t3;
+  x[3] = t0 - t3;
+  x[1] = t1 + t2;
+  x[2] = t1 - t2;
+  t0 = s7;
+  t1 = s5;
+  t2 = s3;
+  t3 = s1;
+  p3 = t0 + t2;
+  p4 = t1 + t3;
+  p1 = t0 + t3;
+  p2 = t1 + t2;
+  p5 = (p3 + p4) * IDCT_F2F(1.175875602f);
+  t0 = t0 * IDCT_F2F(0.298631336f);
+  t1 = t1 * IDCT_F2F(2.053119869f);
+  t2 = t2 * IDCT_F2F(3.072711026f);
+  t3 = t3 * IDCT_F2F(1.501321110f);
+  p1 = p5 + p1 * IDCT_F2F(-0.899976223f);
+  p2 = p5 + p2 * IDCT_F2F(-2.562915447f);
+  p3 = p3 * IDCT_F2F(-1.961570560f);
+  p4 = p4 * IDCT_F2F(-0.390180644f);
+  t[3] = t3 + p1 + p4;
+  t[2] = t2 + p2 + p3;
+  t[1] = t1 + p2 + p4;
+  t[0] = t0 + p1 + p3;
+}
+
+// inverse transform the dequantised coefficients of a block into 8x8 samples
+static void idct_block(unsigned char *out, int out_stride, const short data[JPEG_BLOCK_VALUES])
+{
+  int val[JPEG_BLOCK_VALUES];
+  int x[4], t[4];
+
+  // columns, keeping 2 extra bits of precision
+  for (int i = 0; i < 8; i++)
+  {
+    const short *d = data + i;
+    int *v = val + i;
+    if (d[8] == 0 && d[16] == 0 && d[24] == 0 && d[32] == 0 && d[40] == 0 && d[48] == 0 && d[56] == 0)
+    {
+      int dc = d[0] * 4;
+      v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dc;
+      continue;
+    }
+    idct_1d(d[0], d[8], d[16], d[24], d[32], d[40], d[48], d[56], x, t);
+    for (int k = 0; k < 4; k++)
+    {
+      x[k] += 512;
+    }
+    v[0] = (x[0] + t[3]) >> 10;
+    v[56] = (x[0] - t[3]) >> 10;
+    v[8] = (x[1] + t[2]) >> 10;
+    v[48] = (x[1] - t[2]) >> 10;
+    v[16] = (x[2] + t[1]) >> 10;
+    v[40] = (x[2] - t[1]) >> 10;
+    v[24] = (x[3] + t[0]) >> 10;
+    v[32] = (x[3] - t[0]) >> 10;
+  }
+
+  // rows, removing the 1 << 17 scale (rounded) and shifting back to 0 - 255
+  for (int i = 0; i < 8; i++, out += out_stride)
+  {
+    const int *v = val + i * 8;
+    idct_1d(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], x, t);
+    for (int k = 0; k < 4; k++)
+    {
+      x[k] += 65536 + (128 << 17);
+    }
+    out[0] = clamp_sample((x[0] + t[3]) >> 17);
+    out[7] = clamp_sample((x[0] - t[3]) >> 17);
+    out[1] = clamp_sample((x[1] + t[2]) >> 17);
+    out[6] = clamp_sample((x[1] - t[2]) >> 17);
+    out[2] = clamp_sample((x[2] + t[1]) >> 17);
+    out[5] = clamp_sample((x[2] - t[1]) >> 17);
+    out[3] = clamp_sample((x[3] + t[0]) >> 17);
+    out[4] = clamp_sample((x[3] - t[0]) >> 17);
+  }
+}
+
+#else
+// sod's reader inverse transforms with SSE2 wherever the compiler targets it,
+// in 16-bit lanes that saturate (rather than overflow) on the out of range
+// coefficients of damaged files, so the same is done here
+
+// a pair of IDCT constants, repeated across 16-bit lanes
+#define IDCT_PAIR(x, y) _mm_setr_epi16((x), (y), (x), (y), (x), (y), (x), (y))
+
+// 32-bit values from the low and high halves of eight 16-bit ones
+struct idct_wide
+{
+  __m128i lo;
+  __m128i hi;
+};
+
+static inline struct idct_wide idct_add_sse2(struct idct_wide a, struct idct_wide b)
+{
+  return (struct idct_wide){_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)};
+}
+
+static inline struct idct_wide idct_sub_sse2(struct idct_wide a, struct idct_wide b)
+{
+  return (struct idct_wide){_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)};
+}
+
+// x * c[even] + y * c[odd] in each lane
+static inline struct idct_wide idct_rotate_sse2(__m128i x, __m128i y, __m128i c)
+{
+  return (struct idct_wide){_mm_madd_epi16(_mm_unpacklo_epi16(x, y), c), _mm_madd_epi16(_mm_unpackhi_epi16(x, y), c)};
+}
+
+// x << 12 in each lane
+static inline struct idct_wide idct_widen_sse2(__m128i x)
+{
+  return (struct idct_wide){_mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), x), 4),
+                            _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), x), 4)};
+}
+
+// (a + bias + b) >> shift and (a + bias - b) >> shift, packed back to 16 bits
+static inline void idct_butterfly_sse2(__m128i *out0, __m128i *out1, struct idct_wide a, struct idct_wide b,
+                                       __m128i bias, int shift)
+{
+  struct idct_wide biased = {_mm_add_epi32(a.lo, bias), _mm_add_epi32(a.hi, bias)};
+  struct idct_wide sum = idct_add_sse2(biased, b);
+  struct idct_wide dif = idct_sub_sse2(biased, b);
+  *out0 = _mm_packs_epi32(_mm_srai_epi32(sum.lo, shift), _mm_srai_epi32(sum.hi, shift));
+  *out1 = _mm_packs_epi32(_mm_srai_epi32(dif.lo, shift), _mm_srai_epi32(dif.hi, shift));
+}
+
+// one-dimensional IDCT of each lane of eight rows, in place
+static inline void idct_pass_sse2(__m128i row[8], __m128i bias, int shift)
+{
+  const __m128i rot0_0 = IDCT_PAIR(IDCT_F2F(0.5411961f), IDCT_F2F(0.5411961f) + IDCT_F2F(-1.847759065f));
+  const __m128i rot0_1 = IDCT_PAIR(IDCT_F2F(0.5411961f) + IDCT_F2F(0.765366865f), IDCT_F2F(0.5411961f));
+  const __m128i rot1_0 = IDCT_PAIR(IDCT_F2F(1.175875602f) + IDCT_F2F(-0.899976223f), IDCT_F2F(1.175875602f));
+  const __m128i rot1_1 = IDCT_PAIR(IDCT_F2F(1.175875602f), IDCT_F2F(1.175875602f) + IDCT_F2F(-2.562915447f));
+  const __m128i rot2_0 = IDCT_PAIR(IDCT_F2F(-1.961570560f) + IDCT_F2F(0.298631336f), IDCT_F2F(-1.961570560f));
+  const __m128i rot2_1 = IDCT_PAIR(IDCT_F2F(-1.961570560f), IDCT_F2F(-1.961570560f) + IDCT_F2F(3.072711026f));
+  const __m128i rot3_0 = IDCT_PAIR(IDCT_F2F(-0.390180644f) + IDCT_F2F(2.053119869f), IDCT_F2F(-0.390180644f));
+  const __m128i rot3_1 = IDCT_PAIR(IDCT_F2F(-0.390180644f), IDCT_F2F(-0.390180644f) + IDCT_F2F(1.501321110f));
+
+  // even part
+  struct idct_wide t2e = idct_rotate_sse2(row[2], row[6], rot0_0);
+  struct idct_wide t3e = idct_rotate_sse2(row[2], row[6], rot0_1);
+  struct idct_wide t0e = idct_widen_sse2(_mm_add_epi16(row[0], row[4]));
+  struct idct_wide t1e = idct_widen_sse2(_mm_sub_epi16(row[0], row[4]));
+  struct idct_wide x0 = idct_add_sse2(t0e, t3e);
+  struct idct_wide x3 = idct_sub_sse2(t0e, t3e);
+  struct idct_wide x1 = idct_add_sse2(t1e, t2e);
+  struct idct_wide x2 = idct_sub_sse2(t1e, t2e);
+
+  // odd part
+  struct idct_wide y0o = idct_rotate_sse2(row[7], row[3], rot2_0);
+  struct idct_wide y2o = idct_rotate_sse2(row[7], row[3], rot2_1);
+  struct idct_wide y1o = idct_rotate_sse2(row[5], row[1], rot3_0);
+  struct idct_wide y3o = idct_rotate_sse2(row[5], row[1], rot3_1);
+  __m128i sum17 = _mm_add_epi16(row[1], row[7]);
+  __m128i sum35 = _mm_add_epi16(row[3], row[5]);
+  struct idct_wide y4o = idct_rotate_sse2(sum17, sum35, rot1_0);
+  struct idct_wide y5o = idct_rotate_sse2(sum17, sum35, rot1_1);
+  struct idct_wide x4 = idct_add_sse2(y0o, y4o);
+  struct idct_wide x5 = idct_add_sse2(y1o, y5o);
+  struct idct_wide x6 = idct_add_sse2(y2o, y5o);
+  struct idct_wide x7 = idct_add_sse2(y3o, y4o);
+
+  idct_butterfly_sse2(&row[0], &row[7], x0, x7, bias, shift);
+  idct_butterfly_sse2(&row[1], &row[6], x1, x6, bias, shift);
+  idct_butterfly_sse2(&row[2], &row[5], x2, x5, bias, shift);
+  idct_butterfly_sse2(&row[3], &row[4], x3, x4, bias, shift);
+}
+
+// interleave the low and high halves of a and b (as 16-bit values)
+static inline void idct_interleave16_sse2(__m128i *a, __m128i *b)
+{
+  __m128i t = *a;
+  *a = _mm_unpacklo_epi16(*a, *b);
+  *b = _mm_unpackhi_epi16(t, *b);
+}
+
+// interleave the low and high halves of a and b (as bytes)
+static inline void idct_interleave8_sse2(__m128i *a, __m128i *b)
+{
+  __m128i t = *a;
+  *a = _mm_unpacklo_epi8(*a, *b);
+  *b = _mm_unpackhi_epi8(t, *b);
+}
+
+// inverse transform the dequantised coefficients of a block into 8x8 samples
+static void idct_block(unsigned char *out, int out_stride, const short data[JPEG_BLOCK_VALUES])
+{
+  __m128i row[8];
+  for (int i = 0; i < 8; i++)
+  {
+    row[i] = _mm_loadu_si128((const __m128i *)(data + i * 8));
+  }
+
+  // columns, then rows after a transpose
+  idct_pass_sse2(row, _mm_set1_epi32(512), 10);
+  for (int i = 0; i < 4; i++)
+  {
+    idct_interleave16_sse2(&row[i], &row[i + 4]);
+  }
+  idct_interleave16_sse2(&row[0], &row[2]);
+  idct_interleave16_sse2(&row[1], &row[3]);
+  idct_interleave16_sse2(&row[4], &row[6]);
+  idct_interleave16_sse2(&row[5], &row[7]);
+  for (int i = 0; i < 8; i += 2)
+  {
+    idct_interleave16_sse2(&row[i], &row[i + 1]);
+  }
+  idct_pass_sse2(row, _mm_set1_epi32(65536 + (128 << 17)), 17);
+
+  // pack to bytes and transpose back
+  __m128i p0 = _mm_packus_epi16(row[0], row[1]);
+  __m128i p1 = _mm_packus_epi16(row[2], row[3]);
+  __m128i p2 = _mm_packus_epi16(row[4], row[5]);
+  __m128i p3 = _mm_packus_epi16(row[6], row[7]);
+  idct_interleave8_sse2(&p0, &p2);
+  idct_interleave8_sse2(&p1, &p3);
+  idct_interleave8_sse2(&p0, &p1);
+  idct_interleave8_sse2(&p2, &p3);
+  idct_interleave8_sse2(&p0, &p2);
+  idct_interleave8_sse2(&p1, &p3);
+
+  const __m128i rows[4] = {p0, p2, p1, p3};
+  for (int i = 0; i < 4; i++)
+  {
+    _mm_storel_epi64((__m128i *)out, rows[i]);
+    out += out_stride;
+    _mm_storel_epi64((__m128i *)out, _mm_shuffle_epi32(rows[i], 0x4e));
+    out += out_stride;
+  }
+}
+#endif
+
+// the row of a component's samples at y (as kept in its ring of rows)
+static inline unsigned char *component_row(const struct jpeg_component *comp, int y)
+{
+  return comp->data + (size_t)comp->w2 * (y % comp->ring_rows);
+}
+
+// number of rows of a component's samples in each row of MCUs
+static int component_mcu_rows(const struct jpeg_decoder *dec, const struct jpeg_component *comp)
+{
+  // a single component is coded one block at a time, whatever its sampling
+  return (dec->no_components > 1 ? comp->v : 1) * 8;
+}
+
+// point a cursor at the first MCU of restart interval i
+static void start_interval(const struct jpeg_decoder *dec, struct mcu_cursor *cur, int i)
+{
+  cur->interval = i;
+  cur->mcu = i * dec->interval_mcus;
+  cur->br = (struct bit_reader){dec->intervals[i].start, dec->intervals[i].end, 0, 0, false};
+  memset(cur->dc_pred, 0, sizeof(cur->dc_pred));
+}
+
+// check that the data of the cursor's interval ends where its last MCU does
+static bool end_interval(const struct jpeg_decoder *dec, struct mcu_cursor *cur)
+{
+  // sod's reader rejects data that does not end at the interval's marker (or,
+  // after the last interval, at the end of the image)
+  struct bit_reader *br = &cur->br;
+  if (cur->mcu - cur->interval * dec->interval_mcus == dec->restart_interval && br->bits < 24)
+  {
+    fill_bits(br);
+  }
+  return br->nomore || (cur->interval == dec->no_intervals - 1 && memchr(br->p, 0xFF, br->end - br->p) == NULL &&
+                        br->end[1] == JPEG_EOI);
+}
+
+// decode the MCUs from the cursor up to end into the component planes, moving
+// on from one restart interval to the next, and returning false if they are damaged
+static bool decode_mcus(const struct jpeg_decoder *dec, struct mcu_cursor *cur, int end)
+{
+  int total = dec->mcu_x * dec->mcu_y;
+  short data[JPEG_BLOCK_VALUES];
+
+  while (cur->mcu < end)
+  {
+    int mx = cur->mcu % dec->mcu_x;
+    int my = cur->mcu / dec->mcu_x;
+    for (int k = 0; k < dec->no_components; k++)
+    {
+      int n = dec->scan_order[k];
+      const struct jpeg_component *comp = &dec->comps[n];
+      int h = dec->no_components > 1 ? comp->h : 1;
+      int v = dec->no_components > 1 ? comp->v : 1;
+      for (int y = 0; y < v; y++)
+      {
+        for (int x = 0; x < h; x++)
+        {
+          if (!decode_block(&cur->br, data, &dec->huff_dc[comp->hd], &dec->huff_ac[comp->ha], &cur->dc_pred[n],
+                            dec->dequant[comp->tq]))
+          {
+            return false;
+          }
+          int x2 = (mx * h + x) * 8;
+          int y2 = (my * v + y) * 8;
+          idct_block(component_row(comp, y2) + x2, comp->w2, data);
+        }
+      }
+    }
+
+    if (++cur->mcu % dec->interval_mcus == 0 || cur->mcu == total)
+    {
+      if (!end_interval(dec, cur))
+      {
+        return false;
+      }
+      if (cur->mcu < total)
+      {
+        start_interval(dec, cur, cur->interval + 1);
+      }
+    }
+  }
+  return true;
+}
+
+// decode restart intervals [begin, end) into the component planes
+static void decode_intervals(int begin, int end, void *ctx)
+{
+  struct jpeg_decoder *dec = ctx;
+  int total = dec->mcu_x * dec->mcu_y;
+
+  for (int i = begin; i < end && !atomic_load(&dec->failed); i++)
+  {
+    struct mcu_cursor cur;
+    start_interval(dec, &cur, i);
+    int last = cur.mcu + dec->interval_mcus < total ? cur.mcu + dec->interval_mcus : total;
+    if (!decode_mcus(dec, &cur, last))
+    {
+      atomic_store(&dec->failed, true);
+      return;
+    }
+  }
+}
+
+// upsample one row of a component's samples into out, returning the row (which may be in_near itself)
+// NOTE: each resampler takes every argument any of them needs, and ignores the rest
+typedef const unsigned char *(*resample_row_fn)(unsigned char *out, const unsigned char *in_near,
+                                                const unsigned char *in_far, int w, int hs);
+
+static const unsigned char *resample_row_1(unsigned char *out, const unsigned char *in_near,
+                                           const unsigned char *in_far, int w, int hs)
+{
+  (void)out;
+  (void)in_far;
+  (void)w;
+  (void)hs;
+  return in_near;
+}
+
+static const unsigned char *resample_row_v_2(unsigned char *out, const unsigned char *in_near,
+                                             const unsigned char *in_far, int w, int hs)
+{
+  (void)hs;
+  for (int i = 0; i < w; i++)
+  {
+    out[i] = (unsigned char)((3 * in_near[i] + in_far[i] + 2) >> 2);
+  }
+  return out;
+}
+
+static const unsigned char *resample_row_h_2(unsigned char *out, const unsigned char *in_near,
+                                             const unsigned char *in_far, int w, int hs)
+{
+  (void)in_far;
+  (void)hs;
+  const unsigned char *input = in_near;
+  if (w == 1)
+  {
+    out[0] = out[1] = input[0];
+    return out;
+  }
+
+  out[0] = input[0];
+  out[1] = (unsigned char)((input[0] * 3 + input[1] + 2) >> 2);
+  int i;
+  for (i = 1; i < w - 1; i++)
+  {
+    int n = 3 * input[i] + 2;
+    out[i * 2] = (unsigned char)((n + input[i - 1]) >> 2);
+    out[i * 2 + 1] = (unsigned char)((n + input[i + 1]) >> 2);
+  }
+  out[i * 2] = (unsigned char)((input[w - 2] * 3 + input[w - 1] + 2) >> 2);
+  out[i * 2 + 1] = input[w - 1];
+  return out;
+}
+
+static const unsigned char *resample_row_hv_2(unsigned char *out, const unsigned char *in_near,
+                                              const unsigned char *in_far, int w, int hs)
+{
+  (void)hs;
+  if (w == 1)
+  {
+    out[0] = out[1] = (unsigned char)((3 * in_near[0] + in_far[0] + 2) >> 2);
+    return out;
+  }
+
+  int t1 = 3 * in_near[0] + in_far[0];
+  out[0] = (unsigned char)((t1 + 2) >> 2);
+  for (int i = 1; i < w; i++)
+  {
+    int t0 = t1;
+    t1 = 3 * in_near[i] + in_far[i];
+    out[i * 2 - 1] = (unsigned char)((3 * t0 + t1 + 8) >> 4);
+    out[i * 2] = (unsigned char)((3 * t1 + t0 + 8) >> 4);
+  }
+  out[w * 2 - 1] = (unsigned char)((t1 + 2) >> 2);
+  return out;
+}
+
+// nearest neighbour, for any other sampling
+static const unsigned char *resample_row_generic(unsigned char *out, const unsigned char *in_near,
+                                                 const unsigned char *in_far, int w, int hs)
+{
+  (void)in_far;
+  for (int i = 0; i < w; i++)
+  {
+    for (int j = 0; j < hs; j++)
+    {
+      out[i * hs + j] = in_near[i];
+    }
+  }
+  return out;
+}
+
+// Progress of upsampling a component, one output row at a time
+struct row_resampler
+{
+  resample_row_fn resample;
+  // rows of samples the output row is upsampled from
+  int line0;
+  int line1;
+  // expansion across and down, and samples across before it
+  int hs;
+  int vs;
+  int w_lores;
+  // how far through the vertical expansion of a row, and which row of samples
+  int ystep;
+  int ypos;
+  unsigned char *linebuf;
+};
+
+// start upsampling a component from the first output row
+static void init_row_resampler(struct row_resampler *r, const struct jpeg_decoder *dec,
+                               const struct jpeg_component *comp)
+{
+  r->hs = dec->h_max / comp->h;
+  r->vs = dec->v_max / comp->v;
+  r->ystep = r->vs >> 1;
+  r->w_lores = (dec->width + r->hs - 1) / r->hs;
+  r->ypos = 0;
+  r->line0 = r->line1 = 0;
+  if (r->hs == 1 && r->vs == 1)
+  {
+    r->resample = resample_row_1;
+  }
+  else if (r->hs == 1 && r->vs == 2)
+  {
+    r->resample = resample_row_v_2;
+  }
+  else if (r->hs == 2 && r->vs == 1)
+  {
+    r->resample = resample_row_h_2;
+  }
+  else if (r->hs == 2 && r->vs == 2)
+  {
+    r->resample = resample_row_hv_2;
+  }
+  else
+  {
+    r->resample = resample_row_generic;
+  }
+}
+
+// move a component's upsampling on to the next output row
+static void next_resampled_row(struct row_resampler *r, const struct jpeg_component *comp)
+{
+  if (++r->ystep >= r->vs)
+  {
+    r->ystep = 0;
+    r->line0 = r->line1;
+    if (++r->ypos < comp->y)
+    {
+      r->line1++;
+    }
+  }
+}
+
+// upsample the current output row of a component
+static const unsigned char *resample_row(struct row_resampler *r, const struct jpeg_component *comp)
+{
+  bool y_bot = r->ystep >= (r->vs >> 1);
+  const unsigned char *line0 = component_row(comp, r->line0);
+  const unsigned char *line1 = component_row(comp, r->line1);
+  return r->resample(r->linebuf, y_bot ? line1 : line0, y_bot ? line0 : line1, r->w_lores, r->hs);
+}
+
+// fixed point YCbCr to RGB factors (reduced precision, as sod's reader uses them)
+#define YCC_FIXED(x) (((int)((x) * 4096.0f + 0.5f)) << 8)
+
+// convert one YCbCr sample to RGB
+static inline void ycbcr_to_rgb(unsigned char *out, int y, int cb, int cr)
+{
+  int y_fixed = (y << 20) + (1 << 19);
+  cr -= 128;
+  cb -= 128;
+  int r = y_fixed + cr * YCC_FIXED(1.40200f);
+  int g = y_fixed + (cr * -YCC_FIXED(0.71414f)) + ((cb * -YCC_FIXED(0.34414f)) & 0xffff0000);
+  int b = y_fixed + cb * YCC_FIXED(1.77200f);
+  out[0] = clamp_sample(r >> 20);
+  out[1] = clamp_sample(g >> 20);
+  out[2] = clamp_sample(b >> 20);
+}
+
+// colour convert a row of YCbCr samples to interleaved RGB
+static void ycbcr_to_rgb_row(unsigned char *out, const unsigned char *y, const unsigned char *pcb,
+                             const unsigned char *pcr, int count)
+{
+  for (int i = 0; i < count; i++, out += NO_RGB_VALUES)
+  {
+    ycbcr_to_rgb(out, y[i], pcb[i], pcr[i]);
+  }
+}
+
+// resample the next output row of every component into rows
+static void resample_rows(const struct jpeg_decoder *dec, struct row_resampler *resamplers,
+                          const unsigned char **rows)
+{
+  for (int k = 0; k < dec->no_components; k++)
+  {
+    rows[k] = resample_row(&resamplers[k], &dec->comps[k]);
+    next_resampled_row(&resamplers[k], &dec->comps[k]);
+  }
+}
+
+// check if a three component picture holds RGB rather than YCbCr samples
+static bool has_rgb_components(const struct jpeg_decoder *dec)
+{
+  return dec->no_components == 3 && (dec->rgb_ids == 3 || (dec->app14_transform == 0 && !dec->jfif));
+}
+
+// upsample and colour convert the next output row of every component into out
+static void convert_row(const struct jpeg_decoder *dec, struct row_resampler *resamplers, unsigned char *out)
+{
+  const unsigned char *rows[JPEG_MAX_COMPONENTS];
+  resample_rows(dec, resamplers, rows);
+
+  if (dec->out_comp == 1)
+  {
+    memcpy(out, rows[0], dec->width);
+  }
+  else if (dec->no_components == 1)
+  {
+    for (int i = 0; i < dec->width; i++, out += NO_RGB_VALUES)
+    {
+      out[0] = out[1] = out[2] = rows[0][i];
+    }
+  }
+  else if (has_rgb_components(dec))
+  {
+    for (int i = 0; i < dec->width; i++, out += NO_RGB_VALUES)
+    {
+      out[0] = rows[0][i];
+      out[1] = rows[1][i];
+      out[2] = rows[2][i];
+    }
+  }
+  else
+  {
+    ycbcr_to_rgb_row(out, rows[0], rows[1], rows[2], dec->width);
+  }
+}
+
+// upsample and colour convert the next output row of every component straight
+// into row j of each float plane
+static void convert_row_to_planes(const struct jpeg_decoder *dec, struct row_resampler *resamplers, int j)
+{
+  const unsigned char *rows[JPEG_MAX_COMPONENTS];
+  resample_rows(dec, resamplers, rows);
+
+  size_t plane_size = (size_t)dec->width * dec->height;
+  float *out[NO_RGB_VALUES];
+  for (int k = 0; k < dec->out_comp; k++)
+  {
+    out[k] = dec->planes + k * plane_size + (size_t)j * dec->width;
+  }
+
+  if (dec->no_components == 3 && dec->out_comp == NO_RGB_VALUES && !has_rgb_components(dec))
+  {
+    for (int i = 0; i < dec->width; i++)
+    {
+      unsigned char rgb[NO_RGB_VALUES];
+      ycbcr_to_rgb(rgb, rows[0][i], rows[1][i], rows[2][i]);
+      out[0][i] = dec->sample_values[rgb[0]];
+      out[1][i] = dec->sample_values[rgb[1]];
+      out[2][i] = dec->sample_values[rgb[2]];
+    }
+    return;
+  }
+  // grey samples go to every plane, RGB samples to their own
+  for (int k = 0; k < dec->out_comp; k++)
+  {
+    const unsigned char *in = rows[dec->no_components == 1 ? 0 : k];
+    for (int i = 0; i < dec->width; i++)
+    {
+      out[k][i] = dec->sample_values[in[i]];
+    }
+  }
+}
+
+// upsample and colour convert output rows [begin, end) into the output
+static void convert_rows(int begin, int end, void *ctx)
+{
+  struct jpeg_decoder *dec = ctx;
+  struct row_resampler resamplers[JPEG_MAX_COMPONENTS];
+  unsigned char *linebufs = malloc((size_t)dec->no_components * (dec->width + 3));
+  if (linebufs == NULL)
+  {
+    atomic_store(&dec->failed, true);
+    return;
+  }
+
+  // the upsampling of a row depends on the rows before it, so replay it up to begin
+  for (int k = 0; k < dec->no_components; k++)
+  {
+    init_row_resampler(&resamplers[k], dec, &dec->comps[k]);
+    resamplers[k].linebuf = linebufs + (size_t)k * (dec->width + 3);
+    for (int j = 0; j < begin; j++)
+    {
+      next_resampled_row(&resamplers[k], &dec->comps[k]);
+    }
+  }
+
+  for (int j = begin; j < end; j++)
+  {
+    if (dec->planes != NULL)
+    {
+      convert_row_to_planes(dec, resamplers, j);
+    }
+    else
+    {
+      convert_row(dec, resamplers, dec->pixels + (size_t)j * dec->width * dec->out_comp);
+    }
+  }
+  free(linebufs);
+}
+
+// Markers and segments of a JPEG file being parsed
+struct jpeg_parser
+{
+  const unsigned char *p;
+  const unsigned char *end;
+};
+
+static int read_u16(const unsigned char *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+// read the next marker, skipping fill bytes (and anything else before it if junk is allowed),
+// returning -1 if there is none
+static int next_marker(struct jpeg_parser *parser, bool skip_junk)
+{
+  while (parser->p < parser->end && *parser->p != 0xFF && skip_junk)
+  {
+    parser->p++;
+  }
+  if (parser->p == parser->end || *parser->p != 0xFF)
+  {
+    return -1;
+  }
+  while (parser->p < parser->end && *parser->p == 0xFF)
+  {
+    parser->p++;
+  }
+  return parser->p < parser->end ? *parser->p++ : -1;
+}
+
+// take the payload of the segment at the parser (after its length), or NULL if it overruns the file
+static const unsigned char *take_segment(struct jpeg_parser *parser, int *length)
+{
+  if (parser->end - parser->p < 2)
+  {
+    return NULL;
+  }
+  *length = read_u16(parser->p) - 2;
+  if (*length < 0 || parser->end - parser->p - 2 < *length)
+  {
+    return NULL;
+  }
+  const unsigned char *payload = parser->p + 2;
+  parser->p = payload + *length;
+  return payload;
+}
+
+// read the tables and other segments that may come before a scan
+static bool parse_table_segment(struct jpeg_decoder *dec, int marker, const unsigned char *p, int length)
+{
+  const unsigned char *end = p + length;
+  switch (marker)
+  {
+  case JPEG_DRI:
+    if (length != 2)
+    {
+      return false;
+    }
+    dec->restart_interval = read_u16(p);
+    return true;
+
+  case JPEG_DQT:
+    while (p < end)
+    {
+      int sixteen = *p >> 4;
+      int t = *p++ & 15;
+      if (sixteen > 1 || t >= JPEG_MAX_TABLES || end - p < (sixteen ? 128 : 64))
+      {
+        return false;
+      }
+      for (int i = 0; i < JPEG_BLOCK_VALUES; i++, p += 1 + sixteen)
+      {
+        dec->dequant[t][dezigzag[i]] = (unsigned short)(sixteen ? read_u16(p) : *p);
+      }
+      dec->dequant_defined[t] = true;
+    }
+    return true;
+
+  case JPEG_DHT:
+    while (p < end)
+    {
+      if (end - p < 17)
+      {
+        return false;
+      }
+      int tc = *p >> 4;
+      int th = *p++ & 15;
+      if (tc > 1 || th >= JPEG_MAX_TABLES)
+      {
+        return false;
+      }
+      int counts[16], n = 0;
+      for (int i = 0; i < 16; i++)
+      {
+        counts[i] = *p++;
+        n += counts[i];
+      }
+      struct huffman_decoder *h = tc == 0 ? &dec->huff_dc[th] : &dec->huff_ac[th];
+      if (end - p < n || !build_huffman_decoder(h, counts))
+      {
+        return false;
+      }
+      memcpy(h->values, p, n);
+      p += n;
+      if (tc != 0)
+      {
+        build_fast_ac(h);
+      }
+      h->defined = true;
+    }
+    return true;
+
+  case JPEG_APP0:
+    if (length >= 5 && !memcmp(p, "JFIF", 5))
+    {
+      dec->jfif = true;
+    }
+    return true;
+
+  case JPEG_APP14:
+    if (length >= 12 && !memcmp(p, "Adobe", 6))
+    {
+      dec->app14_transform = p[11];
+    }
+    return true;
+  }
+
+  // other application segments and comments
+  return (marker >= JPEG_APP0 && marker <= JPEG_APP15) || marker == JPEG_COM;
+}
+
+// read a frame header (SOF0 or SOF1) and allocate the component planes
+static bool parse_frame_header(struct jpeg_decoder *dec, const unsigned char *p, int length)
+{
+  if (length < 6 || p[0] != 8)
+  {
+    return false;
+  }
+  dec->height = read_u16(p + 1);
+  dec->width = read_u16(p + 3);
+  dec->no_components = p[5];
+  if (dec->width == 0 || dec->height == 0 || (dec->no_components != 1 && dec->no_components != 3) ||
+      length != 6 + 3 * dec->no_components ||
+      (size_t)dec->width * dec->height * NO_RGB_VALUES > INT_MAX)
+  {
+    return false;
+  }
+
+  dec->h_max = dec->v_max = 1;
+  for (int i = 0; i < dec->no_components; i++)
+  {
+    static const unsigned char rgb_ids[JPEG_MAX_COMPONENTS] = {'R', 'G', 'B'};
+    struct jpeg_component *comp = &dec->comps[i];
+    const unsigned char *c = p + 6 + 3 * i;
+    comp->id = c[0];
+    dec->rgb_ids += dec->no_components == 3 && comp->id == rgb_ids[i];
+    comp->h = c[1] >> 4;
+    comp->v = c[1] & 15;
+    comp->tq = c[2];
+    if (comp->h < 1 || comp->h > JPEG_MAX_SAMPLING || comp->v < 1 || comp->v > JPEG_MAX_SAMPLING ||
+        comp->tq >= JPEG_MAX_TABLES)
+    {
+      return false;
+    }
+    dec->h_max = comp->h > dec->h_max ? comp->h : dec->h_max;
+    dec->v_max = comp->v > dec->v_max ? comp->v : dec->v_max;
+  }
+
+  dec->mcu_x = (dec->width + dec->h_max * 8 - 1) / (dec->h_max * 8);
+  dec->mcu_y = (dec->height + dec->v_max * 8 - 1) / (dec->v_max * 8);
+  for (int i = 0; i < dec->no_components; i++)
+  {
+    struct jpeg_component *comp = &dec->comps[i];
+    comp->x = (dec->width * comp->h + dec->h_max - 1) / dec->h_max;
+    comp->y = (dec->height * comp->v + dec->v_max - 1) / dec->v_max;
+    comp->w2 = dec->mcu_x * comp->h * 8;
+    comp->h2 = dec->mcu_y * comp->v * 8;
+  }
+
+  if (dec->no_components == 1)
+  {
+    // a single component's MCUs are its blocks
+    dec->mcu_x = (dec->comps[0].x + 7) / 8;
+    dec->mcu_y = (dec->comps[0].y + 7) / 8;
+  }
+
+  // a streamed row never needs samples beyond the MCU rows either side of its own
+  for (int i = 0; i < dec->no_components; i++)
+  {
+    struct jpeg_component *comp = &dec->comps[i];
+    comp->ring_rows = dec->streaming ? JPEG_STREAM_MCU_ROWS * component_mcu_rows(dec, comp) : comp->h2;
+    comp->data = malloc((size_t)comp->w2 * comp->ring_rows);
+    if (comp->data == NULL)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// read a scan header, accepting only a single scan of every component
+static bool parse_scan_header(struct jpeg_decoder *dec, const unsigned char *p, int length)
+{
+  if (length < 1 || p[0] != dec->no_components || length != 4 + 2 * dec->no_components)
+  {
+    return false;
+  }
+  for (int i = 0; i < dec->no_components; i++)
+  {
+    const unsigned char *c = p + 1 + 2 * i;
+    int which = 0;
+    while (which < dec->no_components && dec->comps[which].id != c[0])
+    {
+      which++;
+    }
+    if (which == dec->no_components)
+    {
+      return false;
+    }
+    struct jpeg_component *comp = &dec->comps[which];
+    comp->hd = c[1] >> 4;
+    comp->ha = c[1] & 15;
+    if (comp->hd >= JPEG_MAX_TABLES || comp->ha >= JPEG_MAX_TABLES || !dec->huff_dc[comp->hd].defined ||
+        !dec->huff_ac[comp->ha].defined || !dec->dequant_defined[comp->tq])
+    {
+      return false;
+    }
+    dec->scan_order[i] = which;
+  }
+
+  // baseline: all coefficients at full precision
+  const unsigned char *spectral = p + 1 + 2 * dec->no_components;
+  return spectral[0] == 0 && spectral[2] == 0;
+}
+
+// split the entropy coded data at p into restart intervals, returning the
+// marker ending the scan (or -1 if the data does not have one interval each)
+static int split_intervals(struct jpeg_decoder *dec, struct jpeg_parser *parser)
+{
+  int n = 0;
+  dec->intervals[0].start = parser->p;
+  for (;;)
+  {
+    const unsigned char *ff = memchr(parser->p, 0xFF, parser->end - parser->p);
+    if (ff == NULL)
+    {
+      return -1;
+    }
+    const unsigned char *q = ff + 1;
+    while (q < parser->end && *q == 0xFF)
+    {
+      q++;
+    }
+    if (q == parser->end)
+    {
+      return -1;
+    }
+    parser->p = q + 1;
+    if (*q == 0)
+    {
+      // a stuffed 0xFF data byte
+      continue;
+    }
+
+    dec->intervals[n++].end = ff;
+    if (*q < JPEG_RST0 || *q > JPEG_RST7)
+    {
+      return n == dec->no_intervals ? *q : -1;
+    }
+    if (n == dec->no_intervals)
+    {
+      return -1;
+    }
+    dec->intervals[n].start = parser->p;
+  }
+}
+
+// parse a whole JPEG file, up to its entropy coded data split into restart intervals
+static bool parse_jpeg(struct jpeg_decoder *dec, const unsigned char *data, size_t size)
+{
+  struct jpeg_parser parser = {data, data + size};
+  if (next_marker(&parser, false) != JPEG_SOI)
+  {
+    return false;
+  }
+
+  // tables and the like, up to the frame header
+  int marker;
+  while ((marker = next_marker(&parser, true)) != JPEG_SOF0 && marker != JPEG_SOF1)
+  {
+    int length;
+    const unsigned char *payload = take_segment(&parser, &length);
+    if (marker < 0 || payload == NULL || !parse_table_segment(dec, marker, payload, length))
+    {
+      return false;
+    }
+  }
+  int length;
+  const unsigned char *payload = take_segment(&parser, &length);
+  if (payload == NULL || !parse_frame_header(dec, payload, length))
+  {
+    return false;
+  }
+
+  // more tables, up to the scan
+  while ((marker = next_marker(&parser, false)) != JPEG_SOS)
+  {
+    payload = take_segment(&parser, &length);
+    if (marker < 0 || payload == NULL || !parse_table_segment(dec, marker, payload, length))
+    {
+      return false;
+    }
+  }
+  payload = take_segment(&parser, &length);
+  if (payload == NULL || !parse_scan_header(dec, payload, length) ||
+      (dec->restart_interval == 0 && !dec->streaming))
+  {
+    return false;
+  }
+
+  // without restart markers the whole scan is a single interval
+  int total = dec->mcu_x * dec->mcu_y;
+  dec->interval_mcus = dec->restart_interval > 0 ? dec->restart_interval : total;
+  dec->no_intervals = (total + dec->interval_mcus - 1) / dec->interval_mcus;
+  dec->intervals = malloc(dec->no_intervals * sizeof(struct jpeg_interval));
+  return dec->intervals != NULL && split_intervals(dec, &parser) == JPEG_EOI;
+}
+
+// free everything a decoder allocated but its pixels
+static void clear_jpeg_decoder(struct jpeg_decoder *dec)
+{
+  for (int i = 0; i < JPEG_MAX_COMPONENTS; i++)
+  {
+    free(dec->comps[i].data);
+  }
+  free(dec->intervals);
+  free(dec);
+}
+
+// map the whole file at path into memory, returning MAP_FAILED if it cannot be
+static void *map_jpeg_file(const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return MAP_FAILED;
+  }
+  struct stat info;
+  void *map = fstat(fd, &info) == 0 && info.st_size > 0
+                  ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+  close(fd);
+  *size = map != MAP_FAILED ? info.st_size : 0;
+  return map;
+}
+
+// parse a mapped JPEG file into a new decoder (keeping only a window of MCU
+// rows if streaming), returning NULL if it cannot be decoded
+static struct jpeg_decoder *open_jpeg_decoder(const unsigned char *data, size_t size, bool streaming)
+{
+  struct jpeg_decoder *dec = calloc(1, sizeof(struct jpeg_decoder));
+  if (dec == NULL)
+  {
+    return NULL;
+  }
+  dec->app14_transform = -1;
+  dec->streaming = streaming;
+  atomic_init(&dec->failed, false);
+  if (!parse_jpeg(dec, data, size))
+  {
+    clear_jpeg_decoder(dec);
+    return NULL;
+  }
+  return dec;
+}
+
+// decode the JPEG at path into interleaved bytes or float planes (with req_comp
+// values per pixel, or as many as the file has), returning the output or NULL
+static void *decode_jpeg(const char *path, int *width, int *height, int *comp, int req_comp, bool planar)
+{
+  // with a single thread there is nothing to gain over sod's own decoder
+  if ((req_comp != 0 && req_comp != NO_RGB_VALUES) || get_picture_pool_size() < 2)
+  {
+    return NULL;
+  }
+
+  size_t size;
+  void *map = map_jpeg_file(path, &size);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  struct jpeg_decoder *dec = open_jpeg_decoder(map, size, false);
+  bool decoded = dec != NULL;
+  if (decoded)
+  {
+    dec->out_comp = req_comp ? req_comp : dec->no_components;
+  }
+
+  // Huffman decode and inverse transform the intervals, then upsample and colour convert the rows
+  if (decoded)
+  {
+    size_t values = (size_t)dec->width * dec->height * dec->out_comp;
+    if (planar)
+    {
+      dec->planes = malloc(values * sizeof(float));
+      decoded = dec->planes != NULL;
+      for (int i = 0; i < 256; i++)
+      {
+        // the same rounding as sod's own conversion to planes
+        dec->sample_values[i] = (float)i / 255.;
+      }
+    }
+    else
+    {
+      dec->pixels = malloc(values);
+      decoded = dec->pixels != NULL;
+    }
+  }
+  if (decoded)
+  {
+    thpool_parallel_for(get_picture_pool(), 0, dec->no_intervals, 1, decode_intervals, dec);
+  }
+  if (decoded && !atomic_load(&dec->failed))
+  {
+    int rows = ROW_GRAIN_BYTES / (dec->width * dec->out_comp);
+    thpool_parallel_for(get_picture_pool(), 0, dec->height, rows > 0 ? rows : 1, convert_rows, dec);
+  }
+  munmap(map, size);
+
+  void *output = NULL;
+  if (dec != NULL)
+  {
+    decoded = decoded && !atomic_load(&dec->failed);
+    if (decoded)
+    {
+      output = planar ? (void *)dec->planes : (void *)dec->pixels;
+      *width = dec->width;
+      *height = dec->height;
+      *comp = dec->out_comp;
+    }
+    else
+    {
+      free(dec->pixels);
+      free(dec->planes);
+    }
+    clear_jpeg_decoder(dec);
+  }
+  return output;
+}
+
+unsigned char *read_jpeg(const char *path, int *width, int *height, int *comp, int req_comp)
+{
+  return decode_jpeg(path, width, height, comp, req_comp, false);
+}
+
+float *read_jpeg_planes(const char *path, int *width, int *height, int *comp)
+{
+  return decode_jpeg(path, width, height, comp, 0, true);
+}
+
+// A JPEG being decoded a row at a time
+struct jpeg_reader
+{
+  struct jpeg_decoder *dec;
+  void *map;
+  size_t map_size;
+  struct mcu_cursor cursor;
+  // rows of MCUs decoded so far
+  int mcu_rows;
+  struct row_resampler resamplers[JPEG_MAX_COMPONENTS];
+  unsigned char *linebufs;
+};
+
+struct jpeg_reader *open_jpeg_reader(const char *path, int *width, int *height)
+{
+  struct jpeg_reader *reader = calloc(1, sizeof(struct jpeg_reader));
+  if (reader == NULL)
+  {
+    return NULL;
+  }
+  reader->map = map_jpeg_file(path, &reader->map_size);
+  if (reader->map == MAP_FAILED)
+  {
+    free(reader);
+    return NULL;
+  }
+  reader->dec = open_jpeg_decoder(reader->map, reader->map_size, true);
+  struct jpeg_decoder *dec = reader->dec;
+  if (dec != NULL)
+  {
+    dec->out_comp = NO_RGB_VALUES;
+    reader->linebufs = malloc((size_t)dec->no_components * (dec->width + 3));
+  }
+  if (dec == NULL || reader->linebufs == NULL)
+  {
+    close_jpeg_reader(reader);
+    return NULL;
+  }
+
+  start_interval(dec, &reader->cursor, 0);
+  for (int k = 0; k < dec->no_components; k++)
+  {
+    init_row_resampler(&reader->resamplers[k], dec, &dec->comps[k]);
+    reader->resamplers[k].linebuf = reader->linebufs + (size_t)k * (dec->width + 3);
+  }
+  *width = dec->width;
+  *height = dec->height;
+  return reader;
+}
+
+bool read_jpeg_row(struct jpeg_reader *reader, unsigned char *row)
+{
+  // decode as far as the MCU row holding the lowest sample the row is upsampled from
+  struct jpeg_decoder *dec = reader->dec;
+  int needed = 0;
+  for (int k = 0; k < dec->no_components; k++)
+  {
+    int mcu_row = reader->resamplers[k].line1 / component_mcu_rows(dec, &dec->comps[k]);
+    needed = mcu_row > needed ? mcu_row : needed;
+  }
+  while (reader->mcu_rows <= needed)
+  {
+    if (!decode_mcus(dec, &reader->cursor, (reader->mcu_rows + 1) * dec->mcu_x))
+    {
+      return false;
+    }
+    reader->mcu_rows++;
+  }
+
+  convert_row(dec, reader->resamplers, row);
+  return true;
+}
+
+void close_jpeg_reader(struct jpeg_reader *reader)
+{
+  if (reader == NULL)
+  {
+    return;
+  }
+  if (reader->dec != NULL)
+  {
+    clear_jpeg_decoder(reader->dec);
+  }
+  if (reader->map != NULL)
+  {
+    munmap(reader->map, reader->map_size);
+  }
+  free(reader->linebufs);
+  free(reader);
+}
@@ -0,0 +1,74 @@
+#ifndef PICJPEG_H
+#define PICJPEG_H
+
+#include <stdbool.h>
+
+// number of 8x8 pixel blocks the encoder aims to put in each restart interval
+// NOTE: intervals always hold whole rows of blocks, so wide images get one row each
+#define JPEG_RESTART_BLOCKS 512
+
+// Save interleaved 8-bit pixels (comp values each, 1 - 4) to path as a baseline
+// JPEG of the given quality (1 - 100), in the format sod's own writer produces.
+// Bands of block rows are transformed, quantised and Huffman coded in parallel
+// on the shared pool, each as its own restart interval, and joined with RSTn
+// markers. The pixels decode exactly as they would from sod's single-threaded
+// encoder, and the file does not depend on the number of threads.
+bool write_jpeg(const char *path, const unsigned char *pixels, int width, int height,
+                int comp, int quality);
+
+// A JPEG being saved a row at a time
+struct jpeg_writer;
+
+// Start saving a picture of the given size to path, as write_jpeg() would, with
+// its rows given in order by write_jpeg_row(). Each band is encoded on the shared
+// pool as soon as its last row is given, and written out in turn, so only a few
+// bands are ever held at once and the file is the same as write_jpeg() makes.
+// Returns NULL if the file cannot be written.
+struct jpeg_writer *open_jpeg_writer(const char *path, int width, int height, int comp, int quality);
+
+// give the next row of a picture being saved (width * comp values), returning
+// false if the file could not be written so far
+bool write_jpeg_row(struct jpeg_writer *writer, const unsigned char *row);
+
+// finish a picture being saved, returning false if it was not given every row or
+// could not be written, and release the writer
+bool close_jpeg_writer(struct jpeg_writer *writer);
+
+// Read the baseline JPEG at path into interleaved 8-bit pixels, with req_comp
+// values each (0 for as many as the file has, or 3), setting comp to that number.
+// The entropy coded data is split at its RSTn markers, and the restart intervals
+// are Huffman decoded and inverse transformed in parallel on the shared pool
+// before rows are upsampled and colour converted in parallel. The pixels are
+// exactly those sod's reader decodes. Returns NULL, without reporting anything,
+// for files without restart intervals and any this does not handle (progressive,
+// CMYK, multi-scan or damaged ones), which are left to sod, as is everything
+// when the pool has a single thread.
+unsigned char *read_jpeg(const char *path, int *width, int *height, int *comp, int req_comp);
+
+// Read a JPEG as read_jpeg() does (with as many values per pixel as the file
+// has), straight into one plane of floats (value / 255) per colour, the layout
+// of a sod image. Each row is colour converted straight into the planes, so no
+// interleaved copy of the picture (or of a row) is made.
+float *read_jpeg_planes(const char *path, int *width, int *height, int *comp);
+
+// A JPEG being read a row at a time
+struct jpeg_reader;
+
+// Open the baseline JPEG at path to read its rows in order as interleaved RGB
+// values with read_jpeg_row(), setting its size. The MCU rows are Huffman decoded
+// and inverse transformed as the rows need them, on the caller's thread, into a
+// window of three MCU rows per component, so the memory used grows with the
+// width of the picture but not its height. Files with or without restart
+// intervals are read, to exactly the pixels sod's reader decodes. Returns NULL,
+// without reporting anything, for files this does not handle (progressive,
+// CMYK, multi-scan or damaged ones).
+struct jpeg_reader *open_jpeg_reader(const char *path, int *width, int *height);
+
+// read the next row of a picture into row (width * 3 values), returning false
+// if the file turns out to be damaged (in which case sod rejects it too)
+bool read_jpeg_row(struct jpeg_reader *reader, unsigned char *row);
+
+// release a reader, whether or not every row was read
+void close_jpeg_reader(struct jpeg_reader *reader);
+
+#endif
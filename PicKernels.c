@@ -0,0 +1,915 @@
+#include "PicKernels.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Picture.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define NO_RGB_COMPONENTS 3
+#define BLUR_REGION_SIZE 9
+#define MAX_KERNEL_SETS 3
+
+// u16 reciprocals: x / 3 == (x * DIV3_MUL) >> 17 for x <= 765 (3 * 255) and
+// x / 9 == (x * DIV9_MUL) >> 19 for x <= 2295 (9 * 255)
+#define DIV3_MUL 0xAAAB
+#define DIV3_SHIFT 1
+#define DIV9_MUL 0xE38F
+#define DIV9_SHIFT 3
+
+/* ---------- scalar kernels ---------- */
+
+static void invert_row_scalar(unsigned char *rgb, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  for (int k = 0; k < size; k++)
+  {
+    rgb[k] = MAX_PIXEL_INTENSITY - rgb[k];
+  }
+}
+
+static void grayscale_row_scalar(unsigned char *rgb, int width)
+{
+  for (int i = 0; i < width; i++, rgb += NO_PICTURE_CHANNELS)
+  {
+    // compute gray average of pixel's RGB values
+    int avg = (rgb[RED] + rgb[GREEN] + rgb[BLUE]) / NO_RGB_COMPONENTS;
+    rgb[RED] = rgb[GREEN] = rgb[BLUE] = avg;
+  }
+}
+
+// blur samples [from, to) of a row (used for the tails of the vector kernels)
+static void blur_samples_scalar(const unsigned char *above, const unsigned char *row,
+                                const unsigned char *below, unsigned char *out, int from, int to)
+{
+  const int c = NO_PICTURE_CHANNELS;
+  for (int k = from; k < to; k++)
+  {
+    int sum = above[k - c] + above[k] + above[k + c] +
+              row[k - c] + row[k] + row[k + c] +
+              below[k - c] + below[k] + below[k + c];
+    out[k] = sum / BLUR_REGION_SIZE;
+  }
+}
+
+static void blur_row_scalar(const unsigned char *above, const unsigned char *row,
+                            const unsigned char *below, unsigned char *out, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  if (width < 3)
+  {
+    memcpy(out, row, size);
+    return;
+  }
+
+  // don't need to modify boundary pixels
+  memcpy(out, row, NO_PICTURE_CHANNELS);
+  memcpy(out + size - NO_PICTURE_CHANNELS, row + size - NO_PICTURE_CHANNELS, NO_PICTURE_CHANNELS);
+  blur_samples_scalar(above, row, below, out, NO_PICTURE_CHANNELS, size - NO_PICTURE_CHANNELS);
+}
+
+// JFIF RGB to YCbCr coefficients (as signed multipliers of the red, green and blue values)
+#define JPEG_Y_R 0.29900f
+#define JPEG_Y_G 0.58700f
+#define JPEG_Y_B 0.11400f
+#define JPEG_CB_R -0.16874f
+#define JPEG_CB_G 0.33126f
+#define JPEG_CB_B 0.50000f
+#define JPEG_CR_R 0.50000f
+#define JPEG_CR_G 0.41869f
+#define JPEG_CR_B 0.08131f
+#define JPEG_LEVEL_SHIFT 128
+
+// AAN forward DCT rotations
+#define DCT_C4 0.707106781f
+#define DCT_C6 0.382683433f
+#define DCT_C2_MINUS_C6 0.541196100f
+#define DCT_C2_PLUS_C6 1.306562965f
+
+// split an 8x8 block of interleaved pixels into its red, green and blue values
+static void split_jpeg_block(const unsigned char *rgb, float *r, float *g, float *b)
+{
+  for (int i = 0; i < JPEG_BLOCK_VALUES; i++, rgb += NO_PICTURE_CHANNELS)
+  {
+    r[i] = rgb[RED];
+    g[i] = rgb[GREEN];
+    b[i] = rgb[BLUE];
+  }
+}
+
+// one-dimensional AAN forward DCT of eight values, stride elements apart (in place)
+// NOTE: the vector kernels repeat these operations in the same order, lane by lane
+static void dct_8_scalar(float *d, int stride)
+{
+  float d0 = d[0], d1 = d[stride], d2 = d[2 * stride], d3 = d[3 * stride];
+  float d4 = d[4 * stride], d5 = d[5 * stride], d6 = d[6 * stride], d7 = d[7 * stride];
+
+  float tmp0 = d0 + d7;
+  float tmp7 = d0 - d7;
+  float tmp1 = d1 + d6;
+  float tmp6 = d1 - d6;
+  float tmp2 = d2 + d5;
+  float tmp5 = d2 - d5;
+  float tmp3 = d3 + d4;
+  float tmp4 = d3 - d4;
+
+  // even part
+  float tmp10 = tmp0 + tmp3;
+  float tmp13 = tmp0 - tmp3;
+  float tmp11 = tmp1 + tmp2;
+  float tmp12 = tmp1 - tmp2;
+
+  d[0] = tmp10 + tmp11;
+  d[4 * stride] = tmp10 - tmp11;
+
+  float z1 = (tmp12 + tmp13) * DCT_C4;
+  d[2 * stride] = tmp13 + z1;
+  d[6 * stride] = tmp13 - z1;
+
+  // odd part
+  tmp10 = tmp4 + tmp5;
+  tmp11 = tmp5 + tmp6;
+  tmp12 = tmp6 + tmp7;
+
+  float z5 = (tmp10 - tmp12) * DCT_C6;
+  float z2 = tmp10 * DCT_C2_MINUS_C6 + z5;
+  float z4 = tmp12 * DCT_C2_PLUS_C6 + z5;
+  float z3 = tmp11 * DCT_C4;
+
+  float z11 = tmp7 + z3;
+  float z13 = tmp7 - z3;
+
+  d[5 * stride] = z13 + z2;
+  d[3 * stride] = z13 - z2;
+  d[stride] = z11 + z4;
+  d[7 * stride] = z11 - z4;
+}
+
+static void jpeg_block_scalar(const unsigned char *rgb, const float *fdtbl_y, const float *fdtbl_uv,
+                              int coefs[3 * JPEG_BLOCK_VALUES])
+{
+  float r[JPEG_BLOCK_VALUES], g[JPEG_BLOCK_VALUES], b[JPEG_BLOCK_VALUES];
+  split_jpeg_block(rgb, r, g, b);
+
+  float blocks[3][JPEG_BLOCK_VALUES];
+  for (int i = 0; i < JPEG_BLOCK_VALUES; i++)
+  {
+    blocks[0][i] = JPEG_Y_R * r[i] + JPEG_Y_G * g[i] + JPEG_Y_B * b[i] - JPEG_LEVEL_SHIFT;
+    blocks[1][i] = JPEG_CB_R * r[i] - JPEG_CB_G * g[i] + JPEG_CB_B * b[i];
+    blocks[2][i] = JPEG_CR_R * r[i] - JPEG_CR_G * g[i] - JPEG_CR_B * b[i];
+  }
+
+  for (int c = 0; c < 3; c++)
+  {
+    float *block = blocks[c];
+    // rows, then columns
+    for (int i = 0; i < JPEG_BLOCK_VALUES; i += 8)
+    {
+      dct_8_scalar(&block[i], 1);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+      dct_8_scalar(&block[i], 8);
+    }
+
+    // round half away from zero
+    const float *fdtbl = c == 0 ? fdtbl_y : fdtbl_uv;
+    for (int i = 0; i < JPEG_BLOCK_VALUES; i++)
+    {
+      float v = block[i] * fdtbl[i];
+      coefs[c * JPEG_BLOCK_VALUES + i] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+    }
+  }
+}
+
+static const struct pic_kernels scalar_kernels = {
+    "scalar",
+    invert_row_scalar,
+    grayscale_row_scalar,
+    blur_row_scalar,
+    jpeg_block_scalar};
+
+#ifdef KERNELS_X86
+
+/* ---------- SSE2 kernels ---------- */
+
+static void invert_row_sse2(unsigned char *rgb, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  const __m128i ones = _mm_set1_epi8(-1);
+  int k = 0;
+
+  // 255 - v is ~v for 8-bit values
+  for (; k + 16 <= size; k += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(rgb + k));
+    _mm_storeu_si128((__m128i *)(rgb + k), _mm_xor_si128(v, ones));
+  }
+  for (; k < size; k++)
+  {
+    rgb[k] = MAX_PIXEL_INTENSITY - rgb[k];
+  }
+}
+
+// sum of the three bytes starting at each offset of p, as two u16 vectors (lo, hi)
+static inline void sum3_sse2(const unsigned char *p, __m128i *lo, __m128i *hi)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = _mm_loadu_si128((const __m128i *)p);
+  __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+  __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+  *lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                      _mm_unpacklo_epi8(c, zero));
+  *hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                      _mm_unpackhi_epi8(c, zero));
+}
+
+// average of the three bytes starting at each offset of p
+static inline __m128i avg3_sse2(const unsigned char *p)
+{
+  const __m128i mul = _mm_set1_epi16((short)DIV3_MUL);
+  __m128i lo, hi;
+  sum3_sse2(p, &lo, &hi);
+  lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, mul), DIV3_SHIFT);
+  hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, mul), DIV3_SHIFT);
+  return _mm_packus_epi16(lo, hi);
+}
+
+// Each output byte k needs the average of the pixel it belongs to, which starts at
+// k, k - 1 or k - 2 depending on k % 3. All three candidate averages are computed
+// and the right one is picked with a mask that repeats every 48 bytes (16 pixels).
+// Every input of a 48-byte block is loaded before any of it is written back.
+static void grayscale_row_sse2(unsigned char *rgb, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  __m128i masks[3][3];
+  for (int v = 0; v < 3; v++)
+  {
+    unsigned char m[3][16];
+    for (int b = 0; b < 16; b++)
+    {
+      int phase = (v * 16 + b) % 3;
+      for (int s = 0; s < 3; s++)
+      {
+        m[s][b] = phase == s ? 0xFF : 0;
+      }
+    }
+    for (int s = 0; s < 3; s++)
+    {
+      masks[v][s] = _mm_loadu_si128((const __m128i *)m[s]);
+    }
+  }
+
+  // the first block is done by the scalar kernel so the k - 2 loads stay in bounds
+  int k = 48;
+  grayscale_row_scalar(rgb, (size < k ? size : k) / NO_PICTURE_CHANNELS);
+  for (; k + 48 + 2 <= size; k += 48)
+  {
+    __m128i out[3];
+    for (int v = 0; v < 3; v++)
+    {
+      const unsigned char *p = rgb + k + v * 16;
+      __m128i from0 = avg3_sse2(p);
+      __m128i from1 = avg3_sse2(p - 1);
+      __m128i from2 = avg3_sse2(p - 2);
+      out[v] = _mm_or_si128(_mm_or_si128(_mm_and_si128(from0, masks[v][0]),
+                                         _mm_and_si128(from1, masks[v][1])),
+                            _mm_and_si128(from2, masks[v][2]));
+    }
+    for (int v = 0; v < 3; v++)
+    {
+      _mm_storeu_si128((__m128i *)(rgb + k + v * 16), out[v]);
+    }
+  }
+  if (k < size)
+  {
+    grayscale_row_scalar(rgb + k, (size - k) / NO_PICTURE_CHANNELS);
+  }
+}
+
+// 3x3 region sums of the 16 samples starting at k, as two u16 vectors (lo, hi)
+static inline void region_sum_sse2(const unsigned char *above, const unsigned char *row,
+                                   const unsigned char *below, int k, __m128i *lo, __m128i *hi)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const unsigned char *rows[3] = {above, row, below};
+  *lo = *hi = zero;
+  for (int r = 0; r < 3; r++)
+  {
+    for (int n = -1; n <= 1; n++)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(rows[r] + k + n * NO_PICTURE_CHANNELS));
+      *lo = _mm_add_epi16(*lo, _mm_unpacklo_epi8(v, zero));
+      *hi = _mm_add_epi16(*hi, _mm_unpackhi_epi8(v, zero));
+    }
+  }
+}
+
+static void blur_row_sse2(const unsigned char *above, const unsigned char *row,
+                          const unsigned char *below, unsigned char *out, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  if (width < 3)
+  {
+    memcpy(out, row, size);
+    return;
+  }
+
+  // don't need to modify boundary pixels
+  memcpy(out, row, NO_PICTURE_CHANNELS);
+  memcpy(out + size - NO_PICTURE_CHANNELS, row + size - NO_PICTURE_CHANNELS, NO_PICTURE_CHANNELS);
+
+  const __m128i mul = _mm_set1_epi16((short)DIV9_MUL);
+  int end = size - NO_PICTURE_CHANNELS;
+  int k = NO_PICTURE_CHANNELS;
+  for (; k + 16 + NO_PICTURE_CHANNELS <= size; k += 16)
+  {
+    __m128i lo, hi;
+    region_sum_sse2(above, row, below, k, &lo, &hi);
+    lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, mul), DIV9_SHIFT);
+    hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, mul), DIV9_SHIFT);
+    _mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(lo, hi));
+  }
+  blur_samples_scalar(above, row, below, out, k, end);
+}
+
+// one-dimensional forward DCT of eight vectors, stride vectors apart (in place), as dct_8_scalar()
+static inline void dct_8_sse2(__m128 *d, int stride)
+{
+  __m128 d0 = d[0], d1 = d[stride], d2 = d[2 * stride], d3 = d[3 * stride];
+  __m128 d4 = d[4 * stride], d5 = d[5 * stride], d6 = d[6 * stride], d7 = d[7 * stride];
+
+  __m128 tmp0 = _mm_add_ps(d0, d7);
+  __m128 tmp7 = _mm_sub_ps(d0, d7);
+  __m128 tmp1 = _mm_add_ps(d1, d6);
+  __m128 tmp6 = _mm_sub_ps(d1, d6);
+  __m128 tmp2 = _mm_add_ps(d2, d5);
+  __m128 tmp5 = _mm_sub_ps(d2, d5);
+  __m128 tmp3 = _mm_add_ps(d3, d4);
+  __m128 tmp4 = _mm_sub_ps(d3, d4);
+
+  // even part
+  __m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+  __m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+  __m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+  __m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+  d[0] = _mm_add_ps(tmp10, tmp11);
+  d[4 * stride] = _mm_sub_ps(tmp10, tmp11);
+
+  __m128 z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(DCT_C4));
+  d[2 * stride] = _mm_add_ps(tmp13, z1);
+  d[6 * stride] = _mm_sub_ps(tmp13, z1);
+
+  // odd part
+  tmp10 = _mm_add_ps(tmp4, tmp5);
+  tmp11 = _mm_add_ps(tmp5, tmp6);
+  tmp12 = _mm_add_ps(tmp6, tmp7);
+
+  __m128 z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(DCT_C6));
+  __m128 z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(DCT_C2_MINUS_C6)), z5);
+  __m128 z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(DCT_C2_PLUS_C6)), z5);
+  __m128 z3 = _mm_mul_ps(tmp11, _mm_set1_ps(DCT_C4));
+
+  __m128 z11 = _mm_add_ps(tmp7, z3);
+  __m128 z13 = _mm_sub_ps(tmp7, z3);
+
+  d[5 * stride] = _mm_add_ps(z13, z2);
+  d[3 * stride] = _mm_sub_ps(z13, z2);
+  d[stride] = _mm_add_ps(z11, z4);
+  d[7 * stride] = _mm_sub_ps(z11, z4);
+}
+
+// transpose an 8x8 block held as the left and right halves of each row (row r half h in x[2r + h])
+static inline void transpose_8x8_sse2(__m128 *x)
+{
+  __m128 t[16];
+  for (int qr = 0; qr < 2; qr++)
+  {
+    for (int qc = 0; qc < 2; qc++)
+    {
+      __m128 a = x[(4 * qr + 0) * 2 + qc];
+      __m128 b = x[(4 * qr + 1) * 2 + qc];
+      __m128 c = x[(4 * qr + 2) * 2 + qc];
+      __m128 d = x[(4 * qr + 3) * 2 + qc];
+      _MM_TRANSPOSE4_PS(a, b, c, d);
+      t[(4 * qc + 0) * 2 + qr] = a;
+      t[(4 * qc + 1) * 2 + qr] = b;
+      t[(4 * qc + 2) * 2 + qr] = c;
+      t[(4 * qc + 3) * 2 + qr] = d;
+    }
+  }
+  memcpy(x, t, sizeof(t));
+}
+
+// store the rounded (half away from zero) quantised values of four coefficients
+static inline void quantise_sse2(__m128 v, __m128 fdtbl, int *out)
+{
+  v = _mm_mul_ps(v, fdtbl);
+  __m128 negative = _mm_cmplt_ps(v, _mm_setzero_ps());
+  __m128 half = _mm_or_ps(_mm_and_ps(negative, _mm_set1_ps(-0.5f)), _mm_andnot_ps(negative, _mm_set1_ps(0.5f)));
+  _mm_storeu_si128((__m128i *)out, _mm_cvttps_epi32(_mm_add_ps(v, half)));
+}
+
+static void jpeg_block_sse2(const unsigned char *rgb, const float *fdtbl_y, const float *fdtbl_uv,
+                            int coefs[3 * JPEG_BLOCK_VALUES])
+{
+  float r[JPEG_BLOCK_VALUES], g[JPEG_BLOCK_VALUES], b[JPEG_BLOCK_VALUES];
+  split_jpeg_block(rgb, r, g, b);
+
+  // the three component blocks, each as the left and right halves of its rows
+  __m128 blocks[3][16];
+  for (int k = 0; k < 16; k++)
+  {
+    __m128 vr = _mm_loadu_ps(r + 4 * k);
+    __m128 vg = _mm_loadu_ps(g + 4 * k);
+    __m128 vb = _mm_loadu_ps(b + 4 * k);
+    blocks[0][k] = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(JPEG_Y_R), vr),
+                                                    _mm_mul_ps(_mm_set1_ps(JPEG_Y_G), vg)),
+                                         _mm_mul_ps(_mm_set1_ps(JPEG_Y_B), vb)),
+                              _mm_set1_ps(JPEG_LEVEL_SHIFT));
+    blocks[1][k] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(JPEG_CB_R), vr),
+                                         _mm_mul_ps(_mm_set1_ps(JPEG_CB_G), vg)),
+                              _mm_mul_ps(_mm_set1_ps(JPEG_CB_B), vb));
+    blocks[2][k] = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(JPEG_CR_R), vr),
+                                         _mm_mul_ps(_mm_set1_ps(JPEG_CR_G), vg)),
+                              _mm_mul_ps(_mm_set1_ps(JPEG_CR_B), vb));
+  }
+
+  for (int c = 0; c < 3; c++)
+  {
+    __m128 *x = blocks[c];
+    // rows (as columns of the transposed block, four rows per vector), then columns
+    transpose_8x8_sse2(x);
+    dct_8_sse2(x, 2);
+    dct_8_sse2(x + 1, 2);
+    transpose_8x8_sse2(x);
+    dct_8_sse2(x, 2);
+    dct_8_sse2(x + 1, 2);
+
+    const float *fdtbl = c == 0 ? fdtbl_y : fdtbl_uv;
+    for (int k = 0; k < 16; k++)
+    {
+      quantise_sse2(x[k], _mm_loadu_ps(fdtbl + 4 * k), coefs + c * JPEG_BLOCK_VALUES + 4 * k);
+    }
+  }
+}
+
+static const struct pic_kernels sse2_kernels = {
+    "sse2",
+    invert_row_sse2,
+    grayscale_row_sse2,
+    blur_row_sse2,
+    jpeg_block_sse2};
+
+/* ---------- AVX2 kernels ---------- */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void invert_row_avx2(unsigned char *rgb, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  const __m256i ones = _mm256_set1_epi8(-1);
+  int k = 0;
+
+  // 255 - v is ~v for 8-bit values
+  for (; k + 32 <= size; k += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(rgb + k));
+    _mm256_storeu_si256((__m256i *)(rgb + k), _mm256_xor_si256(v, ones));
+  }
+  for (; k < size; k++)
+  {
+    rgb[k] = MAX_PIXEL_INTENSITY - rgb[k];
+  }
+}
+
+// average of the three bytes starting at each offset of p
+// NOTE: unpack/pack work within 128-bit lanes, so the byte order is preserved
+AVX2 static inline __m256i avg3_avx2(const unsigned char *p)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mul = _mm256_set1_epi16((short)DIV3_MUL);
+  __m256i a = _mm256_loadu_si256((const __m256i *)p);
+  __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+  __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+  __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                                 _mm256_unpacklo_epi8(b, zero)),
+                                _mm256_unpacklo_epi8(c, zero));
+  __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                                 _mm256_unpackhi_epi8(b, zero)),
+                                _mm256_unpackhi_epi8(c, zero));
+  lo = _mm256_srli_epi16(_mm256_mulhi_epu16(lo, mul), DIV3_SHIFT);
+  hi = _mm256_srli_epi16(_mm256_mulhi_epu16(hi, mul), DIV3_SHIFT);
+  return _mm256_packus_epi16(lo, hi);
+}
+
+// same scheme as grayscale_row_sse2, with the mask repeating every 96 bytes (32 pixels)
+AVX2 static void grayscale_row_avx2(unsigned char *rgb, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  __m256i masks[3][3];
+  for (int v = 0; v < 3; v++)
+  {
+    unsigned char m[3][32];
+    for (int b = 0; b < 32; b++)
+    {
+      int phase = (v * 32 + b) % 3;
+      for (int s = 0; s < 3; s++)
+      {
+        m[s][b] = phase == s ? 0xFF : 0;
+      }
+    }
+    for (int s = 0; s < 3; s++)
+    {
+      masks[v][s] = _mm256_loadu_si256((const __m256i *)m[s]);
+    }
+  }
+
+  // the first block is done by the scalar kernel so the k - 2 loads stay in bounds
+  int k = 96;
+  grayscale_row_scalar(rgb, (size < k ? size : k) / NO_PICTURE_CHANNELS);
+  for (; k + 96 + 2 <= size; k += 96)
+  {
+    __m256i out[3];
+    for (int v = 0; v < 3; v++)
+    {
+      const unsigned char *p = rgb + k + v * 32;
+      __m256i from0 = avg3_avx2(p);
+      __m256i from1 = avg3_avx2(p - 1);
+      __m256i from2 = avg3_avx2(p - 2);
+      out[v] = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(from0, masks[v][0]),
+                                               _mm256_and_si256(from1, masks[v][1])),
+                               _mm256_and_si256(from2, masks[v][2]));
+    }
+    for (int v = 0; v < 3; v++)
+    {
+      _mm256_storeu_si256((__m256i *)(rgb + k + v * 32), out[v]);
+    }
+  }
+  if (k < size)
+  {
+    grayscale_row_scalar(rgb + k, (size - k) / NO_PICTURE_CHANNELS);
+  }
+}
+
+AVX2 static void blur_row_avx2(const unsigned char *above, const unsigned char *row,
+                               const unsigned char *below, unsigned char *out, int width)
+{
+  int size = width * NO_PICTURE_CHANNELS;
+  if (width < 3)
+  {
+    memcpy(out, row, size);
+    return;
+  }
+
+  // don't need to modify boundary pixels
+  memcpy(out, row, NO_PICTURE_CHANNELS);
+  memcpy(out + size - NO_PICTURE_CHANNELS, row + size - NO_PICTURE_CHANNELS, NO_PICTURE_CHANNELS);
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mul = _mm256_set1_epi16((short)DIV9_MUL);
+  const unsigned char *rows[3] = {above, row, below};
+  int end = size - NO_PICTURE_CHANNELS;
+  int k = NO_PICTURE_CHANNELS;
+  for (; k + 32 + NO_PICTURE_CHANNELS <= size; k += 32)
+  {
+    __m256i lo = zero;
+    __m256i hi = zero;
+    for (int r = 0; r < 3; r++)
+    {
+      for (int n = -1; n <= 1; n++)
+      {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(rows[r] + k + n * NO_PICTURE_CHANNELS));
+        lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v, zero));
+        hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v, zero));
+      }
+    }
+    lo = _mm256_srli_epi16(_mm256_mulhi_epu16(lo, mul), DIV9_SHIFT);
+    hi = _mm256_srli_epi16(_mm256_mulhi_epu16(hi, mul), DIV9_SHIFT);
+    _mm256_storeu_si256((__m256i *)(out + k), _mm256_packus_epi16(lo, hi));
+  }
+  blur_samples_scalar(above, row, below, out, k, end);
+}
+
+// one-dimensional forward DCT of eight vectors (in place), as dct_8_scalar()
+AVX2 static inline void dct_8_avx2(__m256 *d)
+{
+  __m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+  __m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+  __m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+  __m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+  __m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+  __m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+  __m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+  __m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+  // even part
+  __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+  __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+  __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+  __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+  d[0] = _mm256_add_ps(tmp10, tmp11);
+  d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+  __m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(DCT_C4));
+  d[2] = _mm256_add_ps(tmp13, z1);
+  d[6] = _mm256_sub_ps(tmp13, z1);
+
+  // odd part
+  tmp10 = _mm256_add_ps(tmp4, tmp5);
+  tmp11 = _mm256_add_ps(tmp5, tmp6);
+  tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+  __m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(DCT_C6));
+  __m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(DCT_C2_MINUS_C6)), z5);
+  __m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(DCT_C2_PLUS_C6)), z5);
+  __m256 z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(DCT_C4));
+
+  __m256 z11 = _mm256_add_ps(tmp7, z3);
+  __m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+  d[5] = _mm256_add_ps(z13, z2);
+  d[3] = _mm256_sub_ps(z13, z2);
+  d[1] = _mm256_add_ps(z11, z4);
+  d[7] = _mm256_sub_ps(z11, z4);
+}
+
+// transpose an 8x8 block held as one vector per row
+AVX2 static inline void transpose_8x8_avx2(__m256 *x)
+{
+  __m256 t[8], u[8];
+  for (int k = 0; k < 8; k += 2)
+  {
+    t[k] = _mm256_unpacklo_ps(x[k], x[k + 1]);
+    t[k + 1] = _mm256_unpackhi_ps(x[k], x[k + 1]);
+  }
+  for (int k = 0; k < 8; k += 4)
+  {
+    u[k] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(1, 0, 1, 0));
+    u[k + 1] = _mm256_shuffle_ps(t[k], t[k + 2], _MM_SHUFFLE(3, 2, 3, 2));
+    u[k + 2] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(1, 0, 1, 0));
+    u[k + 3] = _mm256_shuffle_ps(t[k + 1], t[k + 3], _MM_SHUFFLE(3, 2, 3, 2));
+  }
+  for (int k = 0; k < 4; k++)
+  {
+    x[k] = _mm256_permute2f128_ps(u[k], u[k + 4], 0x20);
+    x[k + 4] = _mm256_permute2f128_ps(u[k], u[k + 4], 0x31);
+  }
+}
+
+// store the rounded (half away from zero) quantised values of eight coefficients
+AVX2 static inline void quantise_avx2(__m256 v, __m256 fdtbl, int *out)
+{
+  v = _mm256_mul_ps(v, fdtbl);
+  __m256 negative = _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LT_OQ);
+  __m256 half = _mm256_blendv_ps(_mm256_set1_ps(0.5f), _mm256_set1_ps(-0.5f), negative);
+  _mm256_storeu_si256((__m256i *)out, _mm256_cvttps_epi32(_mm256_add_ps(v, half)));
+}
+
+AVX2 static void jpeg_block_avx2(const unsigned char *rgb, const float *fdtbl_y, const float *fdtbl_uv,
+                                 int coefs[3 * JPEG_BLOCK_VALUES])
+{
+  float r[JPEG_BLOCK_VALUES], g[JPEG_BLOCK_VALUES], b[JPEG_BLOCK_VALUES];
+  split_jpeg_block(rgb, r, g, b);
+
+  // the three component blocks, one vector per row
+  __m256 blocks[3][8];
+  for (int k = 0; k < 8; k++)
+  {
+    __m256 vr = _mm256_loadu_ps(r + 8 * k);
+    __m256 vg = _mm256_loadu_ps(g + 8 * k);
+    __m256 vb = _mm256_loadu_ps(b + 8 * k);
+    blocks[0][k] = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(JPEG_Y_R), vr),
+                                                             _mm256_mul_ps(_mm256_set1_ps(JPEG_Y_G), vg)),
+                                               _mm256_mul_ps(_mm256_set1_ps(JPEG_Y_B), vb)),
+                                 _mm256_set1_ps(JPEG_LEVEL_SHIFT));
+    blocks[1][k] = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(JPEG_CB_R), vr),
+                                               _mm256_mul_ps(_mm256_set1_ps(JPEG_CB_G), vg)),
+                                 _mm256_mul_ps(_mm256_set1_ps(JPEG_CB_B), vb));
+    blocks[2][k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(JPEG_CR_R), vr),
+                                               _mm256_mul_ps(_mm256_set1_ps(JPEG_CR_G), vg)),
+                                 _mm256_mul_ps(_mm256_set1_ps(JPEG_CR_B), vb));
+  }
+
+  for (int c = 0; c < 3; c++)
+  {
+    __m256 *x = blocks[c];
+    // rows (as columns of the transposed block), then columns
+    transpose_8x8_avx2(x);
+    dct_8_avx2(x);
+    transpose_8x8_avx2(x);
+    dct_8_avx2(x);
+
+    const float *fdtbl = c == 0 ? fdtbl_y : fdtbl_uv;
+    for (int k = 0; k < 8; k++)
+    {
+      quantise_avx2(x[k], _mm256_loadu_ps(fdtbl + 8 * k), coefs + c * JPEG_BLOCK_VALUES + 8 * k);
+    }
+  }
+}
+
+static const struct pic_kernels avx2_kernels = {
+    "avx2",
+    invert_row_avx2,
+    grayscale_row_avx2,
+    blur_row_avx2,
+    jpeg_block_avx2};
+
+// check CPUID (and that the OS saves the YMM registers) for AVX2 support
+static bool cpu_has_avx2(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+  {
+    return false;
+  }
+
+  unsigned int xcr0_lo, xcr0_hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6)
+  {
+    return false;
+  }
+
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+
+// check CPUID for SSE2 support (always present on x86-64)
+static bool cpu_has_sse2(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2);
+}
+
+#endif
+
+/* ---------- runtime dispatch ---------- */
+
+static const struct pic_kernels *selected_kernels = &scalar_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+int get_supported_kernels(const struct pic_kernels **list, int max)
+{
+  int count = 0;
+#ifdef KERNELS_X86
+  // list the widest instruction set first
+  if (count < max && cpu_has_avx2())
+  {
+    list[count++] = &avx2_kernels;
+  }
+  if (count < max && cpu_has_sse2())
+  {
+    list[count++] = &sse2_kernels;
+  }
+#endif
+  if (count < max)
+  {
+    list[count++] = &scalar_kernels;
+  }
+  return count;
+}
+
+static void select_kernels(void)
+{
+  const struct pic_kernels *supported[MAX_KERNEL_SETS];
+  int count = get_supported_kernels(supported, MAX_KERNEL_SETS);
+  selected_kernels = supported[0];
+
+  // honour an explicit request for one of the supported kernel sets
+  const char *forced = getenv("PIC_KERNELS");
+  if (forced == NULL)
+  {
+    return;
+  }
+  for (int n = 0; n < count; n++)
+  {
+    if (!strcmp(forced, supported[n]->name))
+    {
+      selected_kernels = supported[n];
+      return;
+    }
+  }
+  printf("[!] PIC_KERNELS=%s is not supported here, using %s\n", forced, selected_kernels->name);
+}
+
+const struct pic_kernels *get_pic_kernels(void)
+{
+  pthread_once(&kernels_once, select_kernels);
+  return selected_kernels;
+}
+
+const struct pic_kernels *get_scalar_kernels(void)
+{
+  return &scalar_kernels;
+}
+
+/* ---------- self check ---------- */
+
+// run every kernel of one set over a whole packed picture
+static void run_kernels(const struct pic_kernels *kernels, struct picture *pic,
+                        unsigned char *inverted, unsigned char *gray, unsigned char *blurred)
+{
+  size_t row_size = (size_t)pic->width * NO_PICTURE_CHANNELS;
+  for (int j = 0; j < pic->height; j++)
+  {
+    const unsigned char *row = get_rgb_row(pic, j);
+    memcpy(inverted + j * row_size, row, row_size);
+    kernels->invert_row(inverted + j * row_size, pic->width);
+    memcpy(gray + j * row_size, row, row_size);
+    kernels->grayscale_row(gray + j * row_size, pic->width);
+
+    // don't need to modify boundary rows
+    if (j == 0 || j == pic->height - 1)
+    {
+      memcpy(blurred + j * row_size, row, row_size);
+      continue;
+    }
+    kernels->blur_row(get_rgb_row(pic, j - 1), row, get_rgb_row(pic, j + 1),
+                      blurred + j * row_size, pic->width);
+  }
+}
+
+// check that one kernel set gives the scalar JPEG coefficients for every whole 8x8 block of a picture
+static bool check_jpeg_kernel(const struct pic_kernels *kernels, struct picture *pic)
+{
+  // a different quantisation step for every coefficient, fine enough to keep them all apart
+  float fdtbl[JPEG_BLOCK_VALUES];
+  for (int i = 0; i < JPEG_BLOCK_VALUES; i++)
+  {
+    fdtbl[i] = 1.0f / (1 + i % 16);
+  }
+
+  unsigned char block[JPEG_BLOCK_VALUES * NO_PICTURE_CHANNELS];
+  int expected[3 * JPEG_BLOCK_VALUES];
+  int actual[3 * JPEG_BLOCK_VALUES];
+  for (int y = 0; y + 8 <= pic->height; y += 8)
+  {
+    for (int x = 0; x + 8 <= pic->width; x += 8)
+    {
+      for (int row = 0; row < 8; row++)
+      {
+        memcpy(block + row * 8 * NO_PICTURE_CHANNELS, get_rgb_row(pic, y + row) + x * NO_PICTURE_CHANNELS,
+               8 * NO_PICTURE_CHANNELS);
+      }
+      scalar_kernels.jpeg_block(block, fdtbl, fdtbl, expected);
+      kernels->jpeg_block(block, fdtbl, fdtbl, actual);
+      if (memcmp(expected, actual, sizeof(expected)))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool self_check_kernels(const char *path)
+{
+  struct picture pic;
+  if (!init_picture_from_file_with_format(&pic, path, PACKED_RGB8))
+  {
+    return false;
+  }
+
+  size_t size = (size_t)pic.height * pic.width * NO_PICTURE_CHANNELS;
+  unsigned char *expected = malloc(3 * size);
+  unsigned char *actual = malloc(3 * size);
+  run_kernels(&scalar_kernels, &pic, expected, expected + size, expected + 2 * size);
+
+  const struct pic_kernels *supported[MAX_KERNEL_SETS];
+  int count = get_supported_kernels(supported, MAX_KERNEL_SETS);
+  const char *ops[] = {"invert", "grayscale", "blur"};
+  bool success = true;
+
+  for (int n = 0; n < count; n++)
+  {
+    if (supported[n] == &scalar_kernels)
+    {
+      continue;
+    }
+
+    run_kernels(supported[n], &pic, actual, actual + size, actual + 2 * size);
+
+    for (int op = 0; op < 3; op++)
+    {
+      bool same = !memcmp(expected + op * size, actual + op * size, size);
+      printf("%s %s %s: %s\n", path, supported[n]->name, ops[op], same ? "ok" : "MISMATCH");
+      success = success && same;
+    }
+
+    bool same = check_jpeg_kernel(supported[n], &pic);
+    printf("%s %s jpeg: %s\n", path, supported[n]->name, same ? "ok" : "MISMATCH");
+    success = success && same;
+  }
+
+  free(expected);
+  free(actual);
+  clear_picture(&pic);
+  return success;
+}
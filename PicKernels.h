@@ -0,0 +1,51 @@
+#ifndef PICKERNELS_H
+#define PICKERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// number of values in an 8x8 JPEG block
+#define JPEG_BLOCK_VALUES 64
+
+// The pic_kernels struct groups the row-major inner loops behind the picture
+// transformations. Every kernel works on rows of interleaved 8-bit RGB values
+// and each instruction set (scalar, SSE2, AVX2) provides a complete set.
+// The JPEG block kernel must give the same coefficients bit for bit in every set.
+struct pic_kernels
+{
+  // name of the instruction set used by the kernels
+  const char *name;
+
+  // invert every colour value of a row of width pixels (in place)
+  void (*invert_row)(unsigned char *rgb, int width);
+
+  // replace every pixel of a row with the average of its colour values (in place)
+  void (*grayscale_row)(unsigned char *rgb, int width);
+
+  // compute the 3x3 box blur of row into out, given the rows above and below it
+  // NOTE: the first and last pixels of the row are copied unchanged
+  void (*blur_row)(const unsigned char *above, const unsigned char *row,
+                   const unsigned char *below, unsigned char *out, int width);
+
+  // convert an 8x8 block of pixels (rgb, row by row) to YCbCr, apply the forward DCT
+  // to each component and quantise it with the luma or chroma reciprocal step sizes
+  // (in row order), giving the Y, Cb and Cr coefficients in row order in coefs
+  void (*jpeg_block)(const unsigned char *rgb, const float *fdtbl_y, const float *fdtbl_uv,
+                     int coefs[3 * JPEG_BLOCK_VALUES]);
+};
+
+// the best kernels supported by the running CPU (selected once, on first use)
+// NOTE: setting PIC_KERNELS=scalar|sse2|avx2 in the environment forces a choice
+const struct pic_kernels *get_pic_kernels(void);
+
+// the portable scalar kernels that every other set must match exactly
+const struct pic_kernels *get_scalar_kernels(void);
+
+// fill list with every kernel set the running CPU supports and return how many there are
+int get_supported_kernels(const struct pic_kernels **list, int max);
+
+// compare every supported kernel set against the scalar kernels on the picture
+// at path, reporting the outcome on stdout (true if they all agree)
+bool self_check_kernels(const char *path);
+
+#endif
@@ -0,0 +1,68 @@
+#include "PicPool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static threadpool picture_pool = NULL;
+static int picture_pool_size = 0;
+static pthread_mutex_t picture_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// work out how many threads a new pool should run
+static int choose_pool_size(void)
+{
+  // an explicit (positive) thread count takes priority
+  const char *env = getenv(POOL_THREADS_ENV);
+  if (env != NULL && atoi(env) > 0)
+  {
+    return atoi(env);
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
+// work out how a new pool should hand out its jobs
+static thpool_scheduler choose_pool_scheduler(void)
+{
+  // the single shared queue is kept available for comparison
+  const char *env = getenv(POOL_SCHEDULER_ENV);
+  if (env != NULL && strcmp(env, "queue") == 0)
+  {
+    return THPOOL_SHARED_QUEUE;
+  }
+  return THPOOL_WORK_STEALING;
+}
+
+int get_picture_pool_size(void)
+{
+  pthread_mutex_lock(&picture_pool_lock);
+  int size = picture_pool != NULL ? picture_pool_size : choose_pool_size();
+  pthread_mutex_unlock(&picture_pool_lock);
+  return size;
+}
+
+threadpool get_picture_pool(void)
+{
+  pthread_mutex_lock(&picture_pool_lock);
+  if (picture_pool == NULL)
+  {
+    picture_pool_size = choose_pool_size();
+    picture_pool = thpool_init_with_scheduler(picture_pool_size, choose_pool_scheduler());
+  }
+  threadpool pool = picture_pool;
+  pthread_mutex_unlock(&picture_pool_lock);
+  return pool;
+}
+
+void shutdown_picture_pool(void)
+{
+  pthread_mutex_lock(&picture_pool_lock);
+  if (picture_pool != NULL)
+  {
+    thpool_wait(picture_pool);
+    thpool_destroy(picture_pool);
+    picture_pool = NULL;
+  }
+  pthread_mutex_unlock(&picture_pool_lock);
+}
@@ -0,0 +1,24 @@
+#ifndef PICPOOL_H
+#define PICPOOL_H
+
+#include "thpool.h"
+
+// environment variable that overrides the number of threads in the shared pool
+#define POOL_THREADS_ENV "PICTURE_THREADS"
+
+// environment variable that selects the shared pool's scheduler ("stealing" or "queue")
+#define POOL_SCHEDULER_ENV "PICTURE_SCHEDULER"
+
+// the process-wide thread pool shared by all parallel picture transformations
+// NOTE: the pool is created on first use, so no thread is started until it is needed,
+//       and uses work stealing unless PICTURE_SCHEDULER=queue is set
+threadpool get_picture_pool(void);
+
+// number of threads the shared pool runs (PICTURE_THREADS if set, else the online cores)
+int get_picture_pool_size(void);
+
+// wait for the shared pool's work to finish, then join its threads and release it
+// NOTE: a later call to get_picture_pool() creates a fresh pool
+void shutdown_picture_pool(void);
+
+#endif
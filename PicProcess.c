@@ -1,245 +1,771 @@
 #include "PicProcess.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
-#include "thpool.h"
+#include <string.h>
+#include <stddef.h>
+#include "PicPool.h"
+#include "PicKernels.h"
 
-#define NO_RGB_COMPONENTS 3
-#define BLUR_REGION_SIZE 9
-#define NUM_THREADS 16
-struct task_args
+#define BLUR_RADIUS 1
+#define TILE_SIZE 32
+#define SWAP_CHUNK_SIZE 256
+#define BAND_CACHE_BYTES (256 * 1024)
+#define BANDS_PER_THREAD 4
+#define ROW_GRAIN_BYTES (64 * 1024)
+#define MAX_BLUR_PASSES 8
+
+// the pictures a parallel blur reads from and writes to
+struct blur_args
 {
-  int i;
-  int j;
   struct picture *input;
   struct picture *output;
+  // set by any band that runs out of memory
+  atomic_bool failed;
+};
+
+// the pictures a sweep of several blur passes reads from and writes to
+struct multi_blur_args
+{
+  struct picture *input;
+  struct picture *output;
+  int passes;
+  // set by any band that runs out of memory
+  atomic_bool failed;
+};
+
+// row kernels to apply (in order) to every row of a picture
+struct row_kernel_args
+{
+  struct picture *pic;
+  void (*const *kernels)(unsigned char *rgb, int width);
+  int no_kernels;
+  // set by any range of rows that runs out of memory
+  atomic_bool failed;
+};
+
+// the stored planes of a picture and the remap of each onto a new picture
+struct remap_args
+{
+  int no_planes;
+  const unsigned char *origins[NO_PICTURE_CHANNELS];
+  ptrdiff_t steps_x[NO_PICTURE_CHANNELS];
+  ptrdiff_t steps_y[NO_PICTURE_CHANNELS];
+  struct picture_plane dst_planes[NO_PICTURE_CHANNELS];
+  int width;
+  int height;
+};
+
+// the stored planes of a picture and the axes to mirror it along
+struct mirror_args
+{
+  int no_planes;
+  struct picture_plane planes[NO_PICTURE_CHANNELS];
+  int width;
+  int height;
+  bool rows;
+  bool columns;
 };
 
-void invert_picture(struct picture *pic)
+// copy a single stored element (a packed pixel or a float intensity) between planes
+static inline void copy_element(unsigned char *dst, const unsigned char *src, int elem_size)
 {
-  // iterate over each pixel in the picture
-  for (int i = 0; i < pic->width; i++)
+  // fixed-size copies let the compiler emit plain loads and stores
+  if (elem_size == NO_PICTURE_CHANNELS)
   {
-    for (int j = 0; j < pic->height; j++)
-    {
-      struct pixel rgb = get_pixel(pic, i, j);
+    memcpy(dst, src, NO_PICTURE_CHANNELS);
+  }
+  else
+  {
+    memcpy(dst, src, sizeof(float));
+  }
+}
+
+// run fn over the items [0, count) on the shared pool, in ranges of about ROW_GRAIN_BYTES
+// NOTE: work that fits in a single range runs on the calling thread without the pool
+static void parallel_items(int count, size_t item_bytes, void (*fn)(int, int, void *), void *ctx)
+{
+  int grain = ROW_GRAIN_BYTES / (item_bytes > 0 ? item_bytes : 1);
+  grain = grain > 0 ? grain : 1;
+  if (count <= grain)
+  {
+    fn(0, count, ctx);
+    return;
+  }
+  thpool_parallel_for(get_picture_pool(), 0, count, grain, fn, ctx);
+}
 
-      // invert RGB values of pixel
-      rgb.red = MAX_PIXEL_INTENSITY - rgb.red;
-      rgb.green = MAX_PIXEL_INTENSITY - rgb.green;
-      rgb.blue = MAX_PIXEL_INTENSITY - rgb.blue;
+// apply in-place interleaved RGB row kernels to rows [y0, y1) of the picture
+// NOTE: every kernel runs on a row before the next row is touched, so the row
+//       is only read from and written back to memory once
+static void apply_row_kernel_rows(int y0, int y1, void *ctx)
+{
+  struct row_kernel_args *args = ctx;
+  struct picture *pic = args->pic;
 
-      // set pixel to inverted RBG values
-      set_pixel(pic, i, j, &rgb);
+  // planar rows are converted through a scratch row, packed rows are used in place
+  unsigned char *scratch = NULL;
+  if (pic->format != PACKED_RGB8)
+  {
+    scratch = malloc((size_t)pic->width * NO_PICTURE_CHANNELS);
+    if (scratch == NULL)
+    {
+      atomic_store(&args->failed, true);
+      return;
     }
   }
+
+  for (int j = y0; j < y1; j++)
+  {
+    unsigned char *row = scratch;
+    if (scratch)
+    {
+      read_rgb_row(pic, j, scratch);
+    }
+    else
+    {
+      row = get_rgb_row(pic, j);
+    }
+    for (int k = 0; k < args->no_kernels; k++)
+    {
+      args->kernels[k](row, pic->width);
+    }
+    write_rgb_row(pic, j, row);
+  }
+
+  free(scratch);
 }
 
-void grayscale_picture(struct picture *pic)
+bool apply_colour_ops(struct picture *pic, const enum colour_op *ops, int no_ops)
 {
-  // iterate over each pixel in the picture
-  for (int i = 0; i < pic->width; i++)
+  // look up the row kernel of each operation
+  const struct pic_kernels *pk = get_pic_kernels();
+  void (*kernels[no_ops > 0 ? no_ops : 1])(unsigned char *rgb, int width);
+  for (int k = 0; k < no_ops; k++)
   {
-    for (int j = 0; j < pic->height; j++)
-    {
-      struct pixel rgb = get_pixel(pic, i, j);
+    kernels[k] = ops[k] == INVERT_COLOURS ? pk->invert_row : pk->grayscale_row;
+  }
 
-      // compute gray average of pixel's RGB values
-      int avg = (rgb.red + rgb.green + rgb.blue) / NO_RGB_COMPONENTS;
-      rgb.red = avg;
-      rgb.green = avg;
-      rgb.blue = avg;
+  // apply them all in a single parallel pass over the rows
+  struct row_kernel_args args = {pic, kernels, no_ops, false};
+  parallel_items(pic->height, (size_t)pic->width * NO_PICTURE_CHANNELS, apply_row_kernel_rows, &args);
+  return !atomic_load(&args.failed);
+}
 
-      // set pixel to gray-scale RBG value
-      set_pixel(pic, i, j, &rgb);
+bool invert_picture(struct picture *pic)
+{
+  enum colour_op op = INVERT_COLOURS;
+  return apply_colour_ops(pic, &op, 1);
+}
+
+bool grayscale_picture(struct picture *pic)
+{
+  enum colour_op op = GRAYSCALE_COLOURS;
+  return apply_colour_ops(pic, &op, 1);
+}
+
+// copy rows [y0, y1) of a plane through an axis-aligned remap, one cache-sized tile at a time.
+// The source element of destination (x, y) is found at src + x * step_x + y * step_y,
+// so every rotation and flip is just a different pair of (signed) steps. Tiling keeps
+// both the strided reads and the sequential writes of a tile resident in L1.
+static void remap_plane_tiled(const unsigned char *src, ptrdiff_t step_x, ptrdiff_t step_y,
+                              struct picture_plane *dst, int width, int y0, int y1)
+{
+  int elem = dst->elem_size;
+  for (int ty = y0; ty < y1; ty += TILE_SIZE)
+  {
+    int y_end = ty + TILE_SIZE < y1 ? ty + TILE_SIZE : y1;
+    for (int tx = 0; tx < width; tx += TILE_SIZE)
+    {
+      int x_end = tx + TILE_SIZE < width ? tx + TILE_SIZE : width;
+      for (int y = ty; y < y_end; y++)
+      {
+        const unsigned char *s = src + tx * step_x + y * step_y;
+        unsigned char *d = dst->data + y * dst->stride + tx * elem;
+        for (int x = tx; x < x_end; x++, s += step_x, d += elem)
+        {
+          copy_element(d, s, elem);
+        }
+      }
     }
   }
 }
 
-void rotate_picture(struct picture *pic, int angle)
+// swap two stored elements in place
+static inline void swap_elements(unsigned char *a, unsigned char *b, int elem_size)
+{
+  unsigned char tmp[sizeof(float)];
+  copy_element(tmp, a, elem_size);
+  copy_element(a, b, elem_size);
+  copy_element(b, tmp, elem_size);
+}
+
+// swap the contents of two rows in place, reversing the order of their elements
+// when requested (if both are the same row this just reverses it)
+static void swap_rows(unsigned char *a, unsigned char *b, int width, int elem_size, bool reverse)
 {
-  // capture current picture size
-  int new_width = pic->width;
-  int new_height = pic->height;
+  if (!reverse)
+  {
+    // swap in small chunks so no full-size buffer is ever needed
+    unsigned char chunk[SWAP_CHUNK_SIZE];
+    size_t size = (size_t)width * elem_size;
+    for (size_t n = 0; n < size; n += SWAP_CHUNK_SIZE)
+    {
+      size_t len = size - n < SWAP_CHUNK_SIZE ? size - n : SWAP_CHUNK_SIZE;
+      memcpy(chunk, a + n, len);
+      memcpy(a + n, b + n, len);
+      memcpy(b + n, chunk, len);
+    }
+    return;
+  }
 
-  // adjust output picture size as necessary
-  if (angle == 90 || angle == 270)
+  int count = a == b ? width / 2 : width;
+  for (int i = 0; i < count; i++)
   {
-    new_width = pic->height;
-    new_height = pic->width;
+    swap_elements(a + i * elem_size, b + (width - 1 - i) * elem_size, elem_size);
   }
+}
 
-  // make new temporary picture to work in
-  struct picture tmp;
-  init_picture_from_size(&tmp, new_width, new_height);
+// remap the destination tile rows [t0, t1) of every plane
+static void remap_tile_rows(int t0, int t1, void *ctx)
+{
+  struct remap_args *args = ctx;
+  int y0 = t0 * TILE_SIZE;
+  int y1 = t1 * TILE_SIZE < args->height ? t1 * TILE_SIZE : args->height;
+  for (int p = 0; p < args->no_planes; p++)
+  {
+    remap_plane_tiled(args->origins[p], args->steps_x[p], args->steps_y[p],
+                      &args->dst_planes[p], args->width, y0, y1);
+  }
+}
 
-  // iterate over each pixel in the picture
-  for (int i = 0; i < new_width; i++)
+// mirror rows [j0, j1) of every plane; when the rows are mirrored, row j is
+// swapped with its mirror image, so only the top half of the rows is visited
+static void mirror_rows(int j0, int j1, void *ctx)
+{
+  struct mirror_args *args = ctx;
+  for (int p = 0; p < args->no_planes; p++)
   {
-    for (int j = 0; j < new_height; j++)
+    unsigned char *data = args->planes[p].data;
+    size_t stride = args->planes[p].stride;
+    int elem = args->planes[p].elem_size;
+
+    for (int j = j0; j < j1; j++)
     {
-      struct pixel rgb;
-      // determine rotation angle and execute corresponding pixel update
-      switch (angle)
+      if (!args->rows)
+      {
+        // only mirror each row onto itself
+        swap_rows(data + j * stride, data + j * stride, args->width, elem, true);
+        continue;
+      }
+
+      // pair each row with its mirror image (the middle row of an odd height pairs with itself)
+      unsigned char *top = data + j * stride;
+      unsigned char *bottom = data + (args->height - 1 - j) * stride;
+      if (top != bottom || args->columns)
       {
-      case (90):
-        rgb = get_pixel(pic, j, new_width - 1 - i);
-        break;
-      case (180):
-        rgb = get_pixel(pic, new_width - 1 - i, new_height - 1 - j);
-        break;
-      case (270):
-        rgb = get_pixel(pic, new_height - 1 - j, i);
-        break;
-      default:
-        printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
-        clear_picture(&tmp);
-        clear_picture(pic);
-        exit(IO_ERROR);
+        swap_rows(top, bottom, args->width, elem, args->columns);
       }
-      set_pixel(&tmp, i, j, &rgb);
     }
   }
+}
 
-  // clean-up the old picture and replace with new picture
-  clear_picture(pic);
-  overwrite_picture(pic, &tmp);
+// rotate by 180 degrees (reverse both axes) or flip along one axis, in place
+static void mirror_picture_in_place(struct picture *pic, bool rows, bool columns)
+{
+  struct mirror_args args;
+  args.no_planes = get_picture_planes(pic, args.planes);
+  args.width = pic->width;
+  args.height = pic->height;
+  args.rows = rows;
+  args.columns = columns;
+
+  // each visited row touches itself and (when mirroring rows) its mirror image
+  int no_rows = rows ? (pic->height + 1) / 2 : pic->height;
+  size_t row_bytes = (size_t)pic->width * NO_PICTURE_CHANNELS * (rows ? 2 : 1);
+  parallel_items(no_rows, row_bytes, mirror_rows, &args);
 }
 
-void flip_picture(struct picture *pic, char plane)
+bool rotation_geometry(int angle, struct geometry *geom)
 {
+  // 90: new (x, y) is old (y, h - 1 - x), 180: old (w - 1 - x, h - 1 - y), 270: old (w - 1 - y, x)
+  switch (angle)
+  {
+  case 90:
+    *geom = (struct geometry){true, false, true};
+    return true;
+  case 180:
+    *geom = (struct geometry){false, true, true};
+    return true;
+  case 270:
+    *geom = (struct geometry){true, true, false};
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool flip_geometry(char plane, struct geometry *geom)
+{
+  // H mirrors the columns (left to right), V mirrors the rows (top to bottom)
+  switch (plane)
+  {
+  case ('H'):
+    *geom = (struct geometry){false, true, false};
+    return true;
+  case ('V'):
+    *geom = (struct geometry){false, false, true};
+    return true;
+  default:
+    return false;
+  }
+}
+
+struct geometry compose_geometry(struct geometry first, struct geometry then)
+{
+  // then picks a pixel of first's result, whose axes are first's source axes
+  // swapped when first transposes, so then's mirrors land on the other axes
+  struct geometry net;
+  net.transpose = first.transpose != then.transpose;
+  net.mirror_x = first.mirror_x != (first.transpose ? then.mirror_y : then.mirror_x);
+  net.mirror_y = first.mirror_y != (first.transpose ? then.mirror_x : then.mirror_y);
+  return net;
+}
+
+bool apply_geometry(struct picture *pic, struct geometry geom)
+{
+  // without a transpose the picture keeps its size, so it can be mirrored in place
+  // (which is nothing at all for the identity)
+  if (!geom.transpose)
+  {
+    if (geom.mirror_x || geom.mirror_y)
+    {
+      mirror_picture_in_place(pic, geom.mirror_y, geom.mirror_x);
+    }
+    return true;
+  }
+
+  // a transpose swaps the picture size
+  int new_width = pic->height;
+  int new_height = pic->width;
+
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
+  if (!init_picture_from_size_with_format(&tmp, new_width, new_height, pic->format))
+  {
+    return false;
+  }
+
+  struct picture_plane src_planes[NO_PICTURE_CHANNELS];
+  struct remap_args args;
+  args.no_planes = get_picture_planes(pic, src_planes);
+  get_picture_planes(&tmp, args.dst_planes);
+  args.width = new_width;
+  args.height = new_height;
 
-  // iterate over each pixel in the picture
-  for (int i = 0; i < tmp.width; i++)
+  // work out the (mirrored) transpose of each stored plane: new (x, y) is old
+  // (y, x), counting old columns from the right and old rows from the bottom
+  // as mirrored
+  for (int p = 0; p < args.no_planes; p++)
   {
-    for (int j = 0; j < tmp.height; j++)
+    ptrdiff_t stride = src_planes[p].stride;
+    ptrdiff_t elem = src_planes[p].elem_size;
+
+    args.origins[p] = src_planes[p].data;
+    args.steps_x[p] = stride;
+    args.steps_y[p] = elem;
+    if (geom.mirror_y)
     {
-      struct pixel rgb;
-      // determine flip plane and execute corresponding pixel update
-      switch (plane)
-      {
-      case ('V'):
-        rgb = get_pixel(pic, i, tmp.height - 1 - j);
-        break;
-      case ('H'):
-        rgb = get_pixel(pic, tmp.width - 1 - i, j);
-        break;
-      default:
-        printf("[!] flip is undefined for plane %c\n", plane);
-        clear_picture(&tmp);
-        clear_picture(pic);
-        exit(IO_ERROR);
-      }
-      set_pixel(&tmp, i, j, &rgb);
+      args.origins[p] += (new_width - 1) * stride;
+      args.steps_x[p] = -stride;
+    }
+    if (geom.mirror_x)
+    {
+      args.origins[p] += (new_height - 1) * elem;
+      args.steps_y[p] = -elem;
     }
   }
 
+  // and run it tile row by tile row across the pool
+  int tile_rows = (new_height + TILE_SIZE - 1) / TILE_SIZE;
+  size_t tile_row_bytes = (size_t)new_width * NO_PICTURE_CHANNELS * TILE_SIZE;
+  parallel_items(tile_rows, tile_row_bytes, remap_tile_rows, &args);
+
   // clean-up the old picture and replace with new picture
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
+  return true;
 }
 
-void calculate_new_blur_pixel(int i, int j, struct picture *input, struct picture *output)
+bool rotate_picture(struct picture *pic, int angle)
 {
-  // set-up a local pixel on the stack
-  struct pixel rgb = get_pixel(input, i, j);
+  // check the rotation angle before doing any work
+  struct geometry geom;
+  if (!rotation_geometry(angle, &geom))
+  {
+    printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
+    clear_picture(pic);
+    exit(IO_ERROR);
+  }
+  return apply_geometry(pic, geom);
+}
 
-  // don't need to modify boundary pixels
-  if (i != 0 && j != 0 && i != output->width - 1 && j != output->height - 1)
+bool flip_picture(struct picture *pic, char plane)
+{
+  // determine flip plane and mirror the picture in place
+  struct geometry geom;
+  if (!flip_geometry(plane, &geom))
+  {
+    printf("[!] flip is undefined for plane %c\n", plane);
+    clear_picture(pic);
+    exit(IO_ERROR);
+  }
+  return apply_geometry(pic, geom);
+}
+
+// compute the sums of the (2 * radius + 1) values centred on each interior sample of
+// an interleaved RGB row, sliding the window along so each sum costs O(1) work
+static void horizontal_box_sums(const unsigned char *row, int *sums, int width, int radius)
+{
+  int lo = radius * NO_PICTURE_CHANNELS;
+  int hi = (width - radius) * NO_PICTURE_CHANNELS;
+  int lead = radius * NO_PICTURE_CHANNELS;
+  int trail = (radius + 1) * NO_PICTURE_CHANNELS;
+
+  // seed the running sums with the first full window of each colour
+  for (int c = 0; c < NO_PICTURE_CHANNELS; c++)
+  {
+    int sum = 0;
+    for (int n = 0; n <= 2 * radius; n++)
+    {
+      sum += row[n * NO_PICTURE_CHANNELS + c];
+    }
+    sums[lo + c] = sum;
+  }
+
+  // slide the window: add the sample entering on the right, drop the one leaving on the left
+  for (int k = lo + NO_PICTURE_CHANNELS; k < hi; k++)
+  {
+    sums[k] = sums[k - NO_PICTURE_CHANNELS] + row[k + lead] - row[k - trail];
+  }
+}
+
+// blur rows [y0, y1) of input into output with a (2 * radius + 1)^2 box filter.
+// Horizontal window sums are kept in a ring of (2 * radius + 1) rows and the
+// vertical window total is slid down the image, so each pixel costs O(1) work
+// regardless of radius. Pixels within radius of the picture edge are unchanged.
+// NOTE: returns false if memory runs out, leaving some of the rows unwritten
+static bool box_blur_rows(struct picture *input, struct picture *output, int radius, int y0, int y1)
+{
+  int width = input->width;
+  int height = input->height;
+  int row_size = width * NO_PICTURE_CHANNELS;
+  int window = 2 * radius + 1;
+  int area = window * window;
+
+  // only rows and columns at least radius away from the edge are blurred
+  int first = y0 > radius ? y0 : radius;
+  int last = y1 < height - radius ? y1 : height - radius;
+  if (width <= 2 * radius || first > last)
+  {
+    first = last = y1;
+  }
+
+  unsigned char *scratch = malloc(row_size);
+  unsigned char *out = malloc(row_size);
+  if (scratch == NULL || out == NULL)
   {
+    free(scratch);
+    free(out);
+    return false;
+  }
+  bool blurred = true;
 
-    // set up running RGB component totals for pixel region
-    int sum_red = rgb.red;
-    int sum_green = rgb.green;
-    int sum_blue = rgb.blue;
+  // don't need to modify boundary rows
+  for (int j = y0; j < y1; j++)
+  {
+    if (j < first || j >= last)
+    {
+      write_rgb_row(output, j, read_rgb_row(input, j, scratch));
+    }
+  }
 
-    // check the surrounding pixel region
-    for (int n = -1; n <= 1; n++)
+  if (first < last && radius == BLUR_RADIUS)
+  {
+    // the 3x3 blur goes straight through the (vectorised) row kernel,
+    // keeping a rolling window of the three input rows it needs
+    void (*blur_row)(const unsigned char *, const unsigned char *, const unsigned char *,
+                     unsigned char *, int) = get_pic_kernels()->blur_row;
+    unsigned char *scratches[3] = {malloc(row_size), malloc(row_size), malloc(row_size)};
+    const unsigned char *rows[3];
+    blurred = scratches[0] != NULL && scratches[1] != NULL && scratches[2] != NULL;
+    for (int n = 0; n < 3 && blurred; n++)
     {
-      for (int m = -1; m <= 1; m++)
+      rows[n] = read_rgb_row(input, first - 1 + n, scratches[n]);
+    }
+
+    for (int j = first; j < last && blurred; j++)
+    {
+      if (j > first)
+      {
+        // recycle the scratch row of the row leaving the window
+        unsigned char *recycled = scratches[0];
+        scratches[0] = scratches[1];
+        scratches[1] = scratches[2];
+        scratches[2] = recycled;
+        rows[0] = rows[1];
+        rows[1] = rows[2];
+        rows[2] = read_rgb_row(input, j + 1, recycled);
+      }
+      blur_row(rows[0], rows[1], rows[2], out, width);
+      write_rgb_row(output, j, out);
+    }
+
+    for (int n = 0; n < 3; n++)
+    {
+      free(scratches[n]);
+    }
+  }
+  else if (first < last)
+  {
+    int lo = radius * NO_PICTURE_CHANNELS;
+    int hi = (width - radius) * NO_PICTURE_CHANNELS;
+    int *ring = malloc((size_t)window * row_size * sizeof(int));
+    int *total = calloc(row_size, sizeof(int));
+    blurred = ring != NULL && total != NULL;
+
+    // prime the vertical window with the rows surrounding the first blurred row
+    for (int j = first - radius; j <= first + radius && blurred; j++)
+    {
+      int *sums = ring + (size_t)(j % window) * row_size;
+      horizontal_box_sums(read_rgb_row(input, j, scratch), sums, width, radius);
+      for (int k = lo; k < hi; k++)
       {
-        if (n != 0 || m != 0)
+        total[k] += sums[k];
+      }
+    }
+
+    for (int j = first; j < last && blurred; j++)
+    {
+      if (j > first)
+      {
+        // the slot of the row leaving the window is reused for the row entering it
+        int *sums = ring + (size_t)((j + radius) % window) * row_size;
+        for (int k = lo; k < hi; k++)
         {
-          rgb = get_pixel(input, i + n, j + m);
-          sum_red += rgb.red;
-          sum_green += rgb.green;
-          sum_blue += rgb.blue;
+          total[k] -= sums[k];
+        }
+        horizontal_box_sums(read_rgb_row(input, j + radius, scratch), sums, width, radius);
+        for (int k = lo; k < hi; k++)
+        {
+          total[k] += sums[k];
         }
       }
+
+      // keep the boundary columns and average the region of every other pixel
+      const unsigned char *src = read_rgb_row(input, j, scratch);
+      memcpy(out, src, lo);
+      memcpy(out + hi, src + hi, row_size - hi);
+      for (int k = lo; k < hi; k++)
+      {
+        out[k] = total[k] / area;
+      }
+      write_rgb_row(output, j, out);
     }
 
-    // compute average pixel RGB value
-    rgb.red = sum_red / BLUR_REGION_SIZE;
-    rgb.green = sum_green / BLUR_REGION_SIZE;
-    rgb.blue = sum_blue / BLUR_REGION_SIZE;
+    free(ring);
+    free(total);
   }
 
-  // set pixel to computed region RBG value (unmodified if boundary)
-  set_pixel(output, i, j, &rgb);
+  free(scratch);
+  free(out);
+  return blurred;
 }
 
-// sequential verison
-void blur_picture(struct picture *pic)
+bool box_blur_picture(struct picture *pic, int radius)
 {
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
+  if (!init_picture_from_size_with_format(&tmp, pic->width, pic->height, pic->format))
+  {
+    return false;
+  }
 
-  // iterate over each pixel in the picture
-  for (int i = 0; i < tmp.width; i++)
+  if (!box_blur_rows(pic, &tmp, radius, 0, pic->height))
   {
-    for (int j = 0; j < tmp.height; j++)
-    {
-      calculate_new_blur_pixel(i, j, pic, &tmp);
-    }
+    clear_picture(&tmp);
+    return false;
   }
 
   // clean-up the old picture and replace with new picture
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
+  return true;
 }
 
-// helper function runs by child for parallel blur
-void *help_parallel_blur(struct task_args *args)
+// sequential verison
+bool blur_picture(struct picture *pic)
 {
-  int i = args->i;
-  int j = args->j;
-  struct picture *input = args->input;
-  struct picture *output = args->output;
+  return box_blur_picture(pic, BLUR_RADIUS);
+}
 
-  calculate_new_blur_pixel(i, j, input, output);
+// helper function runs by child for parallel blur
+static void help_parallel_blur(int y0, int y1, void *ctx)
+{
+  struct blur_args *args = ctx;
+  if (!box_blur_rows(args->input, args->output, BLUR_RADIUS, y0, y1))
+  {
+    atomic_store(&args->failed, true);
+  }
+}
 
-  free(args);
-  return NULL;
+// pick a band height that fits the cache and still gives every thread several bands
+static int blur_band_rows(struct picture *pic, int no_threads)
+{
+  size_t row_size = (size_t)pic->width * NO_PICTURE_CHANNELS;
+  int cache_rows = BAND_CACHE_BYTES / row_size;
+  int balance_rows = (pic->height + no_threads * BANDS_PER_THREAD - 1) / (no_threads * BANDS_PER_THREAD);
+  int rows = cache_rows < balance_rows ? cache_rows : balance_rows;
+  return rows > 0 ? rows : 1;
 }
 
 // parallel version
-void parallel_blur_picture(struct picture *pic)
+bool parallel_blur_picture(struct picture *pic)
 {
   // make new temporary picture to work in
   struct picture tmp;
-  init_picture_from_size(&tmp, pic->width, pic->height);
-  int height = tmp.height;
-  int width = tmp.width;
-  // iterate over each pixel in the picture
-  threadpool thpool = thpool_init(NUM_THREADS);
+  if (!init_picture_from_size_with_format(&tmp, pic->width, pic->height, pic->format))
+  {
+    return false;
+  }
+
+  // blur the picture in row bands spread across the pool
+  struct blur_args args = {pic, &tmp, false};
+  int rows = blur_band_rows(pic, get_picture_pool_size());
+  thpool_parallel_for(get_picture_pool(), 0, pic->height, rows, help_parallel_blur, &args);
+  if (atomic_load(&args.failed))
+  {
+    clear_picture(&tmp);
+    return false;
+  }
+
+  clear_picture(pic);
+  overwrite_picture(pic, &tmp);
+  return true;
+}
+
+// run several blur passes over the band of rows [y0, y1), entirely in a local buffer.
+// The band is read with a halo of one row per pass on each side, and every pass
+// finishes one row further in from each halo edge, so after the last pass exactly
+// the band's own rows are finished (the picture's edge rows never change, so the
+// halo simply stops there)
+static void blur_band_passes(int y0, int y1, void *ctx)
+{
+  struct multi_blur_args *args = ctx;
+  int width = args->input->width;
+  int height = args->input->height;
+  size_t row_size = (size_t)width * NO_PICTURE_CHANNELS;
+  void (*blur_row)(const unsigned char *, const unsigned char *, const unsigned char *,
+                   unsigned char *, int) = get_pic_kernels()->blur_row;
+
+  int lo = y0 - args->passes > 0 ? y0 - args->passes : 0;
+  int hi = y1 + args->passes < height ? y1 + args->passes : height;
+  unsigned char *bufs[2] = {malloc((hi - lo) * row_size), malloc((hi - lo) * row_size)};
+  if (bufs[0] == NULL || bufs[1] == NULL)
+  {
+    atomic_store(&args->failed, true);
+    free(bufs[0]);
+    free(bufs[1]);
+    return;
+  }
+
+  for (int j = lo; j < hi; j++)
+  {
+    unsigned char *row = bufs[0] + (j - lo) * row_size;
+    const unsigned char *src = read_rgb_row(args->input, j, row);
+    if (src != row)
+    {
+      memcpy(row, src, row_size);
+    }
+  }
+
+  // the rows still correct after each pass
+  int first = lo;
+  int last = hi;
+  for (int k = 1; k <= args->passes; k++)
+  {
+    const unsigned char *prev = bufs[(k - 1) % 2];
+    unsigned char *cur = bufs[k % 2];
+    first += lo > 0;
+    last -= hi < height;
+    for (int j = first; j < last; j++)
+    {
+      const unsigned char *row = prev + (j - lo) * row_size;
+      if (j == 0 || j == height - 1)
+      {
+        // don't need to modify boundary rows
+        memcpy(cur + (j - lo) * row_size, row, row_size);
+      }
+      else
+      {
+        blur_row(row - row_size, row, row + row_size, cur + (j - lo) * row_size, width);
+      }
+    }
+  }
+
+  for (int j = y0; j < y1; j++)
+  {
+    write_rgb_row(args->output, j, bufs[args->passes % 2] + (j - lo) * row_size);
+  }
+  free(bufs[0]);
+  free(bufs[1]);
+}
+
+// repeated version
+bool blur_picture_n(struct picture *pic, int n)
+{
+  // pictures too small to have an interior are never changed by a blur
+  if (n <= 0 || pic->width <= 2 * BLUR_RADIUS || pic->height <= 2 * BLUR_RADIUS)
+  {
+    return true;
+  }
+
+  // make a second picture to work in, then ping-pong between the two
+  struct picture tmp;
+  if (!init_picture_from_size_with_format(&tmp, pic->width, pic->height, pic->format))
+  {
+    return false;
+  }
+  struct picture *input = pic;
+  struct picture *output = &tmp;
 
-  for (int i = 0; i < width; i++)
+  // each sweep runs up to MAX_BLUR_PASSES passes in cache-sized bands, spread across the pool
+  bool blurred = true;
+  while (n > 0 && blurred)
   {
-    for (int j = 0; j < height; j++)
+    struct multi_blur_args args = {input, output, n < MAX_BLUR_PASSES ? n : MAX_BLUR_PASSES, false};
+    int rows = blur_band_rows(pic, get_picture_pool_size());
+    // keep the halo rows from outnumbering the band's own rows
+    rows = rows > 2 * args.passes ? rows : 2 * args.passes;
+    thpool_parallel_for(get_picture_pool(), 0, pic->height, rows, blur_band_passes, &args);
+
+    // a failed sweep leaves the result of the sweeps before it as it was
+    blurred = !atomic_load(&args.failed);
+    if (blurred)
     {
-      struct task_args *args = malloc(sizeof(struct task_args));
-      args->i = i;
-      args->j = j;
-      args->input = pic;
-      args->output = &tmp;
-      thpool_add_work(thpool, (void (*)(void *))help_parallel_blur, args);
+      output = input;
+      input = args.output;
+      n -= args.passes;
     }
   }
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
+
+  // keep whichever picture holds the result
+  if (input == pic)
+  {
+    clear_picture(&tmp);
+    return blurred;
+  }
   clear_picture(pic);
   overwrite_picture(pic, &tmp);
-}
\ No newline at end of file
+  return blurred;
+}
@@ -4,12 +4,54 @@
 #include "Picture.h"
 #include "Utils.h"
 
+// point-wise colour operations, which only ever look at one pixel at a time
+enum colour_op
+{
+  INVERT_COLOURS,
+  GRAYSCALE_COLOURS
+};
+
+// The transformations below return false if memory runs out. The picture is then
+// left as it was, except that colour operations may have reached some of its rows
+// and a repeated blur keeps the sweeps that finished.
+
+// apply a run of colour operations (in order) to a picture in a single pass over its pixels
+// NOTE: the result is identical to applying each operation to the whole picture in turn
+bool apply_colour_ops(struct picture *pic, const enum colour_op *ops, int no_ops);
+
+// A rotation and/or flip of a picture: one of the eight symmetries of a rectangle.
+// Pixel (x, y) of the result comes from pixel (y, x) of the original if transpose
+// is set (else from (x, y)), with the original's columns counted from the right
+// if mirror_x is set and its rows counted from the bottom if mirror_y is set.
+struct geometry
+{
+  bool transpose;
+  bool mirror_x;
+  bool mirror_y;
+};
+
+// look up the geometry of a rotation (90, 180 or 270) or flip ('H' or 'V'),
+// returning false if it is undefined
+bool rotation_geometry(int angle, struct geometry *geom);
+bool flip_geometry(char plane, struct geometry *geom);
+
+// the net geometry of applying first and then then
+struct geometry compose_geometry(struct geometry first, struct geometry then);
+
+// rotate and/or flip a picture with a single copy (or none, for the identity)
+bool apply_geometry(struct picture *pic, struct geometry geom);
+
 // picture transformation routines
-void invert_picture(struct picture *pic);
-void grayscale_picture(struct picture *pic);
-void rotate_picture(struct picture *pic, int angle);
-void flip_picture(struct picture *pic, char plane);
-void blur_picture(struct picture *pic);
-void parallel_blur_picture(struct picture *pic);
+bool invert_picture(struct picture *pic);
+bool grayscale_picture(struct picture *pic);
+bool rotate_picture(struct picture *pic, int angle);
+bool flip_picture(struct picture *pic, char plane);
+bool blur_picture(struct picture *pic);
+bool box_blur_picture(struct picture *pic, int radius);
+bool parallel_blur_picture(struct picture *pic);
+
+// blur a picture n times over (identical to n calls of blur_picture), running
+// several passes over each band of rows while it is still in cache
+bool blur_picture_n(struct picture *pic, int n);
 
 #endif
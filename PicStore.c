@@ -1,26 +1,561 @@
 #include "PicStore.h"
+#include <string.h>
+
+// average chain length above which the bucket array is doubled
+#define PICSTORE_MAX_LOAD 2
+
+// lock guarding the bucket a hash falls in
+// NOTE: the caller must hold resize_lock, so that no_buckets cannot change
+static pthread_mutex_t *bucket_lock(struct pic_store *pstore, size_t hash)
+{
+  return &pstore->stripes[(hash & (pstore->no_buckets - 1)) % PICSTORE_STRIPES];
+}
+
+// head of the chain of the bucket a hash falls in
+static struct pic_entry **bucket_head(struct pic_store *pstore, size_t hash)
+{
+  return &pstore->buckets[hash & (pstore->no_buckets - 1)];
+}
+
+// find the link pointing at the entry called name in a chain (or at its end)
+static struct pic_entry **find_link(struct pic_entry **link, const char *name)
+{
+  while (*link != NULL && strcmp((*link)->name, name))
+  {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// double the number of buckets if the chains have grown too long
+static void grow_picstore(struct pic_store *pstore)
+{
+  pthread_rwlock_wrlock(&pstore->resize_lock);
+
+  // another insertion may have grown the store while we waited for the lock
+  size_t no_buckets = pstore->no_buckets;
+  if (atomic_load(&pstore->size) > no_buckets * PICSTORE_MAX_LOAD)
+  {
+    struct pic_entry **buckets = calloc(no_buckets * 2, sizeof(struct pic_entry *));
+    if (buckets != NULL)
+    {
+      for (size_t i = 0; i < no_buckets; i++)
+      {
+        struct pic_entry *entry = pstore->buckets[i];
+        while (entry != NULL)
+        {
+          struct pic_entry *next = entry->next;
+          struct pic_entry **head = &buckets[hash_picture_name(entry->name) & (no_buckets * 2 - 1)];
+          entry->next = *head;
+          *head = entry;
+          entry = next;
+        }
+      }
+      free(pstore->buckets);
+      pstore->buckets = buckets;
+      pstore->no_buckets = no_buckets * 2;
+    }
+  }
+
+  pthread_rwlock_unlock(&pstore->resize_lock);
+}
+
+// remove the entry called name from the store, returning it (or NULL if absent)
+// NOTE: the store's reference moves to the caller
+static struct pic_entry *remove_entry(struct pic_store *pstore, const char *name)
+{
+  size_t hash = hash_picture_name(name);
+  pthread_rwlock_rdlock(&pstore->resize_lock);
+  pthread_mutex_t *lock = bucket_lock(pstore, hash);
+  pthread_mutex_lock(lock);
+
+  struct pic_entry **link = find_link(bucket_head(pstore, hash), name);
+  struct pic_entry *entry = *link;
+  if (entry != NULL)
+  {
+    *link = entry->next;
+    atomic_fetch_sub(&pstore->size, 1);
+  }
+
+  pthread_mutex_unlock(lock);
+  pthread_rwlock_unlock(&pstore->resize_lock);
+  return entry;
+}
+
+// references to every stored entry, for working through them without holding locks
+// NOTE: sets count to the number of entries, or returns NULL if memory runs out
+static struct pic_entry **collect_entries(struct pic_store *pstore, size_t *count)
+{
+  pthread_rwlock_rdlock(&pstore->resize_lock);
+  size_t capacity = atomic_load(&pstore->size) + 1;
+  struct pic_entry **entries = malloc(capacity * sizeof(struct pic_entry *));
+  *count = 0;
+  for (size_t i = 0; entries != NULL && i < pstore->no_buckets; i++)
+  {
+    pthread_mutex_t *lock = &pstore->stripes[i % PICSTORE_STRIPES];
+    pthread_mutex_lock(lock);
+    for (struct pic_entry *entry = pstore->buckets[i]; entry != NULL; entry = entry->next)
+    {
+      if (*count == capacity)
+      {
+        capacity *= 2;
+        struct pic_entry **more = realloc(entries, capacity * sizeof(struct pic_entry *));
+        if (more == NULL)
+        {
+          break;
+        }
+        entries = more;
+      }
+      atomic_fetch_add(&entry->refs, 1);
+      entries[(*count)++] = entry;
+    }
+    pthread_mutex_unlock(lock);
+  }
+  pthread_rwlock_unlock(&pstore->resize_lock);
+  return entries;
+}
+
+// count a picture's pixels towards the store's resident bytes, unless another
+// stored picture sharing them already does
+static void count_pixels(struct pic_entry *entry)
+{
+  if (atomic_fetch_add(&entry->pixels->stored, 1) == 0)
+  {
+    atomic_fetch_add(&entry->store->resident, entry->bytes);
+  }
+}
+
+// stop counting a picture's pixels, unless other stored pictures still share them
+static void uncount_pixels(struct pic_entry *entry)
+{
+  if (atomic_fetch_sub(&entry->pixels->stored, 1) == 1)
+  {
+    atomic_fetch_sub(&entry->store->resident, entry->bytes);
+  }
+}
+
+// write a picture's pixels out to a scratch file and free them
+// NOTE: the caller must hold the entry's write lock; returns false if the picture stays resident
+static bool spill_entry(struct pic_entry *entry)
+{
+  // pixels other pictures share stay resident for them
+  if (!claim_pixels(entry->pixels))
+  {
+    return false;
+  }
+
+  FILE *file = tmpfile();
+  if (file == NULL)
+  {
+    printf("[!] could not open a scratch file to spill picture %s\n", entry->name);
+    return false;
+  }
+
+  struct picture *pic = &entry->pixels->pic;
+  struct picture_plane planes[NO_PICTURE_CHANNELS];
+  int no_planes = get_picture_planes(pic, planes);
+  for (int i = 0; i < no_planes; i++)
+  {
+    if (fwrite(planes[i].data, planes[i].stride, pic->height, file) != (size_t)pic->height)
+    {
+      printf("[!] could not spill picture %s to a scratch file\n", entry->name);
+      fclose(file);
+      return false;
+    }
+  }
+
+  clear_picture(pic);
+  entry->spill = file;
+  atomic_store(&entry->spilled, true);
+  atomic_fetch_sub(&entry->store->resident, entry->bytes);
+  return true;
+}
+
+// read a spilled picture's pixels back in from its scratch file
+// NOTE: the caller must hold the entry's write lock; returns false if the picture stays spilled
+static bool restore_entry(struct pic_entry *entry)
+{
+  struct picture *pic = &entry->pixels->pic;
+  if (!init_picture_from_size_with_format(pic, pic->width, pic->height, pic->format))
+  {
+    printf("[!] could not allocate memory to read back picture %s\n", entry->name);
+    return false;
+  }
+
+  rewind(entry->spill);
+  struct picture_plane planes[NO_PICTURE_CHANNELS];
+  int no_planes = get_picture_planes(pic, planes);
+  for (int i = 0; i < no_planes; i++)
+  {
+    if (fread(planes[i].data, planes[i].stride, pic->height, entry->spill) != (size_t)pic->height)
+    {
+      printf("[!] could not read back picture %s from its scratch file\n", entry->name);
+      clear_picture(pic);
+      return false;
+    }
+  }
+
+  fclose(entry->spill);
+  entry->spill = NULL;
+  atomic_store(&entry->spilled, false);
+  atomic_fetch_add(&entry->store->resident, entry->bytes);
+  return true;
+}
+
+// an entry considered for spilling, with the clock reading it was last used at
+struct spill_candidate
+{
+  struct pic_entry *entry;
+  unsigned long long last_use;
+};
+
+// order spill candidates from least to most recently used
+static int compare_candidates(const void *a, const void *b)
+{
+  const struct spill_candidate *x = a, *y = b;
+  return (x->last_use > y->last_use) - (x->last_use < y->last_use);
+}
+
+// spill the least recently used pictures until the resident ones fit the budget
+// NOTE: pictures locked by a command (the caller's own included) are passed over
+static void enforce_budget(struct pic_store *pstore)
+{
+  if (pstore->budget == 0 || atomic_load(&pstore->resident) <= pstore->budget)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&pstore->evict_lock);
+  size_t count;
+  struct pic_entry **entries = collect_entries(pstore, &count);
+  struct spill_candidate *candidates = malloc((count + 1) * sizeof(struct spill_candidate));
+  if (entries != NULL && candidates != NULL)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      candidates[i].entry = entries[i];
+      candidates[i].last_use = atomic_load(&entries[i]->last_use);
+    }
+    qsort(candidates, count, sizeof(struct spill_candidate), compare_candidates);
+
+    for (size_t i = 0; i < count && atomic_load(&pstore->resident) > pstore->budget; i++)
+    {
+      struct pic_entry *entry = candidates[i].entry;
+      if (pthread_rwlock_trywrlock(&entry->lock) == 0)
+      {
+        if (entry->spill == NULL)
+        {
+          spill_entry(entry);
+        }
+        pthread_rwlock_unlock(&entry->lock);
+      }
+    }
+  }
+
+  for (size_t i = 0; entries != NULL && i < count; i++)
+  {
+    release_picture(entries[i]);
+  }
+  free(candidates);
+  free(entries);
+  pthread_mutex_unlock(&pstore->evict_lock);
+}
+
+// work out the store's memory budget from the environment (0 for no limit)
+static size_t choose_store_budget(void)
+{
+  const char *env = getenv(PICSTORE_BUDGET_ENV);
+  return env != NULL ? parse_byte_size(env) : 0;
+}
 
 void init_picstore(struct pic_store *pstore)
 {
-  // TODO: implement this function for the Optional Extension
+  pstore->no_buckets = PICSTORE_INITIAL_BUCKETS;
+  pstore->buckets = calloc(pstore->no_buckets, sizeof(struct pic_entry *));
+  if (pstore->buckets == NULL)
+  {
+    printf("[!] could not allocate memory for the picture store\n");
+    exit(IO_ERROR);
+  }
+  atomic_init(&pstore->size, 0);
+  pthread_rwlock_init(&pstore->resize_lock, NULL);
+  for (int i = 0; i < PICSTORE_STRIPES; i++)
+  {
+    pthread_mutex_init(&pstore->stripes[i], NULL);
+  }
+  pstore->budget = choose_store_budget();
+  atomic_init(&pstore->resident, 0);
+  atomic_init(&pstore->clock, 0);
+  pthread_mutex_init(&pstore->evict_lock, NULL);
+}
+
+void clear_picstore(struct pic_store *pstore)
+{
+  for (size_t i = 0; i < pstore->no_buckets; i++)
+  {
+    struct pic_entry *entry = pstore->buckets[i];
+    while (entry != NULL)
+    {
+      struct pic_entry *next = entry->next;
+      release_picture(entry);
+      entry = next;
+    }
+  }
+  free(pstore->buckets);
+  pstore->buckets = NULL;
+  pstore->no_buckets = 0;
+  atomic_store(&pstore->size, 0);
+
+  pthread_rwlock_destroy(&pstore->resize_lock);
+  for (int i = 0; i < PICSTORE_STRIPES; i++)
+  {
+    pthread_mutex_destroy(&pstore->stripes[i]);
+  }
+  pthread_mutex_destroy(&pstore->evict_lock);
+}
+
+// order listing lines alphabetically by picture name
+static int compare_listings(const void *a, const void *b)
+{
+  return strcmp(((const struct pic_listing *)a)->name, ((const struct pic_listing *)b)->name);
 }
 
 void print_picstore(struct pic_store *pstore)
 {
-  // TODO: implement this function for the Optional Extension
+  // hold a reference to every entry rather than its lock, so no picture's lock is ever needed
+  size_t count;
+  struct pic_entry **entries = collect_entries(pstore, &count);
+  struct pic_listing *listing = malloc((count + 1) * sizeof(struct pic_listing));
+  if (entries == NULL || listing == NULL)
+  {
+    printf("[!] could not allocate memory to list the picture store\n");
+  }
+  else
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      listing[i].name = entries[i]->name;
+      listing[i].spilled = atomic_load(&entries[i]->spilled);
+      listing[i].bytes = entries[i]->bytes;
+    }
+    print_picture_listing(listing, count);
+  }
+
+  for (size_t i = 0; entries != NULL && i < count; i++)
+  {
+    release_picture(entries[i]);
+  }
+  free(listing);
+  free(entries);
+}
+
+void print_picture_listing(struct pic_listing *listing, size_t count)
+{
+  if (count == 0)
+  {
+    printf("[empty picture store]\n");
+  }
+  qsort(listing, count, sizeof(struct pic_listing), compare_listings);
+  for (size_t i = 0; i < count; i++)
+  {
+    printf("%-8s %12zu  %s\n", listing[i].spilled ? "spilled" : "resident", listing[i].bytes, listing[i].name);
+  }
 }
 
 void load_picture(struct pic_store *pstore, const char *path, const char *filename)
 {
-  // TODO: implement this function for the Optional Extension
+  // decode the picture before touching the store, so no lock is held meanwhile
+  struct pic_entry *entry = malloc(sizeof(struct pic_entry));
+  if (entry == NULL)
+  {
+    printf("[!] could not allocate memory for picture %s\n", filename);
+    return;
+  }
+  entry->pixels = load_pixels(path);
+  if (entry->pixels == NULL)
+  {
+    free(entry);
+    return;
+  }
+  entry->name = strdup(filename);
+  pthread_rwlock_init(&entry->lock, NULL);
+  atomic_init(&entry->refs, 1);
+  entry->store = pstore;
+  entry->bytes = entry->pixels->bytes;
+  entry->spill = NULL;
+  atomic_init(&entry->spilled, false);
+  atomic_init(&entry->last_use, atomic_fetch_add(&pstore->clock, 1));
+  count_pixels(entry);
+
+  // insert the new entry, taking any picture already stored under its name out
+  size_t hash = hash_picture_name(filename);
+  pthread_rwlock_rdlock(&pstore->resize_lock);
+  pthread_mutex_t *lock = bucket_lock(pstore, hash);
+  pthread_mutex_lock(lock);
+
+  struct pic_entry **link = find_link(bucket_head(pstore, hash), filename);
+  struct pic_entry *old = *link;
+  entry->next = old != NULL ? old->next : NULL;
+  *link = entry;
+  size_t size = old != NULL ? atomic_load(&pstore->size) : atomic_fetch_add(&pstore->size, 1) + 1;
+  bool crowded = size > pstore->no_buckets * PICSTORE_MAX_LOAD;
+
+  pthread_mutex_unlock(lock);
+  pthread_rwlock_unlock(&pstore->resize_lock);
+
+  if (old != NULL)
+  {
+    release_picture(old);
+  }
+  if (crowded)
+  {
+    grow_picstore(pstore);
+  }
+  enforce_budget(pstore);
 }
 
 void unload_picture(struct pic_store *pstore, const char *filename)
 {
-  // TODO: implement this function for the Optional Extension
+  struct pic_entry *entry = remove_entry(pstore, filename);
+  if (entry == NULL)
+  {
+    printf("[!] no picture called %s is stored\n", filename);
+    return;
+  }
+  release_picture(entry);
 }
 
 void save_picture(struct pic_store *pstore, const char *filename, const char *path)
 {
-  // TODO: implement this function for the Optional Extension
+  struct pic_entry *entry = acquire_picture(pstore, filename);
+  if (entry == NULL)
+  {
+    printf("[!] no picture called %s is stored\n", filename);
+    return;
+  }
+
+  struct picture *pic = lock_picture(entry, false);
+  if (pic != NULL)
+  {
+    save_picture_to_file(pic, path);
+    unlock_picture(entry);
+  }
+
+  release_picture(entry);
+}
+
+struct pic_entry *acquire_picture(struct pic_store *pstore, const char *filename)
+{
+  size_t hash = hash_picture_name(filename);
+  pthread_rwlock_rdlock(&pstore->resize_lock);
+  pthread_mutex_t *lock = bucket_lock(pstore, hash);
+  pthread_mutex_lock(lock);
+
+  struct pic_entry *entry = *find_link(bucket_head(pstore, hash), filename);
+  if (entry != NULL)
+  {
+    atomic_fetch_add(&entry->refs, 1);
+  }
+
+  pthread_mutex_unlock(lock);
+  pthread_rwlock_unlock(&pstore->resize_lock);
+  return entry;
+}
+
+void release_picture(struct pic_entry *entry)
+{
+  // the last reference clears the picture
+  if (atomic_fetch_sub(&entry->refs, 1) == 1)
+  {
+    if (entry->spill != NULL)
+    {
+      // spilled pixels were claimed, and their picture is already cleared
+      fclose(entry->spill);
+      free(entry->pixels);
+    }
+    else
+    {
+      uncount_pixels(entry);
+      release_pixels(entry->pixels);
+    }
+    pthread_rwlock_destroy(&entry->lock);
+    free(entry->name);
+    free(entry);
+  }
+}
+
+struct picture *lock_picture(struct pic_entry *entry, bool write)
+{
+  atomic_store(&entry->last_use, atomic_fetch_add(&entry->store->clock, 1));
+  if (!write)
+  {
+    pthread_rwlock_rdlock(&entry->lock);
+    if (!atomic_load(&entry->spilled))
+    {
+      return &entry->pixels->pic;
+    }
+    // reading the picture back in changes it, so the write lock is needed instead
+    pthread_rwlock_unlock(&entry->lock);
+  }
+
+  pthread_rwlock_wrlock(&entry->lock);
+  bool restored = entry->spill != NULL;
+  if (restored && !restore_entry(entry))
+  {
+    pthread_rwlock_unlock(&entry->lock);
+    return NULL;
+  }
+  // pixels no other picture uses are taken out of the cache rather than copied
+  bool locked = true;
+  if (write && !claim_pixels(entry->pixels))
+  {
+    // a private copy counts on its own, while the pictures still sharing the pixels keep counting them
+    uncount_pixels(entry);
+    struct pic_pixels *own = own_pixels(entry->pixels);
+    if (own != NULL)
+    {
+      entry->pixels = own;
+    }
+    else
+    {
+      printf("[!] could not allocate memory to copy picture %s\n", entry->name);
+      locked = false;
+    }
+    count_pixels(entry);
+  }
+  if (restored)
+  {
+    enforce_budget(entry->store);
+  }
+  if (!locked)
+  {
+    pthread_rwlock_unlock(&entry->lock);
+    return NULL;
+  }
+  return &entry->pixels->pic;
+}
+
+void unlock_picture(struct pic_entry *entry)
+{
+  pthread_rwlock_unlock(&entry->lock);
+}
+
+bool transform_picture(struct pic_store *pstore, const char *filename,
+                       void (*transform)(struct picture *, const char *), const char *extra_arg)
+{
+  struct pic_entry *entry = acquire_picture(pstore, filename);
+  if (entry == NULL)
+  {
+    return false;
+  }
+
+  struct picture *pic = lock_picture(entry, true);
+  if (pic != NULL)
+  {
+    transform(pic, extra_arg);
+    unlock_picture(entry);
+  }
+
+  release_picture(entry);
+  return true;
 }
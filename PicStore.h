@@ -1,21 +1,123 @@
 #ifndef PICSTORE_H
 #define PICSTORE_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "PicCache.h"
 #include "Picture.h"
 #include "Utils.h"
 
+// number of locks shared out between the buckets of a picture store
+#define PICSTORE_STRIPES 64
+
+// number of buckets a new picture store starts with (a power of two)
+#define PICSTORE_INITIAL_BUCKETS 64
+
+// environment variable giving the memory budget for a store's resident pictures,
+// in bytes or with a K, M or G suffix (unset or 0 for no limit)
+#define PICSTORE_BUDGET_ENV "PICTURE_STORE_BUDGET"
+
+// A named picture held by the store. The entry is reference counted, so a
+// picture unloaded (or replaced) while a command is still working on it is
+// only cleared once that command releases it. Over the store's memory budget,
+// the least recently used pictures are spilled to scratch files, and are read
+// back in by the next command that locks them.
+struct pic_entry
+{
+  // name the picture was loaded under
+  char *name;
+  // pixels of the stored picture (guarded by lock, and only spilled or written
+  // to while neither the cache nor another picture shares them)
+  struct pic_pixels *pixels;
+  // taken for reading to save or inspect the picture, for writing to transform it
+  pthread_rwlock_t lock;
+  // references held by the store and by commands using the picture
+  atomic_int refs;
+  // store the picture was loaded into, whose resident bytes it counts towards
+  struct pic_store *store;
+  // bytes the picture's pixels take up
+  size_t bytes;
+  // scratch file holding the pixels while the picture is spilled (guarded by lock)
+  FILE *spill;
+  // whether the picture is spilled, readable without taking lock
+  atomic_bool spilled;
+  // reading of the store's clock when the picture was last locked
+  atomic_ullong last_use;
+  // next entry in the same bucket
+  struct pic_entry *next;
+};
+
+// The pic_store struct is a hash map from picture names to entries. Buckets
+// are guarded by a fixed set of striped mutexes and every picture by its own
+// reader/writer lock, so commands on different pictures never wait for each
+// other and listing or saving a picture never waits for another one's blur.
 struct pic_store
 {
-  // TODO: implement this struct with a picture container for the Optional Extension
+  // chains of entries, indexed by the hash of their name
+  struct pic_entry **buckets;
+  size_t no_buckets;
+  // number of pictures stored
+  atomic_size_t size;
+  // taken for writing only to grow the bucket array
+  pthread_rwlock_t resize_lock;
+  // bucket i is guarded by stripes[i % PICSTORE_STRIPES]
+  pthread_mutex_t stripes[PICSTORE_STRIPES];
+  // bytes resident pictures may take up before some are spilled (0 for no limit)
+  size_t budget;
+  // bytes taken up by resident pictures, including unloaded ones still in use
+  // (pixels shared between pictures count once)
+  atomic_size_t resident;
+  // ticks every time a picture is locked, to find the least recently used ones
+  atomic_ullong clock;
+  // held while pictures are picked out and spilled to get back within budget
+  pthread_mutex_t evict_lock;
+};
+
+// A line of a listing of the store
+struct pic_listing
+{
+  const char *name;
+  bool spilled;
+  size_t bytes;
 };
 
 // picture library initialisation
+// NOTE: the store's memory budget is read from PICTURE_STORE_BUDGET
 void init_picstore(struct pic_store *pstore);
 
+// unload every stored picture and release the store's resources
+void clear_picstore(struct pic_store *pstore);
+
 // command-line interpreter routines
 void print_picstore(struct pic_store *pstore);
 void load_picture(struct pic_store *pstore, const char *path, const char *filename);
 void unload_picture(struct pic_store *pstore, const char *filename);
 void save_picture(struct pic_store *pstore, const char *filename, const char *path);
 
+// list pictures one per line, alphabetically (sorting listing in place), as liststore does
+// NOTE: each line gives whether the picture is resident or spilled, its size in bytes and its name
+void print_picture_listing(struct pic_listing *listing, size_t count);
+
+// look up a stored picture and take a reference to it (NULL if there is none)
+// NOTE: the entry stays valid until release_picture() is called, even if it is unloaded
+struct pic_entry *acquire_picture(struct pic_store *pstore, const char *filename);
+
+// drop a reference taken by acquire_picture()
+void release_picture(struct pic_entry *entry);
+
+// lock an acquired picture for reading or writing, reading it back in if it was
+// spilled (and taking a private copy of its pixels to write to if they are shared)
+// NOTE: reading a spilled picture back in may spill other pictures to stay within budget;
+//       returns NULL, unlocked, if the picture cannot be read back in (or copied)
+struct picture *lock_picture(struct pic_entry *entry, bool write);
+
+// unlock a picture locked by lock_picture()
+void unlock_picture(struct pic_entry *entry);
+
+// apply a transformation (given extra_arg) to a stored picture under its write lock
+// NOTE: returns false if no picture is stored under filename
+bool transform_picture(struct pic_store *pstore, const char *filename,
+                       void (*transform)(struct picture *, const char *), const char *extra_arg);
+
 #endif
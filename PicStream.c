@@ -0,0 +1,193 @@
+#include "PicStream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "Utils.h"
+#include "Picture.h"
+#include "PicJpeg.h"
+#include "PicKernels.h"
+
+struct picture_stream
+{
+  struct jpeg_reader *reader;
+  struct jpeg_writer *writer;
+  const char *dst;
+  int width;
+  int height;
+};
+
+// One pass of the 3x3 blur over a stream of rows, keeping the last three rows it was given
+struct blur_stage
+{
+  unsigned char *window[3];
+  unsigned char *out;
+  int rows;
+};
+
+struct picture_stream *open_picture_stream(const char *src, const char *dst)
+{
+  // writing over the file being read would pull the picture out from under the reader
+  struct stat src_info, dst_info;
+  if (stat(src, &src_info) == 0 && stat(dst, &dst_info) == 0 && src_info.st_dev == dst_info.st_dev &&
+      src_info.st_ino == dst_info.st_ino)
+  {
+    return NULL;
+  }
+
+  int width, height;
+  struct jpeg_reader *reader = open_jpeg_reader(src, &width, &height);
+  if (reader == NULL)
+  {
+    return NULL;
+  }
+  struct jpeg_writer *writer =
+      open_jpeg_writer(dst, width, height, NO_PICTURE_CHANNELS, DEFAULT_COMPRESSION_QUALITY);
+  if (writer == NULL)
+  {
+    close_jpeg_reader(reader);
+    return NULL;
+  }
+
+  struct picture_stream *stream = malloc(sizeof(struct picture_stream));
+  if (stream == NULL)
+  {
+    close_jpeg_writer(writer);
+    close_jpeg_reader(reader);
+    remove(dst);
+    return NULL;
+  }
+  stream->reader = reader;
+  stream->writer = writer;
+  stream->dst = dst;
+  stream->width = width;
+  stream->height = height;
+  return stream;
+}
+
+// mirror a row of pixels in place
+static void mirror_row(unsigned char *row, int width)
+{
+  for (int i = 0, j = width - 1; i < j; i++, j--)
+  {
+    unsigned char tmp[NO_PICTURE_CHANNELS];
+    memcpy(tmp, row + i * NO_PICTURE_CHANNELS, NO_PICTURE_CHANNELS);
+    memcpy(row + i * NO_PICTURE_CHANNELS, row + j * NO_PICTURE_CHANNELS, NO_PICTURE_CHANNELS);
+    memcpy(row + j * NO_PICTURE_CHANNELS, tmp, NO_PICTURE_CHANNELS);
+  }
+}
+
+// give a blur pass the next row of its input, returning the next row of its
+// output, or NULL if it needs the row below first
+static const unsigned char *push_blur_row(struct blur_stage *stage, const unsigned char *row, int width)
+{
+  int j = stage->rows++;
+  unsigned char *slot = stage->window[j % 3];
+  memcpy(slot, row, (size_t)width * NO_PICTURE_CHANNELS);
+  if (j == 0)
+  {
+    // don't need to modify boundary rows
+    return slot;
+  }
+  if (j == 1)
+  {
+    return NULL;
+  }
+  get_pic_kernels()->blur_row(stage->window[(j - 2) % 3], stage->window[(j - 1) % 3], slot, stage->out, width);
+  return stage->out;
+}
+
+bool run_picture_stream(struct picture_stream *stream, enum stream_op op, int passes)
+{
+  int width = stream->width;
+  int height = stream->height;
+  size_t row_size = (size_t)width * NO_PICTURE_CHANNELS;
+  const struct pic_kernels *kernels = get_pic_kernels();
+
+  // pictures too small to have an interior are never changed by a blur
+  int no_stages = op == STREAM_BLUR && passes > 0 && width > 2 && height > 2 ? passes : 0;
+  struct blur_stage *stages = calloc(no_stages > 0 ? no_stages : 1, sizeof(struct blur_stage));
+  unsigned char *row = malloc(row_size * (1 + 4 * (size_t)no_stages));
+  bool allocated = stages != NULL && row != NULL;
+  for (int k = 0; allocated && k < no_stages; k++)
+  {
+    unsigned char *rows = row + row_size * (1 + 4 * (size_t)k);
+    for (int n = 0; n < 3; n++)
+    {
+      stages[k].window[n] = rows + row_size * n;
+    }
+    stages[k].out = rows + row_size * 3;
+  }
+
+  bool decoded = allocated;
+  bool saved = true;
+  for (int j = 0; j < height && decoded; j++)
+  {
+    decoded = read_jpeg_row(stream->reader, row);
+    if (!decoded)
+    {
+      break;
+    }
+
+    const unsigned char *out = row;
+    switch (op)
+    {
+    case STREAM_INVERT:
+      kernels->invert_row(row, width);
+      break;
+    case STREAM_GRAYSCALE:
+      kernels->grayscale_row(row, width);
+      break;
+    case STREAM_FLIP_H:
+      mirror_row(row, width);
+      break;
+    case STREAM_BLUR:
+      // each pass hands its rows straight on to the next
+      for (int k = 0; k < no_stages && out != NULL; k++)
+      {
+        out = push_blur_row(&stages[k], out, width);
+      }
+      break;
+    }
+    if (out != NULL)
+    {
+      saved = write_jpeg_row(stream->writer, out) && saved;
+    }
+  }
+
+  // the (unchanged) last row of each pass still has to go through the passes after it
+  for (int k = 0; decoded && k < no_stages; k++)
+  {
+    const unsigned char *out = stages[k].window[(height - 1) % 3];
+    for (int m = k + 1; m < no_stages && out != NULL; m++)
+    {
+      out = push_blur_row(&stages[m], out, width);
+    }
+    if (out != NULL)
+    {
+      saved = write_jpeg_row(stream->writer, out) && saved;
+    }
+  }
+
+  saved = close_jpeg_writer(stream->writer) && saved;
+  close_jpeg_reader(stream->reader);
+  if (!allocated)
+  {
+    remove(stream->dst);
+    printf("[!] could not allocate memory to stream the picture into %s\n", stream->dst);
+  }
+  else if (!decoded)
+  {
+    remove(stream->dst);
+    printf("[!] unsupported image format (expecting jpeg, png or bmp)\n");
+  }
+  else if (!saved)
+  {
+    printf("[!] error saving file to %s\n", stream->dst);
+  }
+
+  free(row);
+  free(stages);
+  free(stream);
+  return decoded && saved;
+}
@@ -0,0 +1,33 @@
+#ifndef PICSTREAM_H
+#define PICSTREAM_H
+
+#include <stdbool.h>
+
+// transformations that only ever look at a few neighbouring rows of a picture
+enum stream_op
+{
+  STREAM_INVERT,
+  STREAM_GRAYSCALE,
+  STREAM_FLIP_H,
+  STREAM_BLUR
+};
+
+// A picture being streamed from one JPEG file into another
+struct picture_stream;
+
+// Open the JPEG at src to be streamed into dst, returning NULL (without reporting
+// anything) if src cannot be read a row at a time or dst cannot be written, in
+// which case the picture has to be loaded whole instead.
+// NOTE: a file is never streamed over itself
+struct picture_stream *open_picture_stream(const char *src, const char *dst);
+
+// Apply op (passes times over, for a blur) to a picture as it streams through:
+// rows are decoded one at a time, transformed in a rolling window of three rows
+// per pass and encoded in bands on the shared pool as soon as they are ready, so
+// no stage ever holds the whole picture and encoding overlaps the other two.
+// The saved file is the one the whole picture transformation saves. Returns
+// false, after reporting it, if src turns out to be damaged (removing dst) or
+// dst cannot be written, as a failed save is. The stream is released either way.
+bool run_picture_stream(struct picture_stream *stream, enum stream_op op, int passes);
+
+#endif
@@ -1,7 +1,24 @@
 #include "Picture.h"
+#include <string.h>
 
 bool init_picture_from_file(struct picture *pic, const char *path)
 {
+  return init_picture_from_file_with_format(pic, path, DEFAULT_PICTURE_FORMAT);
+}
+
+bool init_picture_from_file_with_format(struct picture *pic, const char *path,
+                                        enum picture_format format)
+{
+  pic->format = format;
+  pic->rgb = NULL;
+  pic->img.data = 0;
+  if (format == PACKED_RGB8)
+  {
+    pic->rgb = load_rgb_image(path, &pic->width, &pic->height);
+    // check for picture initialisation error
+    return pic->rgb != NULL;
+  }
+
   pic->img = load_image(path);
   // check for picture initialisation error
   if (pic->img.data == 0)
@@ -15,42 +32,78 @@ bool init_picture_from_file(struct picture *pic, const char *path)
 
 bool init_picture_from_size(struct picture *pic, int width, int height)
 {
+  return init_picture_from_size_with_format(pic, width, height, DEFAULT_PICTURE_FORMAT);
+}
+
+bool init_picture_from_size_with_format(struct picture *pic, int width, int height,
+                                        enum picture_format format)
+{
+  pic->format = format;
+  pic->rgb = NULL;
+  pic->img.data = 0;
+  pic->width = width;
+  pic->height = height;
+  if (format == PACKED_RGB8)
+  {
+    pic->rgb = create_rgb_image(width, height);
+    // check for picture initialisation error
+    return pic->rgb != NULL;
+  }
+
   pic->img = create_image(width, height);
   // check for picture initialisation error
-  if (pic->img.data == 0)
+  return pic->img.data != 0;
+}
+
+bool init_picture_from_picture(struct picture *pic, struct picture *src)
+{
+  if (!init_picture_from_size_with_format(pic, src->width, src->height, src->format))
   {
     return false;
   }
-  pic->width = width;
-  pic->height = height;
+
+  struct picture_plane from[NO_PICTURE_CHANNELS], to[NO_PICTURE_CHANNELS];
+  int no_planes = get_picture_planes(src, from);
+  get_picture_planes(pic, to);
+  for (int i = 0; i < no_planes; i++)
+  {
+    memcpy(to[i].data, from[i].data, from[i].stride * src->height);
+  }
   return true;
 }
 
 void overwrite_picture(struct picture *pic1, struct picture *pic2)
 {
+  pic1->format = pic2->format;
   pic1->img = pic2->img;
+  pic1->rgb = pic2->rgb;
   pic1->width = pic2->width;
   pic1->height = pic2->height;
 }
 
 bool save_picture_to_file(struct picture *pic, const char *path)
 {
+  if (pic->format == PACKED_RGB8)
+  {
+    return save_rgb_image(pic->rgb, pic->width, pic->height, path);
+  }
   return save_image(pic->img, path);
 }
 
-// enum mapping to support get/set pixel functions
-enum RGB
-{
-  RED,
-  GREEN,
-  BLUE
-};
-
 struct pixel get_pixel(struct picture *pic, int x, int y)
 {
   // Beware: pixels are stored in a (x,y) vector from the top left of the image.
   struct pixel pix;
 
+  if (pic->format == PACKED_RGB8)
+  {
+    const unsigned char *rgb = get_rgb_row(pic, y) + x * NO_PICTURE_CHANNELS;
+    pix.red = rgb[RED];
+    pix.green = rgb[GREEN];
+    pix.blue = rgb[BLUE];
+    return pix;
+  }
+
   pix.red = get_pixel_value(pic->img, RED, x, y);
   pix.green = get_pixel_value(pic->img, GREEN, x, y);
   pix.blue = get_pixel_value(pic->img, BLUE, x, y);
@@ -61,6 +114,15 @@ struct pixel get_pixel(struct picture *pic, int x, int y)
 void set_pixel(struct picture *pic, int x, int y, struct pixel *rgb)
 {
   // Beware: pixels are stored in a (x,y) vector from the top left of the image.
+  if (pic->format == PACKED_RGB8)
+  {
+    unsigned char *dst = get_rgb_row(pic, y) + x * NO_PICTURE_CHANNELS;
+    dst[RED] = rgb->red;
+    dst[GREEN] = rgb->green;
+    dst[BLUE] = rgb->blue;
+    return;
+  }
+
   set_pixel_value(pic->img, RED, x, y, rgb->red);
   set_pixel_value(pic->img, GREEN, x, y, rgb->green);
   set_pixel_value(pic->img, BLUE, x, y, rgb->blue);
@@ -73,5 +135,102 @@ bool contains_point(struct picture *pic, int x, int y)
 
 void clear_picture(struct picture *pic)
 {
+  if (pic->format == PACKED_RGB8)
+  {
+    free_rgb_image(pic->rgb);
+    return;
+  }
   free_image(pic->img);
 }
+
+float *get_plane(struct picture *pic, enum RGB rgb)
+{
+  return pic->img.data + (size_t)rgb * pic->width * pic->height;
+}
+
+float *get_row(struct picture *pic, enum RGB rgb, int y)
+{
+  return get_plane(pic, rgb) + (size_t)y * get_row_stride(pic);
+}
+
+unsigned char *get_rgb_row(struct picture *pic, int y)
+{
+  return pic->rgb + (size_t)y * get_row_stride(pic);
+}
+
+const unsigned char *read_rgb_row(struct picture *pic, int y, unsigned char *scratch)
+{
+  if (pic->format == PACKED_RGB8)
+  {
+    return get_rgb_row(pic, y);
+  }
+
+  // interleave the colour planes of the row into the scratch buffer
+  for (int c = 0; c < NO_PICTURE_CHANNELS; c++)
+  {
+    const float *src = get_row(pic, c, y);
+    for (int i = 0; i < pic->width; i++)
+    {
+      scratch[i * NO_PICTURE_CHANNELS + c] = intensity_to_value(src[i]);
+    }
+  }
+  return scratch;
+}
+
+void write_rgb_row(struct picture *pic, int y, const unsigned char *rgb)
+{
+  if (pic->format == PACKED_RGB8)
+  {
+    unsigned char *dst = get_rgb_row(pic, y);
+    if (dst != rgb)
+    {
+      memcpy(dst, rgb, get_row_stride(pic));
+    }
+    return;
+  }
+
+  // split the interleaved values back out into the colour planes
+  for (int c = 0; c < NO_PICTURE_CHANNELS; c++)
+  {
+    float *dst = get_row(pic, c, y);
+    for (int i = 0; i < pic->width; i++)
+    {
+      dst[i] = value_to_intensity(rgb[i * NO_PICTURE_CHANNELS + c]);
+    }
+  }
+}
+
+int get_row_stride(struct picture *pic)
+{
+  if (pic->format == PACKED_RGB8)
+  {
+    return pic->width * NO_PICTURE_CHANNELS;
+  }
+  return pic->width;
+}
+
+int get_picture_planes(struct picture *pic, struct picture_plane planes[NO_PICTURE_CHANNELS])
+{
+  if (pic->format == PACKED_RGB8)
+  {
+    planes[0].data = pic->rgb;
+    planes[0].stride = get_row_stride(pic);
+    planes[0].elem_size = NO_PICTURE_CHANNELS;
+    return 1;
+  }
+
+  for (int c = 0; c < NO_PICTURE_CHANNELS; c++)
+  {
+    planes[c].data = (unsigned char *)get_plane(pic, c);
+    planes[c].stride = get_row_stride(pic) * sizeof(float);
+    planes[c].elem_size = sizeof(float);
+  }
+  return NO_PICTURE_CHANNELS;
+}
+
+size_t get_picture_size(struct picture *pic)
+{
+  struct picture_plane planes[NO_PICTURE_CHANNELS];
+  int no_planes = get_picture_planes(pic, planes);
+  return no_planes * planes[0].stride * pic->height;
+}
@@ -4,6 +4,17 @@
 #include "Utils.h"
 #include <stdbool.h>
 
+// number of colour planes stored for each picture
+#define NO_PICTURE_CHANNELS 3
+
+// enum mapping of the colour planes stored for each picture
+enum RGB
+{
+  RED,
+  GREEN,
+  BLUE
+};
+
 // The pixel struct is used to represent a pixel of an image in RGB format
 struct pixel
 {
@@ -12,22 +23,59 @@ struct pixel
   int blue;
 };
 
+// The layouts a picture can keep its pixels in
+enum picture_format
+{
+  // one sod float plane (0.0 - 1.0) per colour
+  PLANAR_FLOAT,
+  // 8-bit RGB values (0 - 255) interleaved pixel by pixel
+  PACKED_RGB8
+};
+
+// layout used by pictures that are not given one explicitly
+#define DEFAULT_PICTURE_FORMAT PACKED_RGB8
+
 // The picture struct provides a wrapper for image manipulation
 // via the SOD library (https://sod.pixlab.io/intro.html)
 struct picture
 {
-  // sod representation of an image
+  // layout of the stored pixels
+  enum picture_format format;
+  // sod representation of an image (PLANAR_FLOAT only)
   sod_img img;
+  // packed representation of an image (PACKED_RGB8 only)
+  unsigned char *rgb;
   int width;
   int height;
 };
 
+// A raw view of one stored plane of a picture, for layout-agnostic transforms.
+// PLANAR_FLOAT pictures have one plane per colour with float elements, while
+// PACKED_RGB8 pictures have a single plane with 3-byte (RGB) elements.
+struct picture_plane
+{
+  unsigned char *data;
+  size_t stride;
+  int elem_size;
+};
+
 // initialise picture struct with image from a provided file
 bool init_picture_from_file(struct picture *pic, const char *path);
 
+// initialise picture struct with image from a provided file, using the given layout
+bool init_picture_from_file_with_format(struct picture *pic, const char *path,
+                                        enum picture_format format);
+
 // initialise picture struct of the specified size
 bool init_picture_from_size(struct picture *pic, int width, int height);
 
+// initialise picture struct of the specified size, using the given layout
+bool init_picture_from_size_with_format(struct picture *pic, int width, int height,
+                                        enum picture_format format);
+
+// initialise picture struct with a copy of the image stored in another picture (in the same layout)
+bool init_picture_from_picture(struct picture *pic, struct picture *src);
+
 // overwrites the stored image in pic1 with the stored image in pic2
 void overwrite_picture(struct picture *pic1, struct picture *pic2);
 
@@ -46,4 +94,33 @@ bool contains_point(struct picture *pic, int x, int y);
 // clean up the underlying image representation
 void clear_picture(struct picture *pic);
 
+// direct access to the start of a single colour plane of the image
+// NOTE: PLANAR_FLOAT only; each plane holds width * height intensities (0.0 - 1.0)
+float *get_plane(struct picture *pic, enum RGB rgb);
+
+// direct access to row y of a single colour plane of the image
+// NOTE: PLANAR_FLOAT only; no bounds checks are performed, so 0 <= y < height is assumed
+float *get_row(struct picture *pic, enum RGB rgb, int y);
+
+// direct access to row y of the image as interleaved RGB values
+// NOTE: PACKED_RGB8 only; no bounds checks are performed, so 0 <= y < height is assumed
+unsigned char *get_rgb_row(struct picture *pic, int y);
+
+// read row y of the image as interleaved 8-bit RGB values, whatever its layout
+// NOTE: returns the stored row itself for PACKED_RGB8 pictures, otherwise the row
+//       is converted into scratch (which must hold width * NO_PICTURE_CHANNELS bytes)
+const unsigned char *read_rgb_row(struct picture *pic, int y, unsigned char *scratch);
+
+// overwrite row y of the image with interleaved 8-bit RGB values, whatever its layout
+void write_rgb_row(struct picture *pic, int y, const unsigned char *rgb);
+
+// distance (in stored values) between the starts of consecutive rows of the image
+int get_row_stride(struct picture *pic);
+
+// fill planes with raw views of the stored planes of the image and return how many there are
+int get_picture_planes(struct picture *pic, struct picture_plane planes[NO_PICTURE_CHANNELS]);
+
+// number of bytes taken up by the stored planes of the image
+size_t get_picture_size(struct picture *pic);
+
 #endif
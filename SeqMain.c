@@ -1,9 +1,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <dirent.h>
 #include "Utils.h"
 #include "Picture.h"
 #include "PicProcess.h"
+#include "PicKernels.h"
+#include "PicPool.h"
+#include "PicStream.h"
+
+// command line flag (and default directory) for the pixel kernel self-check
+#define SELF_CHECK_FLAG "--self-check"
+#define SELF_CHECK_DIR "test_images"
 
 // list of all possible picture transformations
 static char *cmd_strings[] = {
@@ -16,48 +24,66 @@ static char *cmd_strings[] = {
 
 // -------------- picture transformation function wrappers -------------- \\
 
-void invert_picture_wrapper(struct picture *pic, const char *unused)
+bool invert_picture_wrapper(struct picture *pic, const char *unused)
 {
   printf("calling invert\n");
-  invert_picture(pic);
+  return invert_picture(pic);
 }
 
-void grayscale_picture_wrapper(struct picture *pic, const char *unused)
+bool grayscale_picture_wrapper(struct picture *pic, const char *unused)
 {
   printf("calling grayscale\n");
-  grayscale_picture(pic);
+  return grayscale_picture(pic);
 }
 
-void rotate_picture_wrapper(struct picture *pic, const char *extra_arg)
+bool rotate_picture_wrapper(struct picture *pic, const char *extra_arg)
 {
   int angle = atoi(extra_arg);
   printf("calling rotate (%i)\n", angle);
-  rotate_picture(pic, angle);
+  return rotate_picture(pic, angle);
 }
 
-void flip_picture_wrapper(struct picture *pic, const char *extra_arg)
+bool flip_picture_wrapper(struct picture *pic, const char *extra_arg)
 {
   char plane = extra_arg[0];
   printf("calling flip (%c)\n", plane);
-  flip_picture(pic, plane);
+  return flip_picture(pic, plane);
 }
 
-void blur_picture_wrapper(struct picture *pic, const char *unused)
+// check if an optional blur count (repeating the blur that many times over) is at least 1
+static bool valid_blur_count(const char *extra_arg)
 {
+  return extra_arg == NULL || atoi(extra_arg) >= 1;
+}
+
+bool blur_picture_wrapper(struct picture *pic, const char *extra_arg)
+{
+  if (!valid_blur_count(extra_arg))
+  {
+    printf("[!] blur is undefined for %s passes (must be at least 1)\n", extra_arg);
+    clear_picture(pic);
+    exit(IO_ERROR);
+  }
+  if (extra_arg != NULL)
+  {
+    int passes = atoi(extra_arg);
+    printf("calling blur (%i)\n", passes);
+    return blur_picture_n(pic, passes);
+  }
   printf("calling blur\n");
-  blur_picture(pic);
+  return blur_picture(pic);
 }
 
-void parallel_blur_wrapper(struct picture *pic, const char *unused)
+bool parallel_blur_wrapper(struct picture *pic, const char *unused)
 {
   printf("calling parallel blur\n");
-  parallel_blur_picture(pic);
+  return parallel_blur_picture(pic);
 }
 
 // ------------------------------------------------------------------------ \\
 
 // function pointer look-up table for picture transformation functions
-static void (*const cmds[])(struct picture *, const char *) = {
+static bool (*const cmds[])(struct picture *, const char *) = {
     invert_picture_wrapper,
     grayscale_picture_wrapper,
     rotate_picture_wrapper,
@@ -68,6 +94,107 @@ static void (*const cmds[])(struct picture *, const char *) = {
 // size of look-up table (for safe IO error reporting)
 static int no_of_cmds = sizeof(cmds) / sizeof(cmds[0]);
 
+// ------------ streamed picture transformation function wrappers ------------ \\
+
+bool invert_stream_wrapper(struct picture_stream *stream, const char *unused)
+{
+  printf("calling invert\n");
+  return run_picture_stream(stream, STREAM_INVERT, 1);
+}
+
+bool grayscale_stream_wrapper(struct picture_stream *stream, const char *unused)
+{
+  printf("calling grayscale\n");
+  return run_picture_stream(stream, STREAM_GRAYSCALE, 1);
+}
+
+bool flip_stream_wrapper(struct picture_stream *stream, const char *extra_arg)
+{
+  char plane = extra_arg[0];
+  printf("calling flip (%c)\n", plane);
+  return run_picture_stream(stream, STREAM_FLIP_H, 1);
+}
+
+// NOTE: a bad count is never streamed, so it is reported by blur_picture_wrapper instead
+bool blur_stream_wrapper(struct picture_stream *stream, const char *extra_arg)
+{
+  if (extra_arg != NULL)
+  {
+    int passes = atoi(extra_arg);
+    printf("calling blur (%i)\n", passes);
+    return run_picture_stream(stream, STREAM_BLUR, passes);
+  }
+  printf("calling blur\n");
+  return run_picture_stream(stream, STREAM_BLUR, 1);
+}
+
+// ------------------------------------------------------------------------ \\
+
+// streamed versions of the transformations in cmds, or NULL for those that always load
+// the whole picture (a rotation needs the last row of the original before the first
+// row of the result can be written, and the parallel blur works on it all at once)
+static bool (*const stream_cmds[])(struct picture_stream *, const char *) = {
+    invert_stream_wrapper,
+    grayscale_stream_wrapper,
+    NULL,
+    flip_stream_wrapper,
+    blur_stream_wrapper,
+    NULL};
+
+// check if a transformation can be streamed from file to file, a few rows at a time
+static bool is_streamable(int cmd_no, const char *extra_arg)
+{
+  if (cmd_no == no_of_cmds || stream_cmds[cmd_no] == NULL)
+  {
+    return false;
+  }
+  // a vertical flip needs the last row first as well, so only a horizontal one is streamed
+  if (stream_cmds[cmd_no] == flip_stream_wrapper)
+  {
+    return extra_arg != NULL && extra_arg[0] == 'H';
+  }
+  // a bad blur count must fail before the stream creates the target file
+  return stream_cmds[cmd_no] != blur_stream_wrapper || valid_blur_count(extra_arg);
+}
+
+// --------------------------- kernel self-check --------------------------- \\
+
+// check if a file name has one of the picture extensions we can decode
+static bool is_picture_file(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  return ext != NULL && (!strcmp(ext, ".jpg") || !strcmp(ext, ".jpeg") || !strcmp(ext, ".png"));
+}
+
+// compare every vectorised kernel set with the scalar one on each picture in dir
+static int run_self_check(const char *dir)
+{
+  DIR *dp = opendir(dir);
+  if (dp == NULL)
+  {
+    printf("[!] error reading from directory %s (check it exists)\n", dir);
+    return IO_ERROR;
+  }
+
+  printf("selected kernels = %s\n", get_pic_kernels()->name);
+  bool success = true;
+  struct dirent *entry;
+  while ((entry = readdir(dp)) != NULL)
+  {
+    if (!is_picture_file(entry->d_name))
+    {
+      continue;
+    }
+    char path[strlen(dir) + strlen(entry->d_name) + 2];
+    sprintf(path, "%s/%s", dir, entry->d_name);
+    success = self_check_kernels(path) && success;
+  }
+  closedir(dp);
+
+  printf(success ? "-- kernel self-check passed --\n" : "[!] kernel self-check failed\n");
+  return success ? 0 : IO_ERROR;
+}
+
 // ---------- MAIN PROGRAM ---------- \\
 
 int main(int argc, char **argv)
@@ -75,6 +202,12 @@ int main(int argc, char **argv)
 
   printf("Running the C Picture Processor... \n");
 
+  // run the pixel kernel self-check instead of a transformation if requested
+  if (argc > 1 && !strcmp(argv[1], SELF_CHECK_FLAG))
+  {
+    return run_self_check(argc > 2 ? argv[2] : SELF_CHECK_DIR);
+  }
+
   // capture and check command line arguments
   const char *filename = argv[1];
   const char *target_file = argv[2];
@@ -94,13 +227,6 @@ int main(int argc, char **argv)
 
   printf("\n");
 
-  // create original image object
-  struct picture pic;
-  if (!init_picture_from_file(&pic, filename))
-  {
-    exit(IO_ERROR);
-  }
-
   // identify the picture transformation to run
   int cmd_no = 0;
   while (cmd_no < no_of_cmds && strcmp(process, cmd_strings[cmd_no]))
@@ -108,6 +234,31 @@ int main(int argc, char **argv)
     cmd_no++;
   }
 
+  // stream JPEGs through the transformations that allow it, from decoder to encoder,
+  // so that the whole picture is never held in memory
+  struct picture_stream *stream = NULL;
+  if (is_streamable(cmd_no, extra_arg))
+  {
+    stream = open_picture_stream(filename, target_file);
+  }
+  if (stream != NULL)
+  {
+    if (!stream_cmds[cmd_no](stream, extra_arg))
+    {
+      exit(IO_ERROR);
+    }
+    printf("-- picture processing complete --\n");
+    shutdown_picture_pool();
+    return 0;
+  }
+
+  // create original image object
+  struct picture pic;
+  if (!init_picture_from_file(&pic, filename))
+  {
+    exit(IO_ERROR);
+  }
+
   // IO error check
   if (cmd_no == no_of_cmds)
   {
@@ -117,12 +268,18 @@ int main(int argc, char **argv)
   }
 
   // dispatch to appropriate picture transformation function
-  cmds[cmd_no](&pic, extra_arg);
+  if (!cmds[cmd_no](&pic, extra_arg))
+  {
+    printf("[!] could not allocate memory to %s the picture\n", process);
+    clear_picture(&pic);
+    exit(IO_ERROR);
+  }
 
   // save resulting picture and report success
   save_picture_to_file(&pic, target_file);
   printf("-- picture processing complete --\n");
 
   clear_picture(&pic);
+  shutdown_picture_pool();
   return 0;
 }
@@ -1,9 +1,24 @@
 #include "Utils.h"
+#include <ctype.h>
+#include <stdint.h>
 #include <unistd.h>
+#include "PicJpeg.h"
 
-#define DEFAULT_COMPRESSION_QUALITY -1
 #define FULL_COLOUR_CHANNELS 3
 
+// stream reports go to on this thread (NULL for stdout)
+static _Thread_local FILE *report_stream;
+
+FILE *get_report_stream(void)
+{
+  return report_stream != NULL ? report_stream : stdout;
+}
+
+void set_report_stream(FILE *stream)
+{
+  report_stream = stream;
+}
+
 sod_img create_image(int width, int height)
 {
   return sod_make_image(width, height, FULL_COLOUR_CHANNELS);
@@ -14,29 +29,85 @@ void free_image(sod_img img)
   sod_free_image(img);
 }
 
+// report (and fail) when a file to load from is missing
+static bool check_readable(const char *path)
+{
+  if (access(path, F_OK) == IO_ERROR)
+  {
+    fprintf(get_report_stream(), "[!] error reading from file %s (check it exists)\n", path);
+    return false;
+  }
+  return true;
+}
+
 sod_img load_image(const char *path)
 {
   sod_img input;
-  if (access(path, F_OK) == IO_ERROR)
+  if (!check_readable(path))
   {
-    printf("[!] error reading from file %s (check it exists)\n", path);
     input.data = 0;
     return input;
   }
-  input = sod_img_load_from_file(path, SOD_IMG_COLOR);
+  // JPEGs with restart intervals are decoded in parallel, anything else by sod
+  input.data = read_jpeg_planes(path, &input.w, &input.h, &input.c);
   if (input.data == 0)
   {
-    printf("[!] unsupported image format (expecting jpeg, png or bmp)\n");
+    input = sod_img_load_from_file(path, SOD_IMG_COLOR);
+  }
+  if (input.data == 0)
+  {
+    fprintf(get_report_stream(), "[!] unsupported image format (expecting jpeg, png or bmp)\n");
   }
   return input;
 }
 
 bool save_image(sod_img img, const char *path)
 {
-  int ret = sod_img_save_as_jpeg(img, path, DEFAULT_COMPRESSION_QUALITY);
-  if (ret != SOD_OK)
+  unsigned char *pixels = sod_image_to_blob(img);
+  bool saved = pixels != NULL && write_jpeg(path, pixels, img.w, img.h, img.c, DEFAULT_COMPRESSION_QUALITY);
+  sod_image_free_blob(pixels);
+  if (!saved)
   {
-    printf("[!] error saving file to %s\n", path);
+    fprintf(get_report_stream(), "[!] error saving file to %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+unsigned char *create_rgb_image(int width, int height)
+{
+  return calloc((size_t)width * height, FULL_COLOUR_CHANNELS);
+}
+
+void free_rgb_image(unsigned char *rgb)
+{
+  free(rgb);
+}
+
+unsigned char *load_rgb_image(const char *path, int *width, int *height)
+{
+  if (!check_readable(path))
+  {
+    return NULL;
+  }
+  int comp;
+  unsigned char *rgb = read_jpeg(path, width, height, &comp, FULL_COLOUR_CHANNELS);
+  if (rgb == NULL)
+  {
+    rgb = sod_img_blob_load_from_file(path, width, height, FULL_COLOUR_CHANNELS);
+  }
+  if (rgb == NULL)
+  {
+    fprintf(get_report_stream(), "[!] unsupported image format (expecting jpeg, png or bmp)\n");
+  }
+  return rgb;
+}
+
+bool save_rgb_image(const unsigned char *rgb, int width, int height, const char *path)
+{
+  if (!write_jpeg(path, rgb, width, height, FULL_COLOUR_CHANNELS, DEFAULT_COMPRESSION_QUALITY))
+  {
+    fprintf(get_report_stream(), "[!] error saving file to %s\n", path);
     return false;
   }
   return true;
@@ -60,12 +131,40 @@ int get_image_height(sod_img img)
 int get_pixel_value(sod_img img, int rgb, int x, int y)
 {
   float intensity = sod_img_get_pixel(img, x, y, rgb);
-  int rgb_value = intensity * MAX_PIXEL_INTENSITY;
-  return rgb_value;
+  return intensity_to_value(intensity);
 }
 
 void set_pixel_value(sod_img img, int rgb, int x, int y, int val)
 {
-  float intensity = val / MAX_PIXEL_INTENSITY;
+  float intensity = value_to_intensity(val);
   sod_img_set_pixel(img, x, y, rgb, intensity);
 }
+
+size_t hash_picture_name(const char *name)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+  {
+    hash = (hash ^ *c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+size_t parse_byte_size(const char *text)
+{
+  char *unit;
+  size_t bytes = strtoull(text, &unit, 10);
+  switch (toupper((unsigned char)*unit))
+  {
+  case 'G':
+    bytes *= 1024;
+    // fall through
+  case 'M':
+    bytes *= 1024;
+    // fall through
+  case 'K':
+    bytes *= 1024;
+    break;
+  }
+  return bytes;
+}
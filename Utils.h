@@ -9,6 +9,9 @@
 #define IO_ERROR -1
 #define MAX_PIXEL_INTENSITY 255.0
 
+// JPEG quality pictures are saved with (what sod picks for an unspecified one)
+#define DEFAULT_COMPRESSION_QUALITY 100
+
 // Create a new instance of a sod image of the specified width
 // and height, using the full RGB colour model.
 sod_img create_image(int width, int height);
@@ -25,6 +28,20 @@ bool save_image(sod_img img, const char *path);
 // Clones the image provided as argument
 sod_img copy_image(sod_img img);
 
+// Create a new packed 8-bit RGB buffer of the specified width and height,
+// storing the red, green and blue values of each pixel next to each other.
+unsigned char *create_rgb_image(int width, int height);
+
+// Free the memory used by the packed RGB buffer provided as argument
+void free_rgb_image(unsigned char *rgb);
+
+// Create a packed RGB buffer from the image file at the specified location,
+// reporting its width and height through the provided pointers.
+unsigned char *load_rgb_image(const char *path, int *width, int *height);
+
+// Saves the given packed RGB buffer in the given destination.
+bool save_rgb_image(const unsigned char *rgb, int width, int height, const char *path);
+
 // Find the width of the provided image
 int get_image_width(sod_img img);
 
@@ -39,4 +56,30 @@ int get_pixel_value(sod_img img, int rgb, int x, int y);
 // NOTE: (rgb = 0 for red, rgb = 1 for green, rgb = 2 for blue)
 void set_pixel_value(sod_img img, int rgb, int x, int y, int val);
 
+// Find the stream the calling thread reports failures to load or save files
+// on: stdout, unless set_report_stream() has redirected it
+FILE *get_report_stream(void);
+
+// Redirect the calling thread's reports to the given stream (NULL for stdout),
+// e.g. to collect the reports of a command and print them later, in order
+void set_report_stream(FILE *stream);
+
+// Hash of a picture name or file path (FNV-1a), as used to index pictures by either
+size_t hash_picture_name(const char *name);
+
+// Read a number of bytes, which may be followed by a K, M or G suffix (as in "64M")
+size_t parse_byte_size(const char *text);
+
+// Convert a stored sod intensity (0.0 - 1.0) into an RGB value (0 - 255)
+static inline int intensity_to_value(float intensity)
+{
+  return intensity * MAX_PIXEL_INTENSITY;
+}
+
+// Convert an RGB value (0 - 255) into a stored sod intensity (0.0 - 1.0)
+static inline float value_to_intensity(int val)
+{
+  return val / MAX_PIXEL_INTENSITY;
+}
+
 #endif
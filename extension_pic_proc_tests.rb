@@ -112,6 +112,12 @@ else
   run_test("load_test","",[],[],["funny_name"]) #load
   run_test("unload_test","test_images/ducks2.jpg test_images/ducks1.jpg test_images/test.jpg",[],[],["ducks1\n"],["ducks2\n"]) #unload
   run_test("save_test","test_images/some_ducks.jpg",["a_random_test_name.jpg"],["a_random_test_name.jpeg"]) #save  
+  run_test("invalid_geometry","test_images/test.jpg",[],[],["angle 45", "plane X", "test\n"]) #bad rotate/flip arguments
+  run_test("save_and_reload","test_images/test.jpg",["test_reloaded.jpg"],["test_inverted.jpeg"],["reloaded\n"],["[!]"]) #load after save to the same file
+  run_test("batch_file_order","--batch test_images/test.jpg",["test_batch_saved.jpg"],["test_inverted.jpeg"],["(check it exists)\nresident", "  copy\n"]) #--batch: load after save, error before listing
+  ENV["PICTURE_STORE_BUDGET"] = "1400K" # room for test (loaded twice) and blip, but not for test twice over
+  run_test("shared_budget","",[],[],["resident       600000  c\n"],["spilled"]) #budget
+  ENV.delete("PICTURE_STORE_BUDGET")
     
   # basic "sequential" transformation tests:
   run_test("test_invert", "test_images/test.jpg", ["test_inverted.jpg"], ["test_inverted.jpeg"])
@@ -137,6 +143,11 @@ else
 
   run_test("test_blur", "test_images/test.jpg", ["test_blur.jpg"], ["test_blur.jpeg"])
   run_test("test_load_and_blur", "", ["test_blur.jpg"], ["test_blur.jpeg"])  
+
+  # fused runs of commands must match the same commands run one at a time (liststore ends a run):
+  run_test("fused_colours", "", ["test_fused_colours.jpg"], ["test_stepwise_colours.jpg"])
+  run_test("composed_geometry", "", ["test_composed_geometry.jpg"], ["test_stepwise_geometry.jpg"])
+  run_test("blur_count", "", ["test_blur_3.jpg"], ["test_stepwise_blur_3.jpg"])
       
   # basic concurrency tests (check thread-safe and actual speed-up):
   puts "------------------------------"
@@ -167,6 +178,9 @@ else
   end
   puts ""
 
+  # two loads of one file saved with restart markers (decoded in parallel) must not deadlock:
+  run_test("load_restarts_twice", "", ["test_restarts2.jpg"], ["test_restarts1.jpg"], ["first\n", "second\n"])
+
 
   # full integration tests (more realistic inputs):
   puts "------------------------------"
@@ -116,6 +116,25 @@ else
     run_test("repeated parallel blur test #{blur_cnt}", "par-need_glasses#{blur_cnt-1}.jpg par-need_glasses#{blur_cnt}.jpg parallel-blur", "need_glasses#{blur_cnt}.jpeg")  
   end
   
+  puts "----------------------------------------"
+  puts "      Pixel Kernel Self-Check Cases     "
+  puts "----------------------------------------"
+  puts ""
+
+  # every vectorised kernel set must agree exactly with the scalar kernels
+  puts "> running: kernel self-check"
+  puts "--------------------------------------"
+  output = %x(./picture_lib --self-check test_images)
+  puts output.lines.reject { |line| line.end_with?(": ok\n") }.join
+  if($?.exitstatus == 0) then
+    puts ("  + all kernel sets match the scalar kernels")
+    @testscores << {"score": 1, "name": "kernel self-check", "possible": 1}
+  else
+    puts "  - a kernel set did not match the scalar kernels!"
+    @testscores << {"score": 0, "name": "kernel self-check", "possible": 1}
+  end
+  puts ""
+
   puts "----------------------------------------"
   puts "           IO ERROR Test Cases          " 
   puts "----------------------------------------"
@@ -134,6 +153,9 @@ else
   run_test("rotate arg error test 3", "test_images/test.jpg output.jpg rotate 360", nil, false)
   
   run_test("flip arg error test", "test_images/test.jpg output.jpg flip O", nil, false)
+
+  run_test("blur arg error test 1", "test_images/test.jpg output.jpg blur 0", nil, false)
+  run_test("blur arg error test 2", "test_images/test.jpg output.jpg blur two", nil, false)
   
   # clean up the files generated by the tests
   system %Q(make clean)
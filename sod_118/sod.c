@@ -13573,8 +13573,9 @@ sod_img sod_img_load_from_file(const char *zFile, int nChannels)
 	unsigned char *data;
 	void *pMap = 0;
 	size_t sz = 0; /* gcc warn */
+	float values[256];
 	int w, h, c;
-	int i, j, k;
+	int i, k;
 	if (SOD_OK != pVfs->xMmap(zFile, &pMap, &sz)) {
 		data = stbi_load(zFile, &w, &h, &c, nChannels);
 	}
@@ -13585,15 +13586,19 @@ sod_img sod_img_load_from_file(const char *zFile, int nChannels)
 		return sod_make_empty_image(0, 0, 0);
 	}
 	if (nChannels) c = nChannels;
-	sod_img im = sod_make_image(w, h, c);
+	sod_img im = sod_make_empty_image(w, h, c);
+	im.data = (float *)malloc((size_t)w * h * c * sizeof(float));
 	if (im.data) {
-		for (k = 0; k < c; ++k) {
-			for (j = 0; j < h; ++j) {
-				for (i = 0; i < w; ++i) {
-					int dst_index = i + w * j + w * h*k;
-					int src_index = k + c * i + c * w*j;
-					im.data[dst_index] = (float)data[src_index] / 255.;
-				}
+		/* Walk the decoded samples once, in the order they are stored, dealing each
+		 * pixel's samples out to the planes (rather than one strided pass per plane) */
+		const unsigned char *zSrc = data;
+		size_t nPlane = (size_t)w * h;
+		for (i = 0; i < 256; ++i) {
+			values[i] = (float)i / 255.;
+		}
+		for (i = 0; i < (int)nPlane; ++i) {
+			for (k = 0; k < c; ++k) {
+				im.data[i + nPlane * k] = values[*zSrc++];
 			}
 		}
 	}
@@ -13604,6 +13609,27 @@ sod_img sod_img_load_from_file(const char *zFile, int nChannels)
 	return im;
 }
 /*
+* CAPIREF: Refer to the official documentation at https://sod.pixlab.io/api.html for the expected parameters this interface takes.
+* Unlike sod_img_load_from_file(), the decoded 8-bit samples are returned as is (interleaved, one row after another)
+* without expansion to float planes. The returned blob must be released via sod_image_free_blob().
+*/
+unsigned char * sod_img_blob_load_from_file(const char *zFile, int *pWidth, int *pHeight, int nChannels)
+{
+	const sod_vfs *pVfs = sodExportBuiltinVfs();
+	unsigned char *data;
+	void *pMap = 0;
+	size_t sz = 0; /* gcc warn */
+	int c;
+	if (SOD_OK != pVfs->xMmap(zFile, &pMap, &sz)) {
+		data = stbi_load(zFile, pWidth, pHeight, &c, nChannels);
+	}
+	else {
+		data = stbi_load_from_memory((const unsigned char *)pMap, (int)sz, pWidth, pHeight, &c, nChannels);
+		pVfs->xUnmap(pMap, sz);
+	}
+	return data;
+}
+/*
 * Extract path fields.
 */
 static int ExtractPathInfo(const char *zPath, size_t nByte, sod_path_info *pOut)
@@ -273,6 +273,7 @@ SOD_APIEXPORT void sod_free_image(sod_img m);
 #ifndef SOD_DISABLE_IMG_READER
 SOD_APIEXPORT sod_img sod_img_load_from_file(const char *zFile, int nChannels);
 SOD_APIEXPORT sod_img sod_img_load_from_mem(const unsigned char *zBuf, int buf_len, int nChannels);
+SOD_APIEXPORT unsigned char * sod_img_blob_load_from_file(const char *zFile, int *pWidth, int *pHeight, int nChannels);
 SOD_APIEXPORT int  sod_img_set_load_from_directory(const char *zPath, sod_img ** apLoaded, int * pnLoaded, int max_entries);
 SOD_APIEXPORT void sod_img_set_release(sod_img *aLoaded, int nEntries);
 #ifndef SOD_DISABLE_IMG_WRITER
@@ -15,15 +15,25 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 #endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+/* syscall() is needed for futexes */
+#define _DEFAULT_SOURCE
+#endif
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <time.h>
+#include <stdatomic.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 
 #include "thpool.h"
@@ -40,6 +50,10 @@
 #define err(str)
 #endif
 
+#define JOBQUEUE_SIZE 4096              /* jobs the shared queue holds (a power of two) */
+#define WSDEQUE_INITIAL_SIZE 64         /* initial capacity of a work-stealing deque */
+#define IDLE_SPINS 64                   /* empty rounds before an idle thread parks */
+
 static volatile int threads_keepalive;
 static volatile int threads_on_hold;
 
@@ -48,51 +62,112 @@ static volatile int threads_on_hold;
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
-	pthread_mutex_t mutex;
-	pthread_cond_t   cond;
-	int v;
-} bsem;
+/* Parking spot for idle threads (an eventcount) */
+typedef struct parking{
+	atomic_uint epoch;                   /* bumped by every wake-up   */
+	atomic_int  waiters;                 /* threads about to sleep    */
+#if !defined(__linux__)
+	pthread_mutex_t mutex;               /* used to sleep on epoch    */
+	pthread_cond_t   cond;               /* signal of a new epoch     */
+#endif
+} parking;
 
 
-/* Job */
+/* Job
+ *
+ * Jobs are small enough to be copied around by value.
+ */
 typedef struct job{
-	struct job*  prev;                   /* pointer to previous job   */
 	void   (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
 } job;
 
 
-/* Job queue */
+/* Slot of the job queue */
+typedef struct jobslot{
+	atomic_size_t seq;                   /* whose turn the slot is    */
+	job    job;                          /* job stored in the slot    */
+} jobslot;
+
+
+/* Job queue: a bounded lock-free multi-producer multi-consumer ring
+ *
+ * Slot i is free for the push numbered p when its seq is p, and holds the
+ * job for the pull numbered p when its seq is p + 1. Pushes and pulls claim
+ * their number with a compare-and-swap on rear or front respectively.
+ */
 typedef struct jobqueue{
-	pthread_mutex_t rwmutex;             /* used for queue r/w access */
-	job  *front;                         /* pointer to front of queue */
-	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	jobslot* slots;                      /* ring of JOBQUEUE_SIZE     */
+	char pad0[64];                       /* keep rear and front apart */
+	atomic_size_t rear;                  /* number of the next push   */
+	char pad1[64];
+	atomic_size_t front;                 /* number of the next pull   */
+	char pad2[64];
 } jobqueue;
 
 
+/* Circular array of a work-stealing deque */
+typedef struct wsarray{
+	long size;                           /* capacity (a power of two) */
+	struct wsarray* prev;                /* array this one replaced   */
+	job  buf[];                          /* jobs, indexed modulo size */
+} wsarray;
+
+
+/* Chase-Lev work-stealing deque: the owner pushes and takes at the bottom,
+ * any other thread steals from the top */
+typedef struct wsdeque{
+	atomic_long top;                     /* next index to steal       */
+	char pad[64];                        /* keep top and bottom apart */
+	atomic_long bottom;                  /* next index to push        */
+	_Atomic(wsarray*) array;             /* current circular array    */
+} wsdeque;
+
+
+/* Parallel for loop */
+typedef struct pfor_loop{
+	atomic_int next;                     /* first index not claimed   */
+	int    end;                          /* index after the loop      */
+	int    grain;                        /* largest range run as one  */
+	void   (*function)(int, int, void*); /* body, given a range       */
+	void*  ctx;                          /* body's argument           */
+	atomic_int remaining;                /* indices not yet run       */
+	atomic_int refs;                     /* caller and helper jobs    */
+	parking    done;                     /* where the caller waits    */
+} pfor_loop;
+
+
 /* Thread */
 typedef struct thread{
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	wsdeque   deque;                     /* own jobs (work stealing)  */
+	unsigned int seed;                   /* picks victims to steal    */
 } thread;
 
 
 /* Threadpool */
 typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
+	int        num_threads;              /* threads created           */
+	thpool_scheduler scheduler;          /* how jobs reach threads    */
 	volatile int num_threads_alive;      /* threads currently alive   */
 	volatile int num_threads_working;    /* threads currently working */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
 	jobqueue  jobqueue;                  /* job queue                 */
+	atomic_int jobs_queued;              /* jobs waiting for a thread */
+	atomic_int jobs_pending;             /* jobs not finished yet     */
+	parking   parking;                   /* where idle threads sleep  */
+	parking   space;                     /* where adders wait for room */
 } thpool_;
 
 
+/* Thread of the pool the calling code runs on (NULL outside any pool) */
+static _Thread_local thread* current_thread;
+
+
 
 
 
@@ -101,20 +176,42 @@ typedef struct thpool_{
 
 static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
 static void* thread_do(struct thread* thread_p);
+static int   thread_find_job(struct thread* thread_p, struct job* job_p, int* raced);
+static int   thread_steal_job(thpool_* thpool_p, struct thread* thread_p, unsigned int* seed,
+                              struct job* job_p, int* raced);
+static void  thread_park(thpool_* thpool_p);
 static void  thread_hold(int sig_id);
 static void  thread_destroy(struct thread* thread_p);
 
 static int   jobqueue_init(jobqueue* jobqueue_p);
-static void  jobqueue_clear(jobqueue* jobqueue_p);
-static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
-static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static int   jobqueue_push(jobqueue* jobqueue_p, const struct job* job_p);
+static int   jobqueue_pull(jobqueue* jobqueue_p, struct job* job_p);
+static int   jobqueue_full(jobqueue* jobqueue_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static void  job_run(const struct job* job_p);
+
+static void  pfor_run(pfor_loop* loop);
+static void  pfor_wait(pfor_loop* loop);
+static void  pfor_help(void* arg);
+static void  pfor_release(pfor_loop* loop);
+
+static int   wsdeque_init(wsdeque* deque_p);
+static void  wsdeque_push(wsdeque* deque_p, const struct job* job_p);
+static int   wsdeque_take(wsdeque* deque_p, struct job* job_p);
+static int   wsdeque_steal(wsdeque* deque_p, struct job* job_p);
+static void  wsdeque_destroy(wsdeque* deque_p);
+
+static int   thpool_push(thpool_* thpool_p, const struct job* job_p);
+static void  thpool_run_job(thpool_* thpool_p, const struct job* job_p);
+static void  thpool_job_done(thpool_* thpool_p);
+static void  thpool_wait_space(thpool_* thpool_p);
+static void  thpool_space_freed(thpool_* thpool_p);
+
+static void  parking_init(parking* parking_p);
+static void  parking_sleep(parking* parking_p, unsigned int epoch);
+static void  parking_wake(parking* parking_p, int all);
+static void  parking_destroy(parking* parking_p);
 
 
 
@@ -125,6 +222,12 @@ static void  bsem_wait(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	return thpool_init_with_scheduler(num_threads, THPOOL_SHARED_QUEUE);
+}
+
+
+/* Initialise thread pool using the given scheduler */
+struct thpool_* thpool_init_with_scheduler(int num_threads, thpool_scheduler scheduler){
 
 	threads_on_hold   = 0;
 	threads_keepalive = 1;
@@ -140,8 +243,12 @@ struct thpool_* thpool_init(int num_threads){
 		err("thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
+	thpool_p->num_threads         = num_threads;
+	thpool_p->scheduler           = scheduler;
 	thpool_p->num_threads_alive   = 0;
 	thpool_p->num_threads_working = 0;
+	atomic_init(&thpool_p->jobs_queued, 0);
+	atomic_init(&thpool_p->jobs_pending, 0);
 
 	/* Initialise the job queue */
 	if (jobqueue_init(&thpool_p->jobqueue) == -1){
@@ -161,6 +268,8 @@ struct thpool_* thpool_init(int num_threads){
 
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
 	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+	parking_init(&thpool_p->parking);
+	parking_init(&thpool_p->space);
 
 	/* Thread init */
 	int n;
@@ -180,29 +289,88 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
-	job* newjob;
-
-	newjob=(struct job*)malloc(sizeof(struct job));
-	if (newjob==NULL){
-		err("thpool_add_work(): Could not allocate memory for new job\n");
-		return -1;
-	}
+	job newjob;
 
 	/* add function and argument */
-	newjob->function=function_p;
-	newjob->arg=arg_p;
+	newjob.function = function_p;
+	newjob.arg      = arg_p;
 
-	/* add job to queue */
-	jobqueue_push(&thpool_p->jobqueue, newjob);
+	/* add job to queue, sleeping while the queue is full (running a queued job
+	 * here instead could block on work further down this stack) */
+	while (thpool_push(thpool_p, &newjob) == -1){
+		thpool_wait_space(thpool_p);
+	}
 
 	return 0;
 }
 
 
+/* Run a loop body over [begin, end), splitting the range across the pool */
+void thpool_parallel_for(thpool_* thpool_p, int begin, int end, int grain,
+                         void (*function_p)(int, int, void*), void* ctx){
+	if (begin >= end){
+		return;
+	}
+
+	/* by default every thread gets a few ranges, to even out their load */
+	if (grain <= 0){
+		grain = (end - begin) / (4 * (thpool_p->num_threads > 0 ? thpool_p->num_threads : 1));
+		grain = grain > 0 ? grain : 1;
+	}
+
+	/* nothing to share: run the whole range on the calling thread */
+	if (thpool_p->num_threads == 0 || end - begin <= grain){
+		function_p(begin, end, ctx);
+		return;
+	}
+
+	/* helper jobs may only start once the loop is over, so it outlives this frame */
+	pfor_loop* loop = (struct pfor_loop*)malloc(sizeof(struct pfor_loop));
+	if (loop == NULL){
+		function_p(begin, end, ctx);
+		return;
+	}
+	int ranges  = (end - begin + grain - 1) / grain;
+	int helpers = ranges - 1 < thpool_p->num_threads ? ranges - 1 : thpool_p->num_threads;
+	atomic_init(&loop->next, begin);
+	loop->end      = end;
+	loop->grain    = grain;
+	loop->function = function_p;
+	loop->ctx      = ctx;
+	atomic_init(&loop->remaining, end - begin);
+	atomic_init(&loop->refs, 1 + helpers);
+	parking_init(&loop->done);
+
+	int n;
+	for (n=0; n < helpers; n++){
+		job helper;
+		helper.function = pfor_help;
+		helper.arg      = loop;
+		if (thpool_push(thpool_p, &helper) == -1){
+			pfor_release(loop);
+		}
+	}
+	pfor_run(loop);
+
+	/* Only wait for the ranges helpers are already running. Running other
+	 * queued jobs here instead could block on work further down this stack
+	 * (a job waiting for something the loop's caller is about to finish). */
+	int spins = 0;
+	while (atomic_load_explicit(&loop->remaining, memory_order_acquire) > 0){
+		if (++spins < IDLE_SPINS){
+			sched_yield();
+		} else {
+			pfor_wait(loop);
+		}
+	}
+	pfor_release(loop);
+}
+
+
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
 	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue.len || thpool_p->num_threads_working) {
+	while (atomic_load(&thpool_p->jobs_pending) > 0) {
 		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
 	}
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
@@ -225,19 +393,21 @@ void thpool_destroy(thpool_* thpool_p){
 	double tpassed = 0.0;
 	time (&start);
 	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		parking_wake(&thpool_p->parking, 1);
 		time (&end);
 		tpassed = difftime(end,start);
 	}
 
 	/* Poll remaining threads */
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		parking_wake(&thpool_p->parking, 1);
 		sleep(1);
 	}
 
 	/* Job queue cleanup */
 	jobqueue_destroy(&thpool_p->jobqueue);
+	parking_destroy(&thpool_p->parking);
+	parking_destroy(&thpool_p->space);
 	/* Deallocs */
 	int n;
 	for (n=0; n < threads_total; n++){
@@ -248,6 +418,92 @@ void thpool_destroy(thpool_* thpool_p){
 }
 
 
+/* Hand a job to the pool's threads
+ *
+ * With work stealing, jobs added by the pool's own threads go on their deque.
+ * Everything else goes on the shared queue for the first idle thread to pick
+ * up. A thread of the pool never has to wait for room in the queue (it may be
+ * the one to make it), so its jobs overflow onto its deque instead, while a
+ * push from outside the pool fails.
+ *
+ * @return 0 on success, -1 if the queue is full
+ */
+static int thpool_push(thpool_* thpool_p, const struct job* job_p){
+	int own = current_thread != NULL && current_thread->thpool_p == thpool_p;
+
+	/* count the job before any thread can finish it */
+	atomic_fetch_add(&thpool_p->jobs_pending, 1);
+
+	if (own && thpool_p->scheduler == THPOOL_WORK_STEALING){
+		wsdeque_push(&current_thread->deque, job_p);
+	} else if (jobqueue_push(&thpool_p->jobqueue, job_p) == -1){
+		if (!own){
+			thpool_job_done(thpool_p);
+			return -1;
+		}
+		wsdeque_push(&current_thread->deque, job_p);
+	}
+
+	/* wake a parked thread (see thread_park() for why this cannot be missed) */
+	atomic_fetch_add(&thpool_p->jobs_queued, 1);
+	if (atomic_load(&thpool_p->parking.waiters) > 0){
+		parking_wake(&thpool_p->parking, 0);
+	}
+	return 0;
+}
+
+
+/* Run a job taken from the pool, keeping its counts up to date */
+static void thpool_run_job(thpool_* thpool_p, const struct job* job_p){
+	atomic_fetch_sub(&thpool_p->jobs_queued, 1);
+
+	__atomic_fetch_add(&thpool_p->num_threads_working, 1, __ATOMIC_RELAXED);
+	job_run(job_p);
+	__atomic_fetch_sub(&thpool_p->num_threads_working, 1, __ATOMIC_RELAXED);
+
+	thpool_job_done(thpool_p);
+}
+
+
+/* Count a job as finished */
+static void thpool_job_done(thpool_* thpool_p){
+	/* the last job to finish releases thpool_wait() */
+	if (atomic_fetch_sub(&thpool_p->jobs_pending, 1) == 1){
+		pthread_mutex_lock(&thpool_p->thcount_lock);
+		pthread_cond_broadcast(&thpool_p->threads_all_idle);
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+	}
+}
+
+
+/* Sleep until a job is taken off the full queue
+ *
+ * As in thread_park(), the waiter count is raised before the queue is checked,
+ * while thpool_space_freed() frees a slot before it checks the waiter count,
+ * so either the queue is seen to have room or the epoch read here moves on.
+ */
+static void thpool_wait_space(thpool_* thpool_p){
+	parking* parking_p = &thpool_p->space;
+
+	atomic_fetch_add(&parking_p->waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	unsigned int epoch = atomic_load(&parking_p->epoch);
+	if (jobqueue_full(&thpool_p->jobqueue)){
+		parking_sleep(parking_p, epoch);
+	}
+	atomic_fetch_sub(&parking_p->waiters, 1);
+}
+
+
+/* Wake a caller waiting for room, after a job was taken off the queue */
+static void thpool_space_freed(thpool_* thpool_p){
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&thpool_p->space.waiters) > 0){
+		parking_wake(&thpool_p->space, 0);
+	}
+}
+
+
 /* Pause all threads in threadpool */
 void thpool_pause(thpool_* thpool_p) {
 	int n;
@@ -269,7 +525,7 @@ void thpool_resume(thpool_* thpool_p) {
 
 
 int thpool_num_threads_working(thpool_* thpool_p){
-	return thpool_p->num_threads_working;
+	return __atomic_load_n(&thpool_p->num_threads_working, __ATOMIC_RELAXED);
 }
 
 
@@ -295,6 +551,13 @@ static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
 
 	(*thread_p)->thpool_p = thpool_p;
 	(*thread_p)->id       = id;
+	(*thread_p)->seed     = 2654435761u * (id + 1);
+
+	if (wsdeque_init(&(*thread_p)->deque) == -1){
+		err("thread_init(): Could not allocate memory for work-stealing deque\n");
+		free(*thread_p);
+		return -1;
+	}
 
 	pthread_create(&(*thread_p)->pthread, NULL, (void * (*)(void *)) thread_do, (*thread_p));
 	pthread_detach((*thread_p)->pthread);
@@ -315,7 +578,9 @@ static void thread_hold(int sig_id) {
 /* What each thread is doing
 *
 * In principle this is an endless loop. The only time this loop gets interuppted is once
-* thpool_destroy() is invoked or the program exits.
+* thpool_destroy() is invoked or the program exits. Jobs are run for as long as any can
+* be found; once they run out the thread spins for a little while and then parks until
+* new work is added or the pool ends.
 *
 * @param  thread        thread that will run this function
 * @return nothing
@@ -352,36 +617,38 @@ static void* thread_do(struct thread* thread_p){
 	thpool_p->num_threads_alive += 1;
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	while(threads_keepalive){
-
-		bsem_wait(thpool_p->jobqueue.has_jobs);
-
-		if (threads_keepalive){
+	/* Victims are picked from the pool's threads, so wait for all of them
+	 * (unless the pool is already being destroyed and they are leaving) */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	while (thpool_p->num_threads_alive != thpool_p->num_threads && threads_keepalive){
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+		sched_yield();
+		pthread_mutex_lock(&thpool_p->thcount_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+	current_thread = thread_p;
 
-			/* Read job from queue and execute it */
-			void (*func_buff)(void*);
-			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
+	int idle_rounds = 0;
+	while(threads_keepalive){
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
+		/* Read job and execute it */
+		job job_p;
+		int raced = 0;
+		if (!thread_find_job(thread_p, &job_p, &raced)){
+			if (raced || ++idle_rounds < IDLE_SPINS){
+				sched_yield();
+			} else {
+				thread_park(thpool_p);
+				idle_rounds = 0;
 			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-
+			continue;
 		}
+		idle_rounds = 0;
+		thpool_run_job(thpool_p, &job_p);
 	}
+	current_thread = NULL;
+
 	pthread_mutex_lock(&thpool_p->thcount_lock);
 	thpool_p->num_threads_alive --;
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
@@ -390,8 +657,105 @@ static void* thread_do(struct thread* thread_p){
 }
 
 
+/* Find a job for a thread of the pool
+ *
+ * With work stealing the thread's own deque comes first, then the deques of
+ * the other threads, then the queue of jobs added from outside the pool.
+ * With a shared queue, the deques only hold the jobs that overflowed it, so
+ * they come last.
+ *
+ * @param  thread        thread looking for work
+ * @param  job           filled with the job found
+ * @param  raced         set when a steal lost a race, so work may remain
+ * @return 1 if a job was found, 0 otherwise
+ */
+static int thread_find_job(struct thread* thread_p, struct job* job_p, int* raced){
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	if (thpool_p->scheduler == THPOOL_WORK_STEALING){
+		if (wsdeque_take(&thread_p->deque, job_p)
+		    || thread_steal_job(thpool_p, thread_p, &thread_p->seed, job_p, raced)){
+			return 1;
+		}
+	}
+	if (jobqueue_pull(&thpool_p->jobqueue, job_p)){
+		thpool_space_freed(thpool_p);
+		return 1;
+	}
+	return thpool_p->scheduler == THPOOL_SHARED_QUEUE
+	       && (wsdeque_take(&thread_p->deque, job_p)
+	           || thread_steal_job(thpool_p, thread_p, &thread_p->seed, job_p, raced));
+}
+
+
+/* Steal a job from the deque of a thread of a work-stealing pool
+ *
+ * Victims are tried in turn starting from a random one, so thieves spread
+ * out over the pool instead of all hitting the same deque.
+ *
+ * @param  thread        thread doing the stealing (NULL outside the pool)
+ * @param  seed          state of the thief's random victim choice
+ * @param  job           filled with the job stolen
+ * @param  raced         set when a steal lost a race, so work may remain
+ * @return 1 if a job was stolen, 0 if every deque was empty
+ */
+static int thread_steal_job(thpool_* thpool_p, struct thread* thread_p, unsigned int* seed,
+                            struct job* job_p, int* raced){
+
+	if (thpool_p->num_threads == 0){
+		return 0;
+	}
+
+	/* xorshift keeps the victim choice cheap and independent per thread */
+	if (*seed == 0){
+		*seed = 2463534242u;
+	}
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	int n;
+	int first = *seed % thpool_p->num_threads;
+	for (n=0; n < thpool_p->num_threads; n++){
+		thread* victim = thpool_p->threads[(first + n) % thpool_p->num_threads];
+		if (victim == thread_p){
+			continue;
+		}
+		int stolen = wsdeque_steal(&victim->deque, job_p);
+		if (stolen == -1){
+			*raced = 1;
+		} else if (stolen){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Parks an idle thread until work is added
+ *
+ * The waiter count is raised before jobs_queued is checked, while
+ * thpool_push() raises jobs_queued before it checks the waiter count.
+ * Both are sequentially consistent, so at least one side sees the other:
+ * either the thread finds the new job and stays awake, or the submitter
+ * moves the epoch on, which the thread read before checking and so cannot
+ * sleep through.
+ */
+static void thread_park(thpool_* thpool_p){
+	parking* parking_p = &thpool_p->parking;
+
+	atomic_fetch_add(&parking_p->waiters, 1);
+	unsigned int epoch = atomic_load(&parking_p->epoch);
+	if (threads_keepalive && atomic_load(&thpool_p->jobs_queued) <= 0){
+		parking_sleep(parking_p, epoch);
+	}
+	atomic_fetch_sub(&parking_p->waiters, 1);
+}
+
+
 /* Frees a thread  */
 static void thread_destroy (thread* thread_p){
+	wsdeque_destroy(&thread_p->deque);
 	free(thread_p);
 }
 
@@ -404,150 +768,376 @@ static void thread_destroy (thread* thread_p){
 
 /* Initialize queue */
 static int jobqueue_init(jobqueue* jobqueue_p){
-	jobqueue_p->len = 0;
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
+	jobqueue_p->slots = (struct jobslot*)malloc(JOBQUEUE_SIZE * sizeof(struct jobslot));
+	if (jobqueue_p->slots == NULL){
 		return -1;
 	}
 
-	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	bsem_init(jobqueue_p->has_jobs, 0);
-
+	size_t n;
+	for (n=0; n < JOBQUEUE_SIZE; n++){
+		atomic_init(&jobqueue_p->slots[n].seq, n);
+	}
+	atomic_init(&jobqueue_p->rear, 0);
+	atomic_init(&jobqueue_p->front, 0);
 	return 0;
 }
 
 
-/* Clear the queue */
-static void jobqueue_clear(jobqueue* jobqueue_p){
-
-	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+/* Add a copy of a job at the rear of the queue
+ * @return 0 on success, -1 if the queue is full
+ */
+static int jobqueue_push(jobqueue* jobqueue_p, const struct job* job_p){
+	size_t pos = atomic_load_explicit(&jobqueue_p->rear, memory_order_relaxed);
+	jobslot* slot;
+
+	for (;;){
+		slot = &jobqueue_p->slots[pos & (JOBQUEUE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0){
+			/* the slot is free: claim this push number */
+			if (atomic_compare_exchange_weak_explicit(&jobqueue_p->rear, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		} else if (diff < 0){
+			/* the slot still holds the job from a lap ago */
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&jobqueue_p->rear, memory_order_relaxed);
+		}
 	}
 
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
-	jobqueue_p->len = 0;
+	slot->job = *job_p;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+
+/* Get the job at the front of the queue (removes it from queue)
+ * @return 1 if a job was pulled, 0 if the queue is empty
+ */
+static int jobqueue_pull(jobqueue* jobqueue_p, struct job* job_p){
+	size_t pos = atomic_load_explicit(&jobqueue_p->front, memory_order_relaxed);
+	jobslot* slot;
+
+	for (;;){
+		slot = &jobqueue_p->slots[pos & (JOBQUEUE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0){
+			/* the slot holds a job: claim this pull number */
+			if (atomic_compare_exchange_weak_explicit(&jobqueue_p->front, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		} else if (diff < 0){
+			/* no job has been pushed into the slot yet */
+			return 0;
+		} else {
+			pos = atomic_load_explicit(&jobqueue_p->front, memory_order_relaxed);
+		}
+	}
 
+	*job_p = slot->job;
+	/* free the slot for the push one lap ahead */
+	atomic_store_explicit(&slot->seq, pos + JOBQUEUE_SIZE, memory_order_release);
+	return 1;
 }
 
 
-/* Add (allocated) job to queue
+/* Check if the slot for the next push still holds the job from a lap ago
+ * @return 1 if the queue is full, 0 otherwise
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+static int jobqueue_full(jobqueue* jobqueue_p){
+	size_t pos = atomic_load(&jobqueue_p->rear);
+	jobslot* slot = &jobqueue_p->slots[pos & (JOBQUEUE_SIZE - 1)];
+	return (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire) - (intptr_t)pos < 0;
+}
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	newjob->prev = NULL;
 
-	switch(jobqueue_p->len){
+/* Free all queue resources back to the system */
+static void jobqueue_destroy(jobqueue* jobqueue_p){
+	free(jobqueue_p->slots);
+}
+
 
-		case 0:  /* if no jobs in queue */
-					jobqueue_p->front = newjob;
-					jobqueue_p->rear  = newjob;
-					break;
 
-		default: /* if jobs in queue */
-					jobqueue_p->rear->prev = newjob;
-					jobqueue_p->rear = newjob;
 
-	}
-	jobqueue_p->len++;
 
-	bsem_post(jobqueue_p->has_jobs);
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+/* ============================== JOBS ============================== */
+
+
+/* Run a job */
+static void job_run(const struct job* job_p){
+	job_p->function(job_p->arg);
 }
 
 
-/* Get first job from queue(removes it from queue)
- * Notice: Caller MUST hold a mutex
+/* Copy a job into a deque slot that thieves may be reading */
+static void job_store_shared(struct job* slot_p, const struct job* job_p){
+	__atomic_store_n(&slot_p->function, job_p->function, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot_p->arg, job_p->arg, __ATOMIC_RELAXED);
+}
+
+
+/* Copy a job out of a deque slot that its owner may be overwriting */
+static void job_load_shared(struct job* job_p, const struct job* slot_p){
+	job_p->function = __atomic_load_n(&slot_p->function, __ATOMIC_RELAXED);
+	job_p->arg      = __atomic_load_n(&slot_p->arg, __ATOMIC_RELAXED);
+}
+
+
+
+
+
+/* ========================== PARALLEL FOR ========================== */
+
+
+/* Run ranges of a parallel for loop until none are left to claim
+ *
+ * Ranges are claimed from the loop's next index, so the calling thread and
+ * every helper job only ever run ranges of this loop. Each range counts
+ * itself off the loop once it has run, and thpool_parallel_for() waits for
+ * the count to reach zero.
  */
-static struct job* jobqueue_pull(jobqueue* jobqueue_p){
+static void pfor_run(pfor_loop* loop){
+	int begin;
+	while ((begin = atomic_fetch_add(&loop->next, loop->grain)) < loop->end){
+		int end = loop->end - begin > loop->grain ? begin + loop->grain : loop->end;
+		loop->function(begin, end, loop->ctx);
+		if (atomic_fetch_sub(&loop->remaining, end - begin) == end - begin){
+			/* last range: wake the caller if it went to sleep (see pfor_wait()) */
+			atomic_thread_fence(memory_order_seq_cst);
+			if (atomic_load(&loop->done.waiters) > 0){
+				parking_wake(&loop->done, 1);
+			}
+		}
+	}
+}
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
 
-	switch(jobqueue_p->len){
+/* Sleep until the last range of a parallel for loop has run
+ *
+ * The caller raises the waiter count before checking the ranges left, while
+ * the thread running the last range counts it off before checking the waiter
+ * count, so either the loop is seen to be over or the epoch read here moves on.
+ */
+static void pfor_wait(pfor_loop* loop){
+	atomic_fetch_add(&loop->done.waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	unsigned int epoch = atomic_load(&loop->done.epoch);
+	if (atomic_load(&loop->remaining) > 0){
+		parking_sleep(&loop->done, epoch);
+	}
+	atomic_fetch_sub(&loop->done.waiters, 1);
+}
 
-		case 0:  /* if no jobs in queue */
-		  			break;
 
-		case 1:  /* if one job in queue */
-					jobqueue_p->front = NULL;
-					jobqueue_p->rear  = NULL;
-					jobqueue_p->len = 0;
-					break;
+/* Job helping with a parallel for loop (which may be over by the time it runs) */
+static void pfor_help(void* arg){
+	pfor_loop* loop = (pfor_loop*)arg;
+	pfor_run(loop);
+	pfor_release(loop);
+}
 
-		default: /* if >1 jobs in queue */
-					jobqueue_p->front = job_p->prev;
-					jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(jobqueue_p->has_jobs);
 
+/* Drop a hold on a parallel for loop, freeing it after the last one */
+static void pfor_release(pfor_loop* loop){
+	if (atomic_fetch_sub(&loop->refs, 1) == 1){
+		parking_destroy(&loop->done);
+		free(loop);
 	}
+}
+
+
+
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-	return job_p;
+
+/* ======================== WORK-STEALING DEQUE ===================== */
+
+
+/* Allocate a circular array of the given capacity */
+static wsarray* wsarray_new(long size){
+	wsarray* array_p = (struct wsarray*)malloc(sizeof(struct wsarray) + size * sizeof(struct job));
+	if (array_p == NULL){
+		return NULL;
+	}
+	array_p->size = size;
+	array_p->prev = NULL;
+	return array_p;
 }
 
 
-/* Free all queue resources back to the system */
-static void jobqueue_destroy(jobqueue* jobqueue_p){
-	jobqueue_clear(jobqueue_p);
-	free(jobqueue_p->has_jobs);
+/* Initialize an empty deque */
+static int wsdeque_init(wsdeque* deque_p){
+	wsarray* array_p = wsarray_new(WSDEQUE_INITIAL_SIZE);
+	if (array_p == NULL){
+		return -1;
+	}
+	atomic_init(&deque_p->top, 0);
+	atomic_init(&deque_p->bottom, 0);
+	atomic_init(&deque_p->array, array_p);
+	return 0;
 }
 
 
+/* Add a copy of a job at the bottom of the deque
+ * Notice: only the thread owning the deque may push
+ *
+ * A full array is replaced by one twice its size. Thieves may still be
+ * reading the old array, so it is kept (linked from the new one) until the
+ * deque is destroyed.
+ */
+static void wsdeque_push(wsdeque* deque_p, const struct job* job_p){
+	long b = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&deque_p->top, memory_order_acquire);
+	wsarray* array_p = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+
+	if (b - t > array_p->size - 1){
+		wsarray* bigger = wsarray_new(array_p->size * 2);
+		if (bigger == NULL){
+			err("wsdeque_push(): Could not allocate memory to grow deque\n");
+			exit(1);
+		}
+		long i;
+		for (i=t; i < b; i++){
+			job moved;
+			job_load_shared(&moved, &array_p->buf[i & (array_p->size - 1)]);
+			job_store_shared(&bigger->buf[i & (bigger->size - 1)], &moved);
+		}
+		bigger->prev = array_p;
+		atomic_store_explicit(&deque_p->array, bigger, memory_order_release);
+		array_p = bigger;
+	}
 
+	job_store_shared(&array_p->buf[b & (array_p->size - 1)], job_p);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque_p->bottom, b + 1, memory_order_relaxed);
+}
 
 
-/* ======================== SYNCHRONISATION ========================= */
+/* Take the job at the bottom of the deque (the most recently pushed one)
+ * Notice: only the thread owning the deque may take
+ * @return 1 if a job was taken, 0 if the deque is empty
+ */
+static int wsdeque_take(wsdeque* deque_p, struct job* job_p){
+	long b = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed) - 1;
+	wsarray* array_p = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+	atomic_store_explicit(&deque_p->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&deque_p->top, memory_order_relaxed);
+
+	int taken = 0;
+	if (t <= b){
+		job_load_shared(job_p, &array_p->buf[b & (array_p->size - 1)]);
+		taken = 1;
+		if (t == b){
+			/* last job: race the thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&deque_p->top, &t, t + 1,
+					memory_order_seq_cst, memory_order_relaxed)){
+				taken = 0;
+			}
+			atomic_store_explicit(&deque_p->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&deque_p->bottom, b + 1, memory_order_relaxed);
+	}
+	return taken;
+}
 
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		err("bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
+/* Steal the job at the top of the deque (the least recently pushed one)
+ * @return 1 if a job was stolen, 0 if the deque is empty or -1 if another
+ *         thread took the job first
+ */
+static int wsdeque_steal(wsdeque* deque_p, struct job* job_p){
+	long t = atomic_load_explicit(&deque_p->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&deque_p->bottom, memory_order_acquire);
+
+	if (t >= b){
+		return 0;
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+	wsarray* array_p = atomic_load_explicit(&deque_p->array, memory_order_acquire);
+	job_load_shared(job_p, &array_p->buf[t & (array_p->size - 1)]);
+	if (!atomic_compare_exchange_strong_explicit(&deque_p->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed)){
+		return -1;
+	}
+	return 1;
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
+/* Free a deque and every array it has used */
+static void wsdeque_destroy(wsdeque* deque_p){
+	wsarray* array_p = atomic_load(&deque_p->array);
+	while (array_p != NULL){
+		wsarray* prev = array_p->prev;
+		free(array_p);
+		array_p = prev;
+	}
 }
 
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+
+
+
+/* ======================== SYNCHRONISATION ========================= */
+
+
+/* Init parking spot with no waiters */
+static void parking_init(parking* parking_p) {
+	atomic_init(&parking_p->epoch, 0);
+	atomic_init(&parking_p->waiters, 0);
+#if !defined(__linux__)
+	pthread_mutex_init(&(parking_p->mutex), NULL);
+	pthread_cond_init(&(parking_p->cond), NULL);
+#endif
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Sleep until the epoch moves on from the given one (may wake spuriously) */
+static void parking_sleep(parking* parking_p, unsigned int epoch) {
+#if defined(__linux__)
+	/* the kernel only puts us to sleep if the epoch is still the one read */
+	syscall(SYS_futex, (uint32_t*)&parking_p->epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&parking_p->mutex);
+	while (atomic_load(&parking_p->epoch) == epoch){
+		pthread_cond_wait(&parking_p->cond, &parking_p->mutex);
+	}
+	pthread_mutex_unlock(&parking_p->mutex);
+#endif
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Move the epoch on and wake one (or all) of the sleeping threads */
+static void parking_wake(parking* parking_p, int all) {
+#if defined(__linux__)
+	atomic_fetch_add(&parking_p->epoch, 1);
+	syscall(SYS_futex, (uint32_t*)&parking_p->epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&parking_p->mutex);
+	atomic_fetch_add(&parking_p->epoch, 1);
+	if (all){
+		pthread_cond_broadcast(&parking_p->cond);
+	} else {
+		pthread_cond_signal(&parking_p->cond);
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+	pthread_mutex_unlock(&parking_p->mutex);
+#endif
+}
+
+
+/* Free parking spot resources back to the system */
+static void parking_destroy(parking* parking_p) {
+#if defined(__linux__)
+	(void)parking_p;
+#else
+	pthread_mutex_destroy(&(parking_p->mutex));
+	pthread_cond_destroy(&(parking_p->cond));
+#endif
 }
@@ -17,6 +17,13 @@ extern "C" {
 typedef struct thpool_* threadpool;
 
 
+/* How a threadpool hands its jobs to its threads */
+typedef enum {
+	THPOOL_SHARED_QUEUE,   /* one lock-free ring that every thread pulls from */
+	THPOOL_WORK_STEALING   /* a deque per thread, idle threads steal from busy ones */
+} thpool_scheduler;
+
+
 /**
  * @brief  Initialize threadpool
  *
@@ -37,6 +44,30 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Initialize threadpool with a chosen scheduler
+ *
+ * Same as thpool_init(), but lets the caller pick how jobs are handed
+ * to the threads. With THPOOL_WORK_STEALING, jobs added by a thread of the
+ * pool go on that thread's own Chase-Lev deque and jobs added from outside
+ * go on a shared queue. Idle threads steal from the deque of a randomly
+ * chosen thread, so fine-grained jobs do not all contend on one queue.
+ *
+ * @example
+ *
+ *    ..
+ *    threadpool thpool;
+ *    thpool = thpool_init_with_scheduler(4, THPOOL_WORK_STEALING);
+ *    ..
+ *
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  scheduler     how jobs are handed to the threads
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_with_scheduler(int num_threads, thpool_scheduler scheduler);
+
+
 /**
  * @brief Add work to the job queue
  *
@@ -59,6 +90,9 @@ threadpool thpool_init(int num_threads);
  *       ..
  *    }
  *
+ * If the job queue is full, a caller outside the pool sleeps until there is
+ * room; jobs added from within the pool's own threads never wait.
+ *
  * @param  threadpool    threadpool to which the work will be added
  * @param  function_p    pointer to function to add as work
  * @param  arg_p         pointer to an argument
@@ -67,6 +101,44 @@ threadpool thpool_init(int num_threads);
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief Run a loop body over an index range on the threadpool
+ *
+ * Splits [begin, end) into ranges of at most grain indices and calls
+ * function_p(range_begin, range_end, ctx) for each of them, with the ranges
+ * claimed in turn by the calling thread and by helper jobs on the pool.
+ * Returns once the whole range has been run.
+ *
+ * The calling thread only ever runs ranges of its own loop, never other
+ * queued jobs, so parallel loops can be nested and called from jobs of the
+ * same pool, even while other jobs wait for the caller to finish.
+ *
+ * @example
+ *
+ *    void square(int begin, int end, void* ctx){
+ *       int* values = ctx;
+ *       for (int i = begin; i < end; i++) values[i] *= values[i];
+ *    }
+ *
+ *    int main() {
+ *       ..
+ *       thpool_parallel_for(thpool, 0, n, 1024, square, values);
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool to run the loop on
+ * @param  begin         first index of the range
+ * @param  end           index after the last one of the range
+ * @param  grain         largest range run as one call (0 or less picks one
+ *                       that gives every thread a few ranges)
+ * @param  function_p    loop body, called once per range
+ * @param  ctx           argument passed to every call of the loop body
+ * @return nothing
+ */
+void thpool_parallel_for(threadpool, int begin, int end, int grain,
+                         void (*function_p)(int begin, int end, void* ctx), void* ctx);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  *